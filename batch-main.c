@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 // default mainloop timeout 1s
 #ifndef LOOP_WAIT_SEC
@@ -39,7 +40,8 @@ static httpRqtActionT sampleCallback(httpRqtT *httpRqt)
     assert(httpRqt->magic == MAGIC_HTTP_RQT);
     reqCtxT *ctxRqt = (reqCtxT *)httpRqt->userData;
 
-    if (httpRqt->status < 0)  goto OnErrorExit;
+    // cancelled, libcurl error or http error (ie: 503 from a saturated upstream)
+    if (httpRqt->status < 100 || httpRqt->status >= 400)  goto OnErrorExit;
 
     double seconds = (double)httpRqt->msTime / 1000.0;
     //fprintf(stdout, "\n[body]=%s", httpRqt->body);
@@ -52,11 +54,23 @@ static httpRqtActionT sampleCallback(httpRqtT *httpRqt)
     return HTTP_HANDLE_FREE;
 
 OnErrorExit:
-    fprintf(stderr, "[request-error] status=%ld length=%ld", httpRqt->status, httpRqt->length);
+    fprintf(stderr, "[request-error] status=%ld length=%ld url=%s\n", httpRqt->status, httpRqt->length, ctxRqt->url);
+    free (ctxRqt->url);
     count--;
     return HTTP_HANDLE_FREE;
 }
 
+// static stub resolver (-d host=addr), checks dns cache without any name server
+static char *stubHost = NULL, *stubAddr = NULL;
+static int stubResolver(const char *host, httpDnsAddrT *addrs, int max, long *ttl, void *ctx)
+{
+    if (strcasecmp(host, stubHost) || max < 1) return -1;
+    addrs[0].family = strchr(stubAddr, ':') ? AF_INET6 : AF_INET;
+    snprintf(addrs[0].addr, sizeof(addrs[0].addr), "%s", stubAddr);
+    *ttl = 60;
+    return 1;
+}
+
 typedef enum
 {
     MOD_SYNC,
@@ -69,17 +83,20 @@ int main(int argc, char *argv[])
     const char *url;
     struct timespec startTime, stopTime;
     httpPoolT *httpPool = NULL;
-    int err, start, verbose = 0;
+    int start, verbose = 0;
     runModT runmode = MOD_DEFAULT;
     httpCallbacksT *mainLoopCbs = NULL;
     long uid = 0;
     int timeout=30;
     char *filename=NULL;
     FILE *fileFD=NULL;
+    char *route=NULL;
+    char *limiter=NULL;
+    double rate=0;
 
     if (argc <= 1)
     {
-        fprintf(stderr, "[syntax-error] batch-client [-t timeout(30)] -f filename -vvv] \n");
+        fprintf(stderr, "[syntax-error] batch-client [-t timeout(30)] [-u origin=unixpath] [-l aimd|gradient] [-r rqt/s] [-d host=addr] -f filename -vvv] \n");
         goto OnErrorExit;
     }
 
@@ -99,6 +116,30 @@ int main(int argc, char *argv[])
 
         if (!strcasecmp(argv[start], "-s")) runmode = MOD_SYNC;
 
+        // benchmark unix socket against tcp loopback (ie: -u http://127.0.0.1:8181=/tmp/sidecar.sock)
+        if (!strcasecmp(argv[start], "-u")) {
+            start ++;
+            route= argv[start];
+        };
+
+        // per host adaptive concurrency, compare with unbounded run against a saturating upstream
+        if (!strcasecmp(argv[start], "-l")) {
+            start ++;
+            limiter= argv[start];
+        };
+
+        // pace requests per host instead of bursting the whole file (third party API quotas)
+        if (!strcasecmp(argv[start], "-r")) {
+            start ++;
+            rate= atof(argv[start]);
+        };
+
+        // resolve host through dns cache stub resolver (ie: -d upstream.invalid=127.0.0.1)
+        if (!strcasecmp(argv[start], "-d")) {
+            start ++;
+            stubHost= argv[start];
+        };
+
         if (!strcasecmp(argv[start], "-f")) {
             start ++;
             filename= argv[start];
@@ -147,6 +188,41 @@ int main(int argc, char *argv[])
                 goto OnErrorExit;
             }
         }
+
+        // origin=path, route origin to a unix socket
+        char *path = route ? strchr(route, '=') : NULL;
+        if (route) {
+            if (!path) {
+                fprintf (stderr, "invalid unix route (-u origin=path)\n");
+                goto OnErrorExit;
+            }
+            *path++ = '\0';
+            if (httpPoolSetUnixRoute(httpPool, route, path)) goto OnErrorExit;
+        }
+
+        if (limiter) {
+            httpLimitOptsT limitOpts= {
+                .mode= strcasecmp(limiter, "gradient") ? HTTP_LIMIT_AIMD : HTTP_LIMIT_GRADIENT,
+            };
+            if (httpPoolSetLimiter(httpPool, &limitOpts)) goto OnErrorExit;
+        }
+
+        if (rate > 0 && httpPoolSetRateLimit(httpPool, NULL, rate, 0)) goto OnErrorExit;
+
+        // first lookup is a miss, prefetch stub host and collect it before sending
+        if (stubHost) {
+            char prefetch[256];
+            const char *urls[] = {prefetch};
+            stubAddr = strchr(stubHost, '=');
+            if (!stubAddr) {
+                fprintf (stderr, "invalid stub resolver (-d host=addr)\n");
+                goto OnErrorExit;
+            }
+            *stubAddr++ = '\0';
+            snprintf(prefetch, sizeof(prefetch), "http://%s/", stubHost);
+            if (httpPoolSetDnsCache(httpPool, stubResolver, NULL) || httpPoolDnsPrefetch(httpPool, urls, 1) != 1) goto OnErrorExit;
+            (void)httpPool->callback->evtRunLoop(httpPool, LOOP_WAIT_SEC);
+        }
     }
 
     // launch all or request in asynchronous mode.
@@ -173,8 +249,8 @@ int main(int argc, char *argv[])
             fprintf(stderr, "[request-sent] reqId=%d %s\n", ctxRqt->uid, ctxRqt->url);
 
         // basic get with no header, token, query or options
-        err = httpSendGet(httpPool, ctxRqt->url, &curlOpts, NULL /*token*/, sampleCallback, (void *)ctxRqt);
-        if (!err)
+        httpRqtIdT rqtId = httpSendGet(httpPool, ctxRqt->url, &curlOpts, NULL /*token*/, sampleCallback, (void *)ctxRqt);
+        if (rqtId)
             count++;
         else
         {
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Benchmark C++ coroutine layer against raw callbacks. Each round sends every url from input
+ * file concurrently, once with httpSendGet+callback and once with co_await whenAll.
+ *  syntax: ./build/coro-client -f batch-test.in [-r rounds] [-v]
+ */
+
+#include "http-client.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <time.h>
+
+static int count = 0; // pending raw requests
+static double bytes = 0;
+
+static uint64_t nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static httpRqtActionT rawCallback(httpRqtT *httpRqt)
+{
+    if (httpRqt->status >= 100) bytes += httpRqt->length;
+    count--;
+    return HTTP_HANDLE_FREE;
+}
+
+static uint64_t runRaw(httpPoolT *httpPool, const std::vector<std::string> &urls)
+{
+    uint64_t start = nowUs();
+    for (const std::string &url : urls) {
+        if (httpSendGet(httpPool, url.c_str(), NULL, NULL, rawCallback, NULL)) count++;
+    }
+    while (count) httpPool->callback->evtRunLoop(httpPool, 1);
+    return nowUs() - start;
+}
+
+static httpclient::Task<long> fetch(httpclient::Pool &pool, const char *url)
+{
+    httpclient::Response rsp = co_await pool.get(url);
+    if (rsp.status() >= 100) bytes += rsp.body().size();
+    co_return rsp.status();
+}
+
+static httpclient::Task<size_t> fetchAll(httpclient::Pool &pool, const std::vector<std::string> &urls)
+{
+    std::vector<httpclient::Task<long>> tasks;
+    tasks.reserve(urls.size());
+    for (const std::string &url : urls) tasks.push_back(fetch(pool, url.c_str()));
+
+    std::vector<long> status = co_await httpclient::whenAll(std::move(tasks));
+    co_return status.size();
+}
+
+static uint64_t runCoro(httpclient::Pool &pool, const std::vector<std::string> &urls)
+{
+    uint64_t start = nowUs();
+    pool.run(fetchAll(pool, urls));
+    return nowUs() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    int rounds = 5, verbose = 0;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (!strcmp(argv[idx], "-f") && idx + 1 < argc) filename = argv[++idx];
+        else if (!strcmp(argv[idx], "-r") && idx + 1 < argc) rounds = atoi(argv[++idx]);
+        else if (!strcmp(argv[idx], "-v")) verbose++;
+    }
+
+    FILE *fileFD = filename ? fopen(filename, "r") : NULL;
+    if (!fileFD) {
+        fprintf(stderr, "[syntax-error] coro-client -f filename [-r rounds] [-v]\n");
+        return 1;
+    }
+
+    std::vector<std::string> urls;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, fileFD)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len) urls.emplace_back(line);
+    }
+    free(line);
+    fclose(fileFD);
+
+    httpCallbacksT *mainLoopCbs = glueGetCbs();
+    void *evtLoop = mainLoopCbs->evtMainLoop();
+    httpPoolT *httpPool = evtLoop ? httpCreatePool(evtLoop, mainLoopCbs, verbose) : NULL;
+    if (!httpPool) {
+        fprintf(stderr, "[fail-create-pool] libcurl multi pool\n");
+        return 1;
+    }
+    httpclient::Pool pool(httpPool);
+
+    // first round warms connections, alternate modes to share network conditions
+    uint64_t rawUs = 0, coroUs = 0;
+    runRaw(httpPool, urls);
+    for (int round = 0; round < rounds; round++) {
+        rawUs += runRaw(httpPool, urls);
+        coroUs += runCoro(pool, urls);
+    }
+
+    double requests = (double)rounds * urls.size();
+    fprintf(stdout, "urls=%zu rounds=%d raw=%.1fus/request coro=%.1fus/request total=%.2fKB\n", urls.size(), rounds, rawUs / requests,
+            coroUs / requests, bytes / 1024.0);
+    return 0;
+}
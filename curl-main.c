@@ -62,7 +62,7 @@ int main(int argc, char *argv[])
     const char *url;
     struct timespec startTime, stopTime;
     httpPoolT *httpPool = NULL;
-    int err, start, verbose = 0;
+    int start, verbose = 0;
     runModT runmode = MOD_DEFAULT;
     httpCallbacksT *mainLoopCbs = NULL;
     long uid = 0;
@@ -145,8 +145,8 @@ int main(int argc, char *argv[])
             fprintf(stderr, "[request-sent] reqId=%d %s\n", ctxRqt->uid, ctxRqt->url);
 
         // basic get with no header, token, query or options
-        err = httpSendGet(httpPool, ctxRqt->url, &curlOpts, NULL /*token*/, sampleCallback, (void *)ctxRqt);
-        if (!err)
+        httpRqtIdT rqtId = httpSendGet(httpPool, ctxRqt->url, &curlOpts, NULL /*token*/, sampleCallback, (void *)ctxRqt);
+        if (rqtId)
             count++;
         else
         {
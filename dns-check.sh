@@ -0,0 +1,40 @@
+#!/bin/bash
+# Offline dns cache check, no name server involved.
+# Requests go to a '.invalid' host that only the batch-client stub resolver knows (-d host=addr),
+# any request reaching libcurl own resolver fails and shows as request-error.
+
+DIRNAME=`dirname $0`
+COUNT=${1:-50}
+PORT=${2:-8184}
+HOST=upstream.invalid
+TMPDIR=`mktemp -d`
+
+if ! test -x $DIRNAME/build/batch-client; then
+    echo "syntax: $0 [count(50)] [port(8184)] (build first with 'make MAIN_LOOP=epoll|systemd|libuv')"
+    exit 1
+fi
+
+cat > $TMPDIR/upstream.py <<'PYEOF'
+import http.server, socketserver, sys
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    def log_message(self, *args): pass
+    def do_GET(self):
+        self.send_response(200); self.send_header('Content-Length', '3'); self.end_headers(); self.wfile.write(b'ok\n')
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+Server(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()
+PYEOF
+
+python3 $TMPDIR/upstream.py $PORT &
+SERVER=$!
+trap "kill $SERVER; rm -rf $TMPDIR" EXIT
+sleep 0.5
+
+for IDX in `seq 1 $COUNT`; do echo "http://$HOST:$PORT/rqt-$IDX"; done > $TMPDIR/urls
+
+$DIRNAME/build/batch-client -vv -d $HOST=127.0.0.1 -f $TMPDIR/urls 2> $TMPDIR/log
+ERRORS=`grep -c "request-error" $TMPDIR/log`
+RESOLVED=`grep -c "httpDns: host=$HOST" $TMPDIR/log`
+echo "host=$HOST requests=$COUNT errors=$ERRORS resolved=$RESOLVED"
+test $ERRORS -eq 0 -a $RESOLVED -gt 0
@@ -63,6 +63,7 @@ typedef struct {
     int socksPool;
     int timerPool;
     int mainPool;
+    int wakeFd;
 } epollEvtLoopT;
 
 //  (void *source, int sock, uint32_t revents, void *ctx)
@@ -144,10 +145,12 @@ static int glueSetTimerCB(httpPoolT *httpPool, long timeout) {
     struct epoll_event *source = (struct epoll_event *)httpPool->evtTimer;
     epollEvtLoopT *evtLoop= (epollEvtLoopT*)httpPool->evtLoop;
 
-    // if time is negative just kill it
+    // if time is negative just disarm it (timer is reused on next call)
     if (timeout < 0) {
-        if (source->data.fd) close(source->data.fd);
-        free (source);
+        if (source) {
+            struct itimerspec delay = {0};
+            timerfd_settime(source->data.fd, 0, &delay, NULL);
+        }
     } else {
 
         // not timer yet, create one and add it to timerpool fd list
@@ -188,6 +191,19 @@ OnErrorExit:
     return -1;
 }
 
+// pool eventfd written by worker threads, watched directly from main pool
+static int glueSetWakeupCB(httpPoolT *httpPool, int fd) {
+    epollEvtLoopT *evtLoop= (epollEvtLoopT*)httpPool->evtLoop;
+    struct epoll_event source;
+
+    source.events = EPOLLIN;
+    source.data.fd = fd;
+    int err = epoll_ctl(evtLoop->mainPool, EPOLL_CTL_ADD, fd, &source);
+    if (err < 0) return -1;
+    evtLoop->wakeFd = fd;
+    return 0;
+}
+
 // run mainloop and wait for asynchronous events
 static int processWaitingSockets (httpPoolT *httpPool, long seconds) {
     epollEvtLoopT *evtPool = (epollEvtLoopT*)httpPool->evtLoop;
@@ -257,6 +273,13 @@ static int glueRunLoop(httpPoolT *httpPool, long seconds) {
             if (err) goto OnErrorExit;
             continue;
         }
+
+        // worker threads results (dns lookups)
+        if (events[idx].data.fd == evtPool->wakeFd) {
+            err= httpOnWakeupCB (httpPool);
+            if (err) goto OnErrorExit;
+            continue;
+        }
         fprintf (stderr, "[glueRunLoop]  FD is not a libcurl handle fd=%d\n", events[idx].data.fd);
   }
   return 0;
@@ -273,7 +296,8 @@ static void *gluenewEventLoop() {
     source.events= EPOLLIN | EPOLLOUT;
 
     // epoll is pretty basic, we create a subpool per callback (timer+socket)
-    epollEvtLoopT *evtPool= malloc (sizeof(evtPool));
+    epollEvtLoopT *evtPool= malloc (sizeof(epollEvtLoopT));
+    evtPool->wakeFd = -1;
 
     // NOTE: main eventloop handle is probably already created by your application
     evtPool->mainPool = epoll_create1(EPOLL_CLOEXEC);
@@ -302,6 +326,7 @@ OnErrorExit:
 static httpCallbacksT systemdCbs = {
     .multiTimer = glueSetTimerCB,
     .multiSocket = glueSetSocketCB,
+    .evtWakeup = glueSetWakeupCB,
     .evtMainLoop = gluenewEventLoop,
     .evtRunLoop = glueRunLoop,
 };
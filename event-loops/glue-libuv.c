@@ -122,6 +122,30 @@ static void glueOnTimerCB(uv_timer_t *evtTimer)
     (void)httpOnTimerCB(httpPool);
 }
 
+// pool eventfd written by worker threads
+static void glueOnWakeupCB(uv_poll_t *evtWakeup, int status, int events)
+{
+    httpPoolT *httpPool = (httpPoolT *)evtWakeup->data;
+    (void)httpOnWakeupCB(httpPool);
+}
+
+static int glueSetWakeupCB(httpPoolT *httpPool, int fd)
+{
+    uv_poll_t *evtWakeup = malloc(sizeof(uv_poll_t));
+    if (!evtWakeup) return -1;
+
+    evtWakeup->data = httpPool;
+    if (uv_poll_init(httpPool->evtLoop, evtWakeup, fd)) {
+        free(evtWakeup);
+        return -1;
+    }
+    if (uv_poll_start(evtWakeup, UV_READABLE, glueOnWakeupCB)) {
+        uv_close((uv_handle_t *)evtWakeup, (uv_close_cb)free);
+        return -1;
+    }
+    return 0;
+}
+
 // call httpOnTimerCB after xx milliseconds
 static int glueSetTimerCB(httpPoolT *httpPool, long timeout)
 {
@@ -164,6 +188,7 @@ static void *glueNewEventLoop()
 static httpCallbacksT libUvCbs = {
     .multiTimer = glueSetTimerCB,
     .multiSocket = glueSetSocketCB,
+    .evtWakeup = glueSetWakeupCB,
     .evtMainLoop = glueNewEventLoop,
     .evtRunLoop = glueRunLoop,
 };
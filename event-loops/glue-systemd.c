@@ -99,6 +99,22 @@ OnErrorExit:
     return -1;
 }
 
+// pool eventfd written by worker threads
+static int glueOnWakeupCB (sd_event_source *source, int fd, uint32_t revents, void *ctx)
+{
+    httpPoolT *httpPool= (httpPoolT*)ctx;
+    return httpOnWakeupCB(httpPool);
+}
+
+static int glueSetWakeupCB (httpPoolT *httpPool, int fd)
+{
+    sd_event_source *source;
+    int err = sd_event_add_io((sd_event *)httpPool->evtLoop, &source, fd, EPOLLIN, glueOnWakeupCB, httpPool);
+    if (err < 0) return -1;
+    sd_event_source_set_description(source, "curl-wakeup");
+    return 0;
+}
+
 // map libuv ontimer with multi version
 static int glueOnTimerCB(sd_event_source *timer, uint64_t usec, void *ctx)
 {
@@ -132,6 +148,7 @@ static int glueSetTimerCB(httpPoolT *httpPool, long timeout)
         { // new timer
             sd_event_add_time(evtLoop, &evtTimer, CLOCK_MONOTONIC, usec + timeout * 1000, 0, glueOnTimerCB, httpPool);
             sd_event_source_set_description(evtTimer, "curl-timer");
+            httpPool->evtTimer = evtTimer;
         }
         else
         {
@@ -169,6 +186,7 @@ OnErrorExit:
 static httpCallbacksT systemdCbs = {
     .multiTimer = glueSetTimerCB,
     .multiSocket = glueSetSocketCB,
+    .evtWakeup = glueSetWakeupCB,
     .evtMainLoop = gluenewEventLoop,
     .evtRunLoop = glueRunLoop,
 };
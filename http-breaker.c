@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Per host circuit breaker. Closed circuit keeps a window of request outcomes (libcurl errors,
+ * timeouts included, and 5xx are failures), when failure rate reaches threshold the circuit
+ * opens and requests to host fail within send call with HTTP_STATUS_CIRCUIT_OPEN, before any
+ * easy handle setup. Once open delay expires the circuit is half-open: a few probe requests go
+ * through, enough successes close it, a failure opens it again for a doubled delay. Probes
+ * are either application requests or a pool GET on a configured health path sent when delay
+ * expires, an idle host then recovers without waiting for traffic.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BREAKER_DFLT_PERCENT 50
+#define BREAKER_DFLT_SAMPLES 10
+#define BREAKER_DFLT_WINDOW 20
+#define BREAKER_MAX_WINDOW 32
+#define BREAKER_DFLT_OPEN_MS 5000
+#define BREAKER_MAX_SHIFT 4 // open delay grows up to 16x
+#define BREAKER_PROBE_TIMEOUT_MS 5000
+
+struct httpBreakerS
+{
+    httpBreakerOptsT opts;
+    char *probePath;
+};
+
+static int breakerFailRate(httpHostT *host)
+{
+    if (!host->breakerSamples) return 0;
+    return __builtin_popcount(host->breakerOutcomes) * 100 / host->breakerSamples;
+}
+
+static void breakerReset(httpHostT *host)
+{
+    host->breakerOutcomes = 0;
+    host->breakerSamples = 0;
+    host->probeOk = 0;
+}
+
+static httpRqtActionT breakerProbeDoneCB(httpRqtT *httpRqt)
+{
+    // outcome already fed circuit from httpBreakerDone
+    return HTTP_HANDLE_FREE;
+}
+
+static void breakerProbeCB(httpPoolT *httpPool, void *ctx)
+{
+    httpHostT *host = (httpHostT *)ctx;
+    httpBreakerT *breaker = httpPool->breaker;
+    host->breakerTimer = NULL;
+    if (!breaker || !breaker->probePath || host->breakerState != HTTP_BREAKER_OPEN) return;
+
+    httpOptsT opts = {
+        .nocache = 1,
+        .timeoutMs = BREAKER_PROBE_TIMEOUT_MS,
+        .priority = HTTP_PRIO_HIGH,
+    };
+    char url[strlen(host->origin) + strlen(breaker->probePath) + 2];
+    sprintf(url, "%s%s%s", host->origin, *breaker->probePath == '/' ? "" : "/", breaker->probePath);
+    if (!httpSendGet(httpPool, url, &opts, NULL, breakerProbeDoneCB, NULL))
+        fprintf(stderr, "[breaker-probe-fail] fail to launch url=%s (breakerProbeCB)\n", url);
+}
+
+static void breakerTrip(httpPoolT *httpPool, httpHostT *host, const char *reason)
+{
+    httpBreakerT *breaker = httpPool->breaker;
+    int shift = host->breakerTrips < BREAKER_MAX_SHIFT ? host->breakerTrips : BREAKER_MAX_SHIFT;
+    long delay = breaker->opts.openMs << shift;
+
+    fprintf(stderr, "[breaker-open] origin=%s reason=%s failRate=%d%% delay=%ldms (breakerTrip)\n", host->origin, reason, breakerFailRate(host), delay);
+    host->breakerState = HTTP_BREAKER_OPEN;
+    host->breakerUntil = httpNowMs() + delay;
+    host->breakerTrips++;
+    httpPool->stats.breakerTrips++;
+    breakerReset(host);
+
+    if (breaker->probePath && !host->breakerTimer) host->breakerTimer = httpTimerAdd(httpPool, delay, breakerProbeCB, host);
+}
+
+// request is about to be sent, return 1 when circuit is open and request should fail now
+int httpBreakerAdmit(httpPoolT *httpPool, httpRqtT *httpRqt, httpHostT *host)
+{
+    httpBreakerT *breaker = httpPool->breaker;
+    if (!breaker || !host || host->breakerState == HTTP_BREAKER_CLOSED) return 0;
+
+    if (host->breakerState == HTTP_BREAKER_OPEN) {
+        if (httpNowMs() < host->breakerUntil) goto OnFastFail;
+        host->breakerState = HTTP_BREAKER_HALF_OPEN;
+        breakerReset(host);
+        if (httpPool->verbose) fprintf(stderr, "-- httpBreaker: half-open origin=%s\n", host->origin);
+    }
+
+    // half-open, only a few probes go to host
+    if (host->probeRunning >= breaker->opts.probes) goto OnFastFail;
+    host->probeRunning++;
+    httpRqt->breakerProbe = 1;
+    return 0;
+
+OnFastFail:
+    httpPool->stats.breakerFastFails++;
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpBreaker: fast-fail url=%s\n", httpRqt->url);
+    return 1;
+}
+
+// request is over, feed host circuit
+void httpBreakerDone(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpBreakerT *breaker = httpPool->breaker;
+    httpHostT *host = httpRqt->host;
+    int probe = httpRqt->breakerProbe;
+
+    if (!host) return;
+    httpRqt->breakerProbe = 0;
+    if (probe) host->probeRunning--;
+
+    // cancelled or never sent, says nothing about host health
+    if (!breaker || httpRqt->status <= 0) return;
+    int failed = (httpRqt->status < 100 || httpRqt->status >= 500);
+
+    switch (host->breakerState) {
+        case HTTP_BREAKER_CLOSED:
+            host->breakerOutcomes = (host->breakerOutcomes << 1) | failed;
+            if (breaker->opts.window < BREAKER_MAX_WINDOW) host->breakerOutcomes &= (1U << breaker->opts.window) - 1;
+            if (host->breakerSamples < breaker->opts.window) host->breakerSamples++;
+            if (failed && host->breakerSamples >= breaker->opts.minSamples && breakerFailRate(host) >= breaker->opts.failPercent) breakerTrip(httpPool, host, "error-rate");
+            break;
+
+        case HTTP_BREAKER_HALF_OPEN:
+            if (!probe) break; // sent before circuit opened
+            if (failed) {
+                breakerTrip(httpPool, host, "probe-failed");
+            } else if (++host->probeOk >= breaker->opts.probeSuccess) {
+                host->breakerState = HTTP_BREAKER_CLOSED;
+                host->breakerTrips = 0;
+                breakerReset(host);
+                fprintf(stderr, "[breaker-closed] origin=%s recovered (httpBreakerDone)\n", host->origin);
+            }
+            break;
+
+        default:
+            break; // open, late answers from before trip
+    }
+}
+
+// retries to an open circuit would fail immediately
+int httpBreakerIsOpen(httpPoolT *httpPool, httpHostT *host)
+{
+    return httpPool && httpPool->breaker && host && host->breakerState == HTTP_BREAKER_OPEN;
+}
+
+int httpPoolSetBreaker(httpPoolT *httpPool, const httpBreakerOptsT *opts)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpBreakerT *breaker = httpPool->breaker;
+
+    // disabled, every circuit closes
+    if (!opts) {
+        httpPool->breaker = NULL;
+        if (breaker) free(breaker->probePath);
+        free(breaker);
+        for (size_t idx = 0; idx < httpPool->hostBuckets; idx++) {
+            for (httpHostT *host = httpPool->hosts[idx]; host; host = host->next) {
+                host->breakerState = HTTP_BREAKER_CLOSED;
+                host->breakerTrips = 0;
+                breakerReset(host);
+            }
+        }
+        return 0;
+    }
+    if (opts->failPercent < 0 || opts->failPercent > 100 || opts->minSamples < 0 || opts->window < 0 || opts->window > BREAKER_MAX_WINDOW) goto OnErrorExit;
+    if (opts->openMs < 0 || opts->probes < 0 || opts->probeSuccess < 0) goto OnErrorExit;
+
+    if (!breaker && !(breaker = calloc(1, sizeof(httpBreakerT)))) goto OnErrorExit;
+    free(breaker->probePath);
+    breaker->probePath = NULL;
+    breaker->opts = *opts;
+    if (opts->probePath && !(breaker->probePath = strdup(opts->probePath))) goto OnErrorExit;
+    breaker->opts.probePath = breaker->probePath;
+
+    if (!breaker->opts.failPercent) breaker->opts.failPercent = BREAKER_DFLT_PERCENT;
+    if (!breaker->opts.window) breaker->opts.window = BREAKER_DFLT_WINDOW;
+    if (!breaker->opts.minSamples) breaker->opts.minSamples = BREAKER_DFLT_SAMPLES;
+    if (breaker->opts.minSamples > breaker->opts.window) breaker->opts.minSamples = breaker->opts.window;
+    if (!breaker->opts.openMs) breaker->opts.openMs = BREAKER_DFLT_OPEN_MS;
+    if (!breaker->opts.probes) breaker->opts.probes = 1;
+    if (!breaker->opts.probeSuccess) breaker->opts.probeSuccess = 1;
+    httpPool->breaker = breaker;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[breaker-invalid] invalid thresholds or out of memory (httpPoolSetBreaker)\n");
+    if (breaker && !httpPool->breaker) free(breaker);
+    return -1;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Pool memory budget. Body bytes are charged to the pool when httpBodyCB accepts them and
+ * released when the request is freed. Over budget, httpBodyCB returns CURL_WRITEFUNC_PAUSE
+ * and transfer waits in a FIFO until consumers free memory, then it is resumed with
+ * curl_easy_pause from a pool timer job (never from within libcurl callbacks). A transfer is
+ * only paused when some other non paused request holds memory, at least one transfer always
+ * progresses and paused transfers cannot deadlock each other.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static void budgetLink(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpRqt->pauseNext = NULL;
+    httpRqt->pausePrev = httpPool->pausedTail;
+    if (httpPool->pausedTail) httpPool->pausedTail->pauseNext = httpRqt;
+    else httpPool->pausedHead = httpRqt;
+    httpPool->pausedTail = httpRqt;
+    httpPool->memPaused += httpRqt->memCharged;
+    httpPool->stats.pausedNow++;
+}
+
+static int budgetUnlink(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (httpRqt->pausePrev) httpRqt->pausePrev->pauseNext = httpRqt->pauseNext;
+    else if (httpPool->pausedHead == httpRqt) httpPool->pausedHead = httpRqt->pauseNext;
+    else return 0; // not linked
+
+    if (httpRqt->pauseNext) httpRqt->pauseNext->pausePrev = httpRqt->pausePrev;
+    else httpPool->pausedTail = httpRqt->pausePrev;
+    httpRqt->pauseNext = httpRqt->pausePrev = NULL;
+    httpPool->memPaused -= httpRqt->memCharged;
+    httpPool->stats.pausedNow--;
+    return 1;
+}
+
+static void budgetResume(httpPoolT *httpPool, void *ctx)
+{
+    httpPool->budgetTimer = NULL;
+
+    // a resumed transfer may pause again (tail of queue), visit each paused request once
+    for (uint64_t count = httpPool->stats.pausedNow; count && httpPool->pausedHead; count--) {
+        if (httpPool->memBudget && httpPool->memUsed >= httpPool->memBudget) break;
+
+        httpRqtT *httpRqt = httpPool->pausedHead;
+        budgetUnlink(httpPool, httpRqt);
+        httpRqt->paused = 0;
+        httpPool->stats.resumes++;
+        if (httpPool->verbose > 1) fprintf(stderr, "-- httpBudget: resume used=%lu url=%s\n", httpPool->memUsed, httpRqt->url);
+        curl_easy_pause(httpRqt->easy, CURLPAUSE_CONT);
+    }
+}
+
+static void budgetSchedule(httpPoolT *httpPool)
+{
+    if (!httpPool->pausedHead || httpPool->budgetTimer) return;
+    httpPool->budgetTimer = httpTimerAdd(httpPool, 0, budgetResume, NULL);
+}
+
+// charge accepted body bytes, return 1 when transfer should pause
+int httpBudgetCharge(httpRqtT *httpRqt, size_t size)
+{
+    httpPoolT *httpPool = httpRqt->pool;
+    if (!httpPool) return 0;
+
+    // waiting makes sense only when somebody else will release memory
+    if (httpPool->memBudget && httpPool->memUsed + size > httpPool->memBudget) {
+        size_t others = httpPool->memUsed - httpPool->memPaused - httpRqt->memCharged;
+        if (others > 0) {
+            httpRqt->paused = 1;
+            budgetLink(httpPool, httpRqt);
+            httpPool->stats.pauses++;
+            if (httpPool->verbose > 1) fprintf(stderr, "-- httpBudget: pause used=%lu url=%s\n", httpPool->memUsed, httpRqt->url);
+            return 1;
+        }
+    }
+
+    httpRqt->memCharged += size;
+    httpPool->memUsed += size;
+    if (httpPool->memUsed > httpPool->stats.bufferPeak) httpPool->stats.bufferPeak = httpPool->memUsed;
+    return 0;
+}
+
+// transfer is over (done, cancelled, hedge loser), request does not wait for budget anymore
+void httpBudgetDrop(httpRqtT *httpRqt)
+{
+    if (httpRqt->pool) budgetUnlink(httpRqt->pool, httpRqt);
+}
+
+// buffered body was released, wake up paused transfers
+void httpBudgetRelease(httpRqtT *httpRqt)
+{
+    httpPoolT *httpPool = httpRqt->pool;
+    if (!httpPool) return;
+
+    httpBudgetDrop(httpRqt);
+    httpPool->memUsed -= httpRqt->memCharged;
+    httpRqt->memCharged = 0;
+    budgetSchedule(httpPool);
+}
+
+int httpPoolSetMemBudget(httpPoolT *httpPool, size_t maxBytes)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpPool->memBudget = maxBytes;
+    budgetSchedule(httpPool);
+    return 0;
+}
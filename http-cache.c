@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * In-memory HTTP response cache attached to a multi pool.
+ *  - GET only, keyed by url + request headers listed within response 'Vary'
+ *  - honour Cache-Control max-age/no-store/no-cache, Expires, Date and Age
+ *  - stale entries are revalidated with If-None-Match/If-Modified-Since, 304 is served from cache
+ *  - entries are evicted in LRU order when byte budget (headers+body) is exceeded
+ *  - optional persistent tier (http-diskcache.c) is written through and promoted from on miss
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define MAGIC_HTTP_CACHE 719364
+#define CACHE_DFLT_BUCKETS 256
+#define CACHE_VARY_MAX_LEN 512
+
+struct httpCacheEntryS
+{
+    httpCacheEntryT *hnext; // hash bucket chain
+    httpCacheEntryT *prev;  // lru list (head is most recent)
+    httpCacheEntryT *next;
+    uint64_t hash;
+    int refcount;
+    int linked;
+    long status;
+    time_t expires;
+    size_t size;
+    char *url;
+    char *varyNames;  // response 'Vary' header (NULL when none)
+    char *varyKey;    // request header values matching varyNames
+    char *etag;
+    char *lastmod;
+    char *ctype;
+    char *headers;
+    long hdrLen;
+    char *body;
+    long bodyLen;
+    char data[]; // every strings are stored within entry allocation
+};
+
+struct httpCacheS
+{
+    int magic;
+    int verbose;
+    size_t count;
+    size_t buckets;
+    httpCacheEntryT **table;
+    httpCacheEntryT *lruHead;
+    httpCacheEntryT *lruTail;
+    httpCacheStatsT stats;
+    httpDiskCacheT *disk;
+};
+
+static httpCacheEntryT *cacheInsert(httpCacheT *cache, const httpCacheRecT *rec);
+
+static uint64_t cacheHash(const char *url)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *url; url++) hash = (hash ^ (unsigned char)*url) * 1099511628211ULL;
+    return hash;
+}
+
+static void cacheLruUnlink(httpCacheT *cache, httpCacheEntryT *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->lruHead = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->lruTail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cacheLruPush(httpCacheT *cache, httpCacheEntryT *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->lruHead;
+    if (cache->lruHead) cache->lruHead->prev = entry;
+    cache->lruHead = entry;
+    if (!cache->lruTail) cache->lruTail = entry;
+}
+
+void httpCacheRelease(httpCacheEntryT *entry)
+{
+    if (--entry->refcount == 0 && !entry->linked) free(entry);
+}
+
+// remove entry from cache, memory is released when last pending request drops it
+static void cacheUnlink(httpCacheT *cache, httpCacheEntryT *entry)
+{
+    httpCacheEntryT **slot = &cache->table[entry->hash & (cache->buckets - 1)];
+    while (*slot != entry) slot = &(*slot)->hnext;
+    *slot = entry->hnext;
+
+    cacheLruUnlink(cache, entry);
+    cache->count--;
+    cache->stats.bytes -= entry->size;
+    entry->linked = 0;
+    if (!entry->refcount) free(entry);
+}
+
+static void cacheResize(httpCacheT *cache)
+{
+    size_t buckets = cache->buckets * 2;
+    httpCacheEntryT **table = calloc(buckets, sizeof(httpCacheEntryT *));
+    if (!table) return; // keep old table, chains get longer
+
+    for (size_t idx = 0; idx < cache->buckets; idx++) {
+        httpCacheEntryT *entry, *next;
+        for (entry = cache->table[idx]; entry; entry = next) {
+            next = entry->hnext;
+            entry->hnext = table[entry->hash & (buckets - 1)];
+            table[entry->hash & (buckets - 1)] = entry;
+        }
+    }
+    free(cache->table);
+    cache->table = table;
+    cache->buckets = buckets;
+}
+
+// build request 'vary' key from response vary header names
+static int cacheVaryKey(const char *varyNames, const struct curl_slist *rqtHeaders, char *key, size_t maxlen)
+{
+    size_t index = 0;
+    key[0] = '\0';
+    if (!varyNames) return 0;
+
+    for (const char *name = varyNames; *name;) {
+        char tag[DFLT_HEADER_MAX_LEN];
+        size_t len, count = strcspn(name, ", ");
+
+        if (count && count < sizeof(tag)) {
+            memcpy(tag, name, count);
+            tag[count] = '\0';
+            const char *value = httpSlistLookup(rqtHeaders, tag, &len);
+            int done = snprintf(&key[index], maxlen - index, "%s=%.*s\n", tag, value ? (int)len : 0, value ? value : "");
+            if (done < 0 || index + done >= maxlen) return -1;
+            index += done;
+        }
+        name += count;
+        name += strspn(name, ", ");
+    }
+    return 0;
+}
+
+// return a referenced entry matching url+vary or NULL
+httpCacheEntryT *httpCacheLookup(httpCacheT *cache, const char *url, const struct curl_slist *rqtHeaders)
+{
+    assert(cache->magic == MAGIC_HTTP_CACHE);
+    uint64_t hash = cacheHash(url);
+    char varyKey[CACHE_VARY_MAX_LEN];
+
+    for (httpCacheEntryT *entry = cache->table[hash & (cache->buckets - 1)]; entry; entry = entry->hnext) {
+        if (entry->hash != hash || strcmp(entry->url, url)) continue;
+        if (cacheVaryKey(entry->varyNames, rqtHeaders, varyKey, sizeof(varyKey))) continue;
+        if (strcmp(entry->varyKey, varyKey)) continue;
+
+        cacheLruUnlink(cache, entry);
+        cacheLruPush(cache, entry);
+        entry->refcount++;
+        if (httpCacheIsFresh(entry)) cache->stats.hits++;
+        return entry;
+    }
+
+    // memory miss, promote matching persistent record if any
+    if (cache->disk) {
+        httpCacheRecT rec;
+        size_t cursor = 0;
+        while (httpDiskCacheFind(cache->disk, hash, &cursor, &rec)) {
+            if (strcmp(rec.url, url)) continue;
+            if (cacheVaryKey(rec.varyNames, rqtHeaders, varyKey, sizeof(varyKey))) continue;
+            if (strcmp(rec.varyKey, varyKey)) continue;
+
+            httpCacheEntryT *entry = cacheInsert(cache, &rec);
+            if (!entry) break;
+            entry->refcount++;
+            cache->stats.diskHits++;
+            if (httpCacheIsFresh(entry)) cache->stats.hits++;
+            return entry;
+        }
+    }
+    cache->stats.misses++;
+    return NULL;
+}
+
+int httpCacheIsFresh(httpCacheEntryT *entry)
+{
+    return entry->linked && time(NULL) < entry->expires;
+}
+
+// add conditional headers to revalidate a stale entry
+struct curl_slist *httpCacheValidators(httpCacheEntryT *entry, struct curl_slist *rqtHeaders)
+{
+    char header[DFLT_HEADER_MAX_LEN];
+
+    if (entry->etag) {
+        snprintf(header, sizeof(header), "If-None-Match: %s", entry->etag);
+        rqtHeaders = curl_slist_append(rqtHeaders, header);
+    }
+    if (entry->lastmod) {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", entry->lastmod);
+        rqtHeaders = curl_slist_append(rqtHeaders, header);
+    }
+    return rqtHeaders;
+}
+
+// fill request handle with a private copy of cached response
+int httpCacheServe(httpCacheEntryT *entry, httpRqtT *httpRqt)
+{
+    if (httpRqtReserve(&httpRqt->body, &httpRqt->bodySize, entry->bodyLen)) goto OnErrorExit;
+    if (httpRqtReserve(&httpRqt->headers, &httpRqt->hdrSize, entry->hdrLen)) goto OnErrorExit;
+
+    memcpy(httpRqt->body, entry->body, entry->bodyLen + 1);
+    memcpy(httpRqt->headers, entry->headers, entry->hdrLen + 1);
+    httpRqt->bodyLen = entry->bodyLen;
+    httpRqt->hdrLen = entry->hdrLen;
+    httpRqt->length = entry->bodyLen;
+    httpRqt->status = entry->status;
+    httpRqt->ctype = entry->ctype; // entry is referenced until httpRqt is freed
+    httpRqt->cacheServed = 1;
+    httpJsonReset(httpRqt);
+    return httpHdrIndexParse(httpRqt);
+
+OnErrorExit:
+    return -1;
+}
+
+// extract response lifetime in seconds, return -1 when response should not be stored
+static long cacheLifetime(httpRqtT *httpRqt, time_t now)
+{
+    const char *value;
+    long maxage = -1;
+    time_t date = now;
+
+    value = httpRqtHeader(httpRqt, "cache-control");
+    if (value) {
+        if (strcasestr(value, "no-store")) return -1;
+        if (strcasestr(value, "no-cache")) maxage = 0;
+        else {
+            const char *age = strcasestr(value, "max-age=");
+            if (age) maxage = strtol(age + strlen("max-age="), NULL, 10);
+        }
+    }
+
+    value = httpRqtHeader(httpRqt, "date");
+    if (value) {
+        date = curl_getdate(value, NULL);
+        if (date < 0) date = now;
+    }
+
+    if (maxage < 0) {
+        value = httpRqtHeader(httpRqt, "expires");
+        if (value) {
+            time_t expires = curl_getdate(value, NULL);
+            maxage = (expires > date) ? expires - date : 0;
+        }
+    }
+    if (maxage < 0) maxage = 0; // no explicit freshness, only usable through revalidation
+
+    value = httpRqtHeader(httpRqt, "age");
+    if (value) maxage -= strtol(value, NULL, 10);
+
+    return (maxage > 0) ? maxage : 0;
+}
+
+// copy a string field into entry data area
+static char *cacheCopyField(const char *value, size_t len, char **cursor)
+{
+    if (!value) return NULL;
+
+    char *copy = *cursor;
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+    *cursor += len + 1;
+    return copy;
+}
+
+// evict least recently used entries until we fit within budget
+static void cacheEvict(httpCacheT *cache)
+{
+    while (cache->stats.bytes > cache->stats.maxBytes && cache->lruTail) {
+        cacheUnlink(cache, cache->lruTail);
+        cache->stats.evicted++;
+    }
+}
+
+// insert a response within memory tier, replacing any previous version
+static httpCacheEntryT *cacheInsert(httpCacheT *cache, const httpCacheRecT *rec)
+{
+    size_t urlLen = strlen(rec->url);
+    size_t varyLen = rec->varyNames ? strlen(rec->varyNames) : 0;
+    size_t keyLen = strlen(rec->varyKey);
+    size_t etagLen = rec->etag ? strlen(rec->etag) : 0;
+    size_t lastmodLen = rec->lastmod ? strlen(rec->lastmod) : 0;
+    size_t ctypeLen = rec->ctype ? strlen(rec->ctype) : 0;
+    size_t size = sizeof(httpCacheEntryT) + urlLen + varyLen + keyLen + etagLen + lastmodLen + ctypeLen + 6 + rec->hdrLen + 1 + rec->bodyLen + 1;
+    if (size > cache->stats.maxBytes) return NULL;
+
+    httpCacheEntryT *entry = calloc(1, size);
+    if (!entry) return NULL;
+
+    char *cursor = entry->data;
+    entry->url = cacheCopyField(rec->url, urlLen, &cursor);
+    entry->varyNames = cacheCopyField(rec->varyNames, varyLen, &cursor);
+    entry->varyKey = cacheCopyField(rec->varyKey, keyLen, &cursor);
+    entry->etag = cacheCopyField(rec->etag, etagLen, &cursor);
+    entry->lastmod = cacheCopyField(rec->lastmod, lastmodLen, &cursor);
+    entry->ctype = cacheCopyField(rec->ctype, ctypeLen, &cursor);
+    entry->headers = cacheCopyField(rec->headers ? rec->headers : "", rec->hdrLen, &cursor);
+    entry->hdrLen = rec->hdrLen;
+    entry->body = cacheCopyField(rec->body ? rec->body : "", rec->bodyLen, &cursor);
+    entry->bodyLen = rec->bodyLen;
+
+    entry->status = rec->status;
+    entry->expires = rec->expires;
+    entry->hash = cacheHash(entry->url);
+    entry->size = size;
+    entry->linked = 1;
+
+    // replace any previous version of the same response
+    for (httpCacheEntryT *old = cache->table[entry->hash & (cache->buckets - 1)], *next; old; old = next) {
+        next = old->hnext;
+        if (old->hash == entry->hash && !strcmp(old->url, entry->url) && !strcmp(old->varyKey, entry->varyKey))
+            cacheUnlink(cache, old);
+    }
+
+    if (cache->count >= cache->buckets * 2) cacheResize(cache);
+    httpCacheEntryT **slot = &cache->table[entry->hash & (cache->buckets - 1)];
+    entry->hnext = *slot;
+    *slot = entry;
+    cacheLruPush(cache, entry);
+    cache->count++;
+    cache->stats.bytes += size;
+
+    cacheEvict(cache);
+    return entry;
+}
+
+// copy a response header value into a NUL terminated buffer
+static const char *cacheHeaderCopy(httpRqtT *httpRqt, const char *name, char *buffer, size_t maxlen)
+{
+    const char *value = httpRqtHeader(httpRqt, name);
+    if (!value || strlen(value) >= maxlen) return NULL;
+
+    strcpy(buffer, value);
+    return buffer;
+}
+
+static void cacheStore(httpCacheT *cache, httpRqtT *httpRqt, long lifetime)
+{
+    char varyKey[CACHE_VARY_MAX_LEN];
+    char varyNames[DFLT_HEADER_MAX_LEN], etag[DFLT_HEADER_MAX_LEN], lastmod[DFLT_HEADER_MAX_LEN];
+    httpCacheRecT rec = {
+        .url = httpRqt->url,
+        .varyKey = varyKey,
+        .ctype = httpRqt->ctype,
+        .headers = httpRqt->headers,
+        .hdrLen = httpRqt->hdrLen,
+        .body = httpRqt->body,
+        .bodyLen = httpRqt->bodyLen,
+        .status = httpRqt->status,
+        .expires = time(NULL) + lifetime,
+    };
+
+    rec.varyNames = cacheHeaderCopy(httpRqt, "Vary", varyNames, sizeof(varyNames));
+    if (rec.varyNames && strchr(rec.varyNames, '*')) return;
+    if (cacheVaryKey(rec.varyNames, httpRqt->rqtHeaders, varyKey, sizeof(varyKey))) return;
+
+    // a response without freshness or validator is useless
+    rec.etag = cacheHeaderCopy(httpRqt, "ETag", etag, sizeof(etag));
+    rec.lastmod = cacheHeaderCopy(httpRqt, "Last-Modified", lastmod, sizeof(lastmod));
+    if (!lifetime && !rec.etag && !rec.lastmod) return;
+
+    httpCacheEntryT *entry = cacheInsert(cache, &rec);
+    if (!entry) return;
+    cache->stats.stored++;
+
+    // write through persistent tier
+    if (cache->disk) httpDiskCacheStore(cache->disk, entry->hash, &rec);
+
+    if (cache->verbose > 1)
+        fprintf(stderr, "-- httpCache: stored url=%s lifetime=%lds size=%ld\n", entry->url, lifetime, entry->size);
+}
+
+// called on request completion before user callback
+void httpCacheOnDone(httpCacheT *cache, httpRqtT *httpRqt)
+{
+    assert(cache->magic == MAGIC_HTTP_CACHE);
+    httpCacheEntryT *entry = httpRqt->cacheEntry;
+    time_t now = time(NULL);
+
+    // cache hit already served, nothing to do (easy may be kept by a recycled slot)
+    if (httpRqt->cacheServed) return;
+
+    // revalidated: refresh lifetime and serve cached response
+    if (entry && httpRqt->status == 304) {
+        long lifetime = cacheLifetime(httpRqt, now);
+        if (entry->linked && lifetime >= 0) {
+            entry->expires = now + lifetime;
+            if (cache->disk) httpDiskCacheTouch(cache->disk, entry->hash, entry->url, entry->varyKey, entry->expires);
+        }
+        if (httpCacheServe(entry, httpRqt)) return;
+        cache->stats.revalidated++;
+        if (cache->verbose > 1)
+            fprintf(stderr, "-- httpCache: revalidated url=%s\n", entry->url);
+        return;
+    }
+
+    // only GET (no POST) with final cacheable status are stored
+    if (!httpRqt->easy || !httpRqt->url) return;
+    char *method = NULL;
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_EFFECTIVE_METHOD, &method);
+    if (method && strcmp(method, "GET")) return;
+
+    switch (httpRqt->status) {
+        case 200: case 203: case 300: case 301: case 404: case 410:
+            break;
+        default:
+            return;
+    }
+
+    long lifetime = cacheLifetime(httpRqt, now);
+    if (lifetime < 0) {
+        if (entry && entry->linked) cacheUnlink(cache, entry);
+        return;
+    }
+    cacheStore(cache, httpRqt, lifetime);
+}
+
+int httpPoolCacheStats(httpPoolT *httpPool, httpCacheStatsT *stats)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (!httpPool->cache) goto OnErrorExit;
+
+    *stats = httpPool->cache->stats;
+    stats->entries = httpPool->cache->count;
+    if (httpPool->cache->disk) httpDiskCacheStats(httpPool->cache->disk, stats);
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+// attach an in-memory response cache to the pool
+int httpPoolSetCache(httpPoolT *httpPool, size_t maxBytes)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpCacheT *cache;
+
+    // new budget applies now, a lower one drops entries over it
+    if (httpPool->cache) {
+        httpPool->cache->stats.maxBytes = maxBytes;
+        cacheEvict(httpPool->cache);
+        return 0;
+    }
+
+    cache = calloc(1, sizeof(httpCacheT));
+    if (!cache) goto OnErrorExit;
+    cache->magic = MAGIC_HTTP_CACHE;
+    cache->verbose = httpPool->verbose;
+    cache->buckets = CACHE_DFLT_BUCKETS;
+    cache->table = calloc(cache->buckets, sizeof(httpCacheEntryT *));
+    if (!cache->table) goto OnErrorExit;
+    cache->stats.maxBytes = maxBytes;
+
+    httpPool->cache = cache;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[cache-create-fail] hoops fail to allocate response cache (httpPoolSetCache)\n");
+    free(cache);
+    return -1;
+}
+
+// add a persistent tier behind pool memory cache
+int httpPoolSetDiskCache(httpPoolT *httpPool, const char *path, size_t maxBytes)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+
+    if (!httpPool->cache) {
+        fprintf(stderr, "[diskcache-no-cache] httpPoolSetCache should be called first (httpPoolSetDiskCache)\n");
+        goto OnErrorExit;
+    }
+    if (httpPool->cache->disk) {
+        fprintf(stderr, "[diskcache-exist] pool already has a persistent cache (httpPoolSetDiskCache)\n");
+        goto OnErrorExit;
+    }
+
+    httpPool->cache->disk = httpDiskCacheOpen(path, maxBytes, httpPool->verbose);
+    if (!httpPool->cache->disk) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
@@ -10,6 +10,7 @@
 #define _GNU_SOURCE
 
 #include "http-client.h"
+#include "http-private.h"
 
 #include <errno.h>
 #include <curl/curl.h>
@@ -19,6 +20,7 @@
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <stdarg.h>
 
 // callback might be called as many time as needed to transfert all data
 static size_t httpBodyCB(void *data, size_t blkSize, size_t blkCount, void *ctx)
@@ -34,14 +36,33 @@ static size_t httpBodyCB(void *data, size_t blkSize, size_t blkCount, void *ctx)
     if (!data)
         return 0;
 
-    httpRqt->body = realloc(httpRqt->body, httpRqt->bodyLen + size + 1);
-    if (!httpRqt->body)
+    // limit applies to decoded size, a small compressed payload may expand a lot
+    if (httpRqt->maxsz && httpRqt->bodyLen + (long)size > httpRqt->maxsz) {
+        httpRqt->tooLarge = 1;
+        return 0;
+    }
+
+    // streamed body is never buffered
+    if (httpRqt->sink) {
+        if (httpRqt->sink(httpRqt, data, size) != size) return 0;
+        httpRqt->bodyLen += size;
+        return size;
+    }
+
+    // pool memory budget exhausted, libcurl keeps data until transfer is resumed
+    if (httpBudgetCharge(httpRqt, size))
+        return CURL_WRITEFUNC_PAUSE;
+
+    if (httpRqtReserve(&httpRqt->body, &httpRqt->bodySize, httpRqt->bodyLen + size))
         return 0; // hoops
 
     memcpy(&(httpRqt->body[httpRqt->bodyLen]), data, size);
     httpRqt->bodyLen += size;
     httpRqt->body[httpRqt->bodyLen] = 0;
 
+    // parsing overlaps with network, tokens are ready when transfer completes
+    if (httpRqt->json) httpJsonFeed(httpRqt);
+
     return size;
 }
 
@@ -59,17 +80,290 @@ static size_t httpHeadersCB(void *data, size_t blkSize, size_t blkCount, void *c
     if (!data)
         return 0;
 
-    httpRqt->headers = realloc(httpRqt->headers, httpRqt->hdrLen + size + 1);
-    if (!httpRqt->headers)
+    if (httpRqtReserve(&httpRqt->headers, &httpRqt->hdrSize, httpRqt->hdrLen + size))
         return 0; // hoops
 
     memcpy(&(httpRqt->headers[httpRqt->hdrLen]), data, size);
     httpRqt->hdrLen += size;
     httpRqt->headers[httpRqt->hdrLen] = 0;
 
+    // one line per call, index final response headers as they arrive
+    if (httpHdrIndexAdd(httpRqt, data, size)) return 0;
+
     return size;
 }
 
+// search a 'name: value' header within a request header list
+const char *httpSlistLookup(const struct curl_slist *list, const char *name, size_t *len)
+{
+    size_t nameLen = strlen(name);
+
+    for (; list; list = list->next) {
+        if (strncasecmp(list->data, name, nameLen) || list->data[nameLen] != ':') continue;
+        const char *value = list->data + nameLen + 1;
+        while (*value == ' ') value++;
+        if (len) *len = strlen(value);
+        return value;
+    }
+    return NULL;
+}
+
+// release request handle and every attached resources
+void httpRqtFree(httpRqtT *httpRqt)
+{
+    assert(httpRqt->magic == MAGIC_HTTP_RQT);
+
+    if (httpRqt->freeCtx && httpRqt->userData) httpRqt->freeCtx(httpRqt->userData);
+    if (httpRqt->cacheEntry) httpCacheRelease(httpRqt->cacheEntry);
+    if (httpRqt->rqtHeaders) curl_slist_free_all(httpRqt->rqtHeaders);
+    if (httpRqt->resolve) curl_slist_free_all(httpRqt->resolve);
+    httpJsonFree(httpRqt->json);
+    httpBudgetRelease(httpRqt);
+
+    // pool requests go back to slab with their buffers and easy handle
+    if (httpRqt->pool) {
+        httpRqtRecycle(httpRqt);
+        return;
+    }
+
+    if (httpRqt->easy) curl_easy_cleanup(httpRqt->easy);
+    httpHdrIndexFree(httpRqt->hdrIndex);
+    httpScratchFree(httpRqt);
+    free(httpRqt->headers);
+    free(httpRqt->body);
+    free(httpRqt);
+}
+
+// error message replaces response body (body buffer is reused)
+static void rqtMessage(httpRqtT *httpRqt, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    httpRqt->bodyLen = httpRqt->length = 0;
+    if (len < 0 || httpRqtReserve(&httpRqt->body, &httpRqt->bodySize, len)) {
+        if (httpRqt->body) httpRqt->body[0] = '\0';
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(httpRqt->body, len + 1, format, args);
+    va_end(args);
+    httpRqt->length = len;
+}
+
+// pending asynchronous requests are reachable from their id until completion
+static void rqtLink(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpRqt->activePrev = NULL;
+    httpRqt->activeNext = httpPool->active;
+    if (httpPool->active) httpPool->active->activePrev = httpRqt;
+    httpPool->active = httpRqt;
+}
+
+static void rqtUnlink(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (httpRqt->activePrev) httpRqt->activePrev->activeNext = httpRqt->activeNext;
+    else if (httpPool->active == httpRqt) httpPool->active = httpRqt->activeNext;
+    else return; // not linked
+
+    if (httpRqt->activeNext) httpRqt->activeNext->activePrev = httpRqt->activePrev;
+    httpRqt->activeNext = httpRqt->activePrev = NULL;
+}
+
+static httpRqtT *rqtFind(httpPoolT *httpPool, httpRqtIdT rqtId)
+{
+    for (httpRqtT *httpRqt = httpPool->active; httpRqt; httpRqt = httpRqt->activeNext) {
+        if (httpRqt->id == rqtId) return httpRqt;
+    }
+    return NULL;
+}
+
+// set attempt timeout from request deadline, return -1 when deadline is over
+int httpRqtDeadline(httpRqtT *httpRqt)
+{
+    if (!httpRqt->deadline) return 0;
+
+    uint64_t now = httpNowMs();
+    if (now >= httpRqt->deadline) return -1;
+    curl_easy_setopt(httpRqt->easy, CURLOPT_TIMEOUT_MS, (long)(httpRqt->deadline - now));
+    return 0;
+}
+
+static void rqtWaitExpired(httpPoolT *httpPool, void *ctx)
+{
+    httpRqtT *httpRqt = (httpRqtT *)ctx;
+    httpRqt->waitTimer = NULL;
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpRqt: deadline over while queued url=%s\n", httpRqt->url);
+    httpRqtComplete(httpPool, httpRqt, CURLE_OPERATION_TIMEDOUT);
+}
+
+// request waits in a lane, limiter or rate queue, its deadline still applies
+void httpRqtWait(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (!httpRqt->deadline || httpRqt->waitTimer) return;
+
+    uint64_t now = httpNowMs();
+    uint64_t delay = httpRqt->deadline > now ? httpRqt->deadline - now : 0;
+    httpRqt->waitTimer = httpTimerAdd(httpPool, delay ? delay : 1, rqtWaitExpired, httpRqt);
+}
+
+// request left its queues, either to network or to completion
+void httpRqtWaitDone(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (!httpRqt->waitTimer) return;
+    httpTimerCancel(httpPool, httpRqt->waitTimer);
+    httpRqt->waitTimer = NULL;
+}
+
+// admitted request goes to libcurl, an expired deadline completes it without network round-trip
+int httpRqtStart(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpRqtWaitDone(httpPool, httpRqt);
+    if (httpRqtDeadline(httpRqt)) {
+        httpRqtComplete(httpPool, httpRqt, CURLE_OPERATION_TIMEDOUT);
+        return 0;
+    }
+
+    httpLimitStart(httpRqt);
+    CURLMcode mstatus = curl_multi_add_handle(httpPool->multi, httpRqt->easy);
+    if (mstatus != CURLM_OK) {
+        fprintf(stderr, "[curl-multi-fail] curl curl_multi_add_handle fail url=%s error=%s (httpRqtStart)\n", httpRqt->url, curl_multi_strerror(mstatus));
+        return -1;
+    }
+    httpHedgeArm(httpPool, httpRqt, httpRqt->hedgePct);
+    return 0;
+}
+
+// common completion for synchronous, asynchronous and cached responses
+static void httpRqtDone(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (httpPool) {
+        rqtUnlink(httpPool, httpRqt);
+        httpRqtWaitDone(httpPool, httpRqt);
+        httpSchedRelease(httpPool, httpRqt);
+        httpLimitRelease(httpPool, httpRqt);
+        httpRateRelease(httpPool, httpRqt);
+        httpBudgetDrop(httpRqt);
+        if (httpRqt->host) httpRqt->host->running--;
+    }
+
+    // compute request elapsed time
+    clock_gettime(CLOCK_MONOTONIC, &httpRqt->stopTime);
+    httpRqt->msTime = (httpRqt->stopTime.tv_nsec - httpRqt->startTime.tv_nsec) / 1000000 + (httpRqt->stopTime.tv_sec - httpRqt->startTime.tv_sec) * 1000;
+    if (httpPool) httpUpstreamDone(httpPool, httpRqt);
+    if (httpPool) httpBreakerDone(httpPool, httpRqt);
+
+    // store cacheable responses or substitute 304 with cached response
+    if (httpPool && httpPool->cache && !httpRqt->sink) httpCacheOnDone(httpPool->cache, httpRqt);
+
+    // slow callbacks run on executor thread, request comes back to httpRqtSettle from pool timer
+    if (httpRqt->offload && httpPool && !httpExecPush(httpPool, httpRqt)) return;
+
+    // call request callback (note: callback should free httpRqt)
+    httpRqtSettle(httpRqt, httpRqt->callback(httpRqt));
+}
+
+// callback returned, release transfer resources and request itself on HTTP_HANDLE_FREE
+void httpRqtSettle(httpRqtT *httpRqt, httpRqtActionT status)
+{
+    // transfer is over, easy handle and request headers are not needed anymore (freed request recycles its easy handle)
+    if (httpRqt->easy && status != HTTP_HANDLE_FREE) {
+        curl_easy_cleanup(httpRqt->easy);
+        httpRqt->easy = NULL;
+    }
+    if (httpRqt->rqtHeaders) {
+        curl_slist_free_all(httpRqt->rqtHeaders);
+        httpRqt->rqtHeaders = NULL;
+    }
+    if (httpRqt->resolve) {
+        curl_slist_free_all(httpRqt->resolve);
+        httpRqt->resolve = NULL;
+    }
+
+    if (status == HTTP_HANDLE_FREE) httpRqtFree(httpRqt);
+}
+
+// fill request status from libcurl and complete it
+void httpRqtComplete(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus)
+{
+    if (estatus == CURLE_WRITE_ERROR && httpRqt->tooLarge) estatus = CURLE_FILESIZE_EXCEEDED;
+
+    // check request status
+    if (estatus != CURLE_OK)  {
+        char * url;
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_EFFECTIVE_URL, &url);
+
+        rqtMessage(httpRqt, "[request-error] status=%d error='%s' url=[%s]", estatus, curl_easy_strerror(estatus), url);
+        if (httpPool && httpPool->verbose)  fprintf(stderr, "\n--- %s\n", httpRqt->body);
+        httpRqt->status=estatus;
+    } else {
+        curl_off_t totalTime = 0;
+        httpRqt->wireBytes=0;
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_SIZE_DOWNLOAD_T, &httpRqt->wireBytes);
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE,  &httpRqt->status);
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_CONTENT_TYPE,  &httpRqt->ctype);
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_TOTAL_TIME_T,  &totalTime);
+        httpRqt->length = httpRqt->bodyLen;
+        if (httpPool) {
+            httpPool->stats.wireBytes += httpRqt->wireBytes;
+            httpPool->stats.decodedBytes += httpRqt->bodyLen;
+        }
+
+        // resumed download, application sees the full document
+        if (httpRqt->status == 206 && !httpSlistLookup(httpRqt->rqtHeaders, "Range", NULL)) {
+            httpRqt->status = 200;
+        }
+        if (httpRqt->host && httpRqt->status < 500) httpHostLatency(httpRqt->host, totalTime / 1000);
+        if (httpPool) {
+            httpSockLearn(httpPool, httpRqt);
+            httpConnOnDone(httpPool, httpRqt);
+        }
+    }
+
+    httpRqtDone(httpPool, httpRqt);
+}
+
+int httpCancel(httpPoolT *httpPool, httpRqtIdT rqtId)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpRqtT *httpRqt = rqtFind(httpPool, rqtId);
+    if (!httpRqt) goto OnErrorExit;
+
+    // children first, list changes on each cancel
+    for (httpRqtT *child = httpPool->active; child;) {
+        if (child->parent != rqtId) {
+            child = child->activeNext;
+            continue;
+        }
+        httpCancel(httpPool, child->id);
+        child = httpPool->active;
+    }
+
+    // request is either waiting for a retry or running within multi
+    httpHedgeCancel(httpPool, httpRqt);
+    if (httpRqt->retryTimer) {
+        httpTimerCancel(httpPool, httpRqt->retryTimer);
+        httpRqt->retryTimer = NULL;
+    } else {
+        curl_multi_remove_handle(httpPool->multi, httpRqt->easy);
+    }
+
+    rqtMessage(httpRqt, "[request-cancelled] url=[%s]", httpRqt->url);
+    if (httpPool->verbose)  fprintf(stderr, "\n--- %s\n", httpRqt->body);
+    httpRqt->status = HTTP_STATUS_CANCELLED;
+    httpRqt->ctype = NULL;
+    httpPool->stats.cancelled++;
+
+    httpRqtDone(httpPool, httpRqt);
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
 static void multiCheckInfoCB(httpPoolT *httpPool)
 {
     int count;
@@ -92,41 +386,23 @@ static void multiCheckInfoCB(httpPoolT *httpPool)
             // retreive httpRqt from private easy handle
             curl_easy_getinfo(easy, CURLINFO_PRIVATE, &httpRqt);
 
-            // check request status
-            if (estatus != CURLE_OK)  {
-                char * url, *message;
-                int len;
-                curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
-
-                len=asprintf (&message, "[request-error] status=%d error='%s' url=[%s]", estatus, curl_easy_strerror(estatus), url);
-                if (httpPool->verbose)  fprintf(stderr, "\n--- %s\n", message);
-                httpRqt->status=estatus;
-                httpRqt->body= message;
-                httpRqt->length=strlen(message);
-            } else {
-                httpRqt->length=0;
-                curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &httpRqt->length);
-                curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE,  &httpRqt->status);
-                curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE,  &httpRqt->ctype);
-            }
-
-            // do some clean up
+            // do some clean up (easy is released after callback as it owns ctype)
             curl_multi_remove_handle(httpPool->multi, easy);
-            curl_easy_cleanup(easy);
-
-            // compute request elapsed time
-            clock_gettime(CLOCK_MONOTONIC, &httpRqt->stopTime);
-            httpRqt->msTime = (httpRqt->stopTime.tv_nsec - httpRqt->startTime.tv_nsec) / 1000000 + (httpRqt->stopTime.tv_sec - httpRqt->startTime.tv_sec) * 1000;
-
-            // call request callback (note: callback should free httpRqt)
-            httpRqtActionT status = httpRqt->callback(httpRqt);
-            if (status == HTTP_HANDLE_FREE)
-            {
-                if (httpRqt->freeCtx && httpRqt->userData) httpRqt->freeCtx(httpRqt->userData);
-                if (httpRqt->body) free (httpRqt->body);
-                free(httpRqt);
+
+            // hedged pair completes when a winner is known or both failed
+            if (httpRqt->hedge || httpRqt->hedgeOf) {
+                httpRqt = httpHedgeOnDone(httpPool, httpRqt, &estatus);
+                if (!httpRqt) continue;
             }
-            break;
+            httpHedgeCancel(httpPool, httpRqt);
+
+            // 429 or Retry-After holds host, retried request then waits with others
+            httpRateFeedback(httpPool, httpRqt, estatus);
+
+            // transient failure, request is added back to multi from pool timer
+            if (httpRetrySchedule(httpPool, httpRqt, estatus)) continue;
+
+            httpRqtComplete(httpPool, httpRqt, estatus);
         }
     }
 }
@@ -138,6 +414,7 @@ int httpOnSocketCB(httpPoolT *httpPool, int sock, int action)
     int running = 0;
 
     if (httpPool->verbose > 2) fprintf(stderr, "httpOnSocketCB: sock=%d action=%d\n", sock, action);
+    httpConnTouch(httpPool, sock);
     CURLMcode status = curl_multi_socket_action(httpPool->multi, sock, action, &running);
     if (status != CURLM_OK)
         goto OnErrorExit;
@@ -156,12 +433,19 @@ int httpOnTimerCB(httpPoolT *httpPool)
     assert(httpPool->magic == MAGIC_HTTP_POOL);
     int running = 0;
 
-    // timer transfers request to socket action (don't use curl_multi_perform)
-    int err = curl_multi_socket_action(httpPool->multi, CURL_SOCKET_TIMEOUT, 0, &running);
-    if (err != CURLM_OK)
-        goto OnErrorExit;
+    // glue timer is shared between libcurl and pool jobs
+    if (httpPool->curlDue && httpPool->curlDue <= httpNowMs()) {
+        httpPool->curlDue = 0;
 
-    multiCheckInfoCB(httpPool);
+        // timer transfers request to socket action (don't use curl_multi_perform)
+        int err = curl_multi_socket_action(httpPool->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        if (err != CURLM_OK)
+            goto OnErrorExit;
+
+        multiCheckInfoCB(httpPool);
+    }
+    httpTimerRun(httpPool);
+    httpTimerArm(httpPool);
     return 0;
 
 OnErrorExit:
@@ -169,18 +453,87 @@ OnErrorExit:
     return -1;
 }
 
-static int httpSendQuery(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *datas, long datalen, httpRqtCbT callback, void *ctx)
+static httpRqtIdT httpSendQuery(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *datas, long datalen, httpRqtCbT callback, void *ctx)
 {
-    httpRqtT *httpRqt = calloc(1, sizeof(httpRqtT));
-    httpRqt->magic = MAGIC_HTTP_RQT;
-    httpRqt->easy = curl_easy_init();
+    httpRqtT *httpRqt = httpRqtNew(httpPool);
+    if (!httpRqt) return 0;
     httpRqt->callback = callback;
     httpRqt->userData = ctx;
+
+    size_t urlLen = strlen(url) + 1;
+    httpRqt->url = httpRqtScratch(httpRqt, urlLen);
+    if (!httpRqt->url) goto OnErrorExit;
+    memcpy(httpRqt->url, url, urlLen);
     clock_gettime(CLOCK_MONOTONIC, &httpRqt->startTime);
+    httpRqtIdT rqtId = httpRqt->id = httpPool ? ++httpPool->rqtId : 1;
+
+    // earliest of request timeout, absolute deadline and parent deadline
+    if (opts) {
+        uint64_t now = httpNowMs();
+        if (opts->timeoutMs > 0) httpRqt->deadline = now + opts->timeoutMs;
+        else if (opts->timeout > 0) httpRqt->deadline = now + opts->timeout * 1000;
+        if (opts->deadline && (!httpRqt->deadline || opts->deadline < httpRqt->deadline)) httpRqt->deadline = opts->deadline;
+
+        httpRqtT *parent = (httpPool && opts->parent) ? rqtFind(httpPool, opts->parent) : NULL;
+        if (parent && parent->deadline && (!httpRqt->deadline || parent->deadline < httpRqt->deadline)) httpRqt->deadline = parent->deadline;
+        httpRqt->parent = opts->parent;
+        httpRqt->hedgePct = opts->hedge;
+        httpRqt->maxsz = opts->maxsz;
+        if (opts->priority > 0 && opts->priority < HTTP_PRIO_COUNT) httpRqt->priority = opts->priority;
+        if (opts->json > 0 && !(httpRqt->json = httpJsonNew(opts->json))) goto OnErrorExit;
+        httpRqt->sink = opts->sink;
+        httpRqt->stream = (opts->stream != 0);
+        httpRqt->compress = (opts->compress != 0);
+        if (httpPool && httpPool->exec && opts->offload) {
+            httpRqt->offload = 1;
+            httpRqt->execKey = httpExecKey(opts->orderKey);
+        }
+    }
 
     char header[DFLT_HEADER_MAX_LEN];
     struct curl_slist *rqtHeaders = NULL;
 
+    if (tokens) for (int idx = 0; tokens[idx].tag; idx++)  {
+            snprintf(header, sizeof(header), "%s: %s", tokens[idx].tag, tokens[idx].value);
+            rqtHeaders = curl_slist_append(rqtHeaders, header);
+        }
+
+    if (opts && opts->headers) for (int idx = 0; opts->headers[idx].tag; idx++)   {
+            snprintf(header, sizeof(header), "%s: %s", opts->headers[idx].tag, opts->headers[idx].value);
+            rqtHeaders = curl_slist_append(rqtHeaders, header);
+        }
+    httpRqt->rqtHeaders = rqtHeaders;
+    if (opts && opts->freeCtx) httpRqt->freeCtx = opts->freeCtx;
+    httpRqt->post = (datas != NULL);
+    httpRetryOpts(httpRqt, opts);
+
+    // GET may be served from cache without any network round-trip, or revalidated when stale
+    if (httpPool && httpPool->cache && !datas && !(opts && (opts->nocache || opts->sink))) {
+        httpRqt->cacheEntry = httpCacheLookup(httpPool->cache, url, rqtHeaders);
+        if (httpRqt->cacheEntry && httpCacheIsFresh(httpRqt->cacheEntry)) {
+            httpRqt->verbose = httpPool->verbose;
+            if (httpCacheServe(httpRqt->cacheEntry, httpRqt)) goto OnErrorExit;
+            httpRqtDone(httpPool, httpRqt);
+            return rqtId;
+        }
+        if (httpRqt->cacheEntry) rqtHeaders = httpRqt->rqtHeaders = httpCacheValidators(httpRqt->cacheEntry, rqtHeaders);
+    }
+
+    // replica is picked once request really goes to network, request url stays logical
+    if (httpPool && httpUpstreamIs(url)) {
+        url = httpUpstreamPick(httpPool, httpRqt, url);
+        if (!url) goto OnErrorExit;
+    }
+
+    // open host circuit fails request at once, no transfer is set up
+    if (httpPool && httpPool->breaker && httpBreakerAdmit(httpPool, httpRqt, httpHostFind(httpPool, url))) {
+        rqtMessage(httpRqt, "[circuit-open] url=[%s]", url);
+        httpRqt->status = HTTP_STATUS_CIRCUIT_OPEN;
+        httpRqtDone(httpPool, httpRqt);
+        return rqtId;
+    }
+
+    if (!httpRqt->easy) httpRqt->easy = curl_easy_init();
     curl_easy_setopt(httpRqt->easy, CURLOPT_URL, url);
     curl_easy_setopt(httpRqt->easy, CURLOPT_NOSIGNAL, 1L);
     curl_easy_setopt(httpRqt->easy, CURLOPT_NOPROGRESS, 1L);
@@ -192,36 +545,29 @@ static int httpSendQuery(httpPoolT *httpPool, const char *url, const httpOptsT *
     curl_easy_setopt(httpRqt->easy, CURLOPT_WRITEDATA, httpRqt);
     curl_easy_setopt(httpRqt->easy, CURLOPT_PRIVATE, httpRqt);
 
-    if (tokens) for (int idx = 0; tokens[idx].tag; idx++)  {
-            snprintf(header, sizeof(header), "%s: %s", tokens[idx].tag, tokens[idx].value);
-            rqtHeaders = curl_slist_append(rqtHeaders, header);
-        }
-
     if (opts) {
-
-        if (opts->headers) for (int idx = 0; opts->headers[idx].tag; idx++)   {
-            snprintf(header, sizeof(header), "%s: %s", opts->headers[idx].tag, opts->headers[idx].value);
-            rqtHeaders = curl_slist_append(rqtHeaders, header);
-        }
-
-        if (opts->freeCtx) httpRqt->freeCtx = opts->freeCtx;
         if (opts->follow) curl_easy_setopt(httpRqt->easy, CURLOPT_FOLLOWLOCATION, opts->follow);
         if (opts->verbose)  curl_easy_setopt(httpRqt->easy, CURLOPT_VERBOSE, opts->verbose);
         if (opts->agent) curl_easy_setopt(httpRqt->easy, CURLOPT_USERAGENT, opts->agent);
-        if (opts->timeout)  curl_easy_setopt(httpRqt->easy, CURLOPT_TIMEOUT, opts->timeout);
+        if (opts->head) curl_easy_setopt(httpRqt->easy, CURLOPT_NOBODY, 1L);
+        if (opts->priority) curl_easy_setopt(httpRqt->easy, CURLOPT_STREAM_WEIGHT, httpSchedStreamWeight(httpPool, httpRqt->priority));
+        if (opts->connectMs > 0) curl_easy_setopt(httpRqt->easy, CURLOPT_CONNECTTIMEOUT_MS, opts->connectMs);
         if (opts->sslchk) {
             curl_easy_setopt(httpRqt->easy, CURLOPT_SSL_VERIFYPEER, 1L);
             curl_easy_setopt(httpRqt->easy, CURLOPT_SSL_VERIFYHOST, 1L);
         }
+        if (opts->cainfo) curl_easy_setopt(httpRqt->easy, CURLOPT_CAINFO, opts->cainfo);
         if (opts->sslcert) curl_easy_setopt(httpRqt->easy, CURLOPT_SSLCERT, opts->sslcert);
         if (opts->sslkey)  curl_easy_setopt(httpRqt->easy, CURLOPT_SSLKEY, opts->sslkey);
         if (opts->maxsz)   curl_easy_setopt(httpRqt->easy, CURLOPT_MAXFILESIZE, opts->maxsz);
+        if (opts->compress) curl_easy_setopt(httpRqt->easy, CURLOPT_ACCEPT_ENCODING, ""); // every encoding built within libcurl
         if (opts->speedlow)curl_easy_setopt(httpRqt->easy, CURLOPT_LOW_SPEED_TIME, opts->speedlow);
         if (opts->speedlimit) curl_easy_setopt(httpRqt->easy, CURLOPT_LOW_SPEED_LIMIT, opts->speedlimit);
         if (opts->maxredir)   curl_easy_setopt(httpRqt->easy, CURLOPT_MAXREDIRS, opts->maxredir);
         if (opts->username)   curl_easy_setopt(httpRqt->easy, CURLOPT_USERNAME, opts->username);
         if (opts->password)   curl_easy_setopt(httpRqt->easy, CURLOPT_PASSWORD, opts->password);
         if (opts->ldap) curl_easy_setopt(httpRqt->easy, CURLOPT_PROTOCOLS, CURLPROTO_LDAP|CURLPROTO_LDAPS);
+        if (opts->unixSocket) httpUnixSetup(httpRqt, opts->unixSocket);
     }
 
     if (datas)
@@ -237,61 +583,70 @@ static int httpSendQuery(httpPoolT *httpPool, const char *url, const httpOptsT *
 
     if (httpPool)
     {
-        CURLMcode mstatus;
         httpRqt->verbose = httpPool->verbose;
-
-        // if httpPool add handle and run asynchronously
-        mstatus = curl_multi_add_handle(httpPool->multi, httpRqt->easy);
-        if (mstatus != CURLM_OK)
-        {
-            fprintf(stderr, "[curl-multi-fail] curl curl_multi_add_handle fail url=%s error=%s (httpSendQuery)", url, curl_multi_strerror(mstatus));
-            goto OnErrorExit;
-        }
+        httpRqt->host = httpHostGet(httpPool, url);
+        if (httpRqt->host) httpRqt->host->running++;
+        httpRetryDeposit(httpPool);
+
+        // local sidecar origins go through their unix socket, host name is never resolved
+        const char *unixPath = (opts && opts->unixSocket) ? opts->unixSocket : (httpRqt->host ? httpRqt->host->unixPath : NULL);
+        if (unixPath && !(opts && opts->unixSocket)) httpUnixSetup(httpRqt, unixPath);
+
+        // cached addresses avoid a blocking or serialized resolution within transfer
+        if (!unixPath) httpRqt->resolve = httpDnsResolveList(httpPool, url);
+        if (httpRqt->resolve) curl_easy_setopt(httpRqt->easy, CURLOPT_RESOLVE, httpRqt->resolve);
+        httpTlsSetup(httpPool, httpRqt);
+        httpSockSetup(httpPool, httpRqt);
+        httpConnSetup(httpPool, httpRqt);
+
+        // if httpPool start or queue request within its priority lane and run asynchronously
+        rqtLink(httpPool, httpRqt);
+        if (httpSchedAdmit(httpPool, httpRqt)) goto OnErrorExit;
     }
     else
     {
         CURLcode estatus;
-        // no event loop synchronous call
-        estatus = curl_easy_perform(httpRqt->easy);
+        long delay;
+        // no event loop synchronous call, retries simply sleep
+        for (;;) {
+            if (httpRqtDeadline(httpRqt)) {
+                estatus = CURLE_OPERATION_TIMEDOUT;
+                break;
+            }
+            estatus = curl_easy_perform(httpRqt->easy);
+            delay = httpRetryDelay(NULL, httpRqt, estatus);
+            if (delay < 0) break;
+            usleep(delay * 1000);
+        }
         if (estatus != CURLE_OK)
         {
             fprintf(stderr, "utilsSendRqt: curl request fail url=%s error=%s", url, curl_easy_strerror(estatus));
             goto OnErrorExit;
         }
 
-        curl_easy_getinfo(httpRqt->easy, CURLINFO_SIZE_DOWNLOAD, &httpRqt->length);
-        curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &httpRqt->status);
-        curl_easy_getinfo(httpRqt->easy, CURLINFO_CONTENT_TYPE, &httpRqt->ctype);
-
-        // compute elapsed time and call request callback
-        clock_gettime(CLOCK_MONOTONIC, &httpRqt->stopTime);
-        httpRqt->msTime = (httpRqt->stopTime.tv_nsec - httpRqt->startTime.tv_nsec) / 1000000 + (httpRqt->stopTime.tv_sec - httpRqt->startTime.tv_sec) * 1000;
-
-        // call request callback (note: callback should free httpRqt)
-        httpRqtActionT status = httpRqt->callback(httpRqt);
-        if (status == HTTP_HANDLE_FREE)
-        {
-            if (httpRqt->freeCtx && httpRqt->userData)
-                httpRqt->freeCtx(httpRqt->userData);
-            free(httpRqt);
-        }
-
-        // we're done
-        curl_easy_cleanup(httpRqt->easy);
+        // compute elapsed time, call request callback and we're done
+        httpRqtComplete(httpPool, httpRqt, estatus);
     }
-    return 0;
+    return rqtId;
 
 OnErrorExit:
-    free(httpRqt);
-    return 1;
+    if (httpPool) rqtUnlink(httpPool, httpRqt);
+    if (httpRqt->host) httpRqt->host->running--;
+    if (httpPool) httpLimitRelease(httpPool, httpRqt);
+    if (httpPool) httpRateRelease(httpPool, httpRqt);
+    if (httpPool) httpUpstreamDone(httpPool, httpRqt);
+    if (httpPool) httpBreakerDone(httpPool, httpRqt);
+    httpRqt->freeCtx = NULL; // on error caller keeps ownership of its context
+    httpRqtFree(httpRqt);
+    return 0;
 }
 
-int httpSendPost(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *datas, long len, httpRqtCbT callback, void *ctx)
+httpRqtIdT httpSendPost(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *datas, long len, httpRqtCbT callback, void *ctx)
 {
     return httpSendQuery(httpPool, url, opts, tokens, datas, len, callback, ctx);
 }
 
-int httpSendGet(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, httpRqtCbT callback, void *ctx)
+httpRqtIdT httpSendGet(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, httpRqtCbT callback, void *ctx)
 {
     return httpSendQuery(httpPool, url, opts, tokens, NULL, 0, callback, ctx);
 }
@@ -323,7 +678,8 @@ static int multiSetTimerCB(CURLM *curl, long timeout, void *ctx)
 
     if (httpPool->verbose > 1)
         fprintf(stderr, "-- multiSetTimerCB timeout=%ld\n", timeout);
-    int err = httpPool->callback->multiTimer(httpPool, timeout);
+    httpPool->curlDue = (timeout < 0) ? 0 : httpNowMs() + timeout;
+    int err = httpTimerArm(httpPool);
     if (err)
         fprintf(stderr, "[afb-timer-fail] afb_sched_post_job fail error=%d (multiSetTimerCB)", err);
 
@@ -351,6 +707,7 @@ httpPoolT *httpCreatePool(void *evtLoop, httpCallbacksT *mainLoopCbs, int verbos
 
     // add mainloop to httpPool
     httpPool->evtLoop = evtLoop;
+    httpPool->wakeFd = -1;
 
     httpPool->multi = curl_multi_init();
     if (!httpPool->multi)
@@ -360,6 +717,7 @@ httpPoolT *httpCreatePool(void *evtLoop, httpCallbacksT *mainLoopCbs, int verbos
     curl_multi_setopt(httpPool->multi, CURLMOPT_TIMERFUNCTION, multiSetTimerCB);
     curl_multi_setopt(httpPool->multi, CURLMOPT_SOCKETDATA, httpPool);
     curl_multi_setopt(httpPool->multi, CURLMOPT_TIMERDATA, httpPool);
+    httpRetryInit(httpPool);
 
     return httpPool;
 
@@ -369,6 +727,14 @@ OnErrorExit:
     return NULL;
 }
 
+int httpPoolStats(httpPoolT *httpPool, httpPoolStatsT *stats)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    *stats = httpPool->stats;
+    stats->bufferBytes = httpPool->memUsed;
+    return 0;
+}
+
 // build request with query
 int httpBuildQuery(const char *uid, char *response, size_t maxlen, const char *prefix, const char *url, httpKeyValT *query)
 {
@@ -17,13 +17,105 @@
 #include <sys/types.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MAGIC_HTTP_RQT 951357
 #define MAGIC_HTTP_POOL 583498
 #define DFLT_HEADER_MAX_LEN 1024
 #define HTTP_DFLT_AGENT "afb-oidc-sgate/1.0"
 
+// negative status are reported by http-client itself (positive ones are libcurl errors or http status)
+#define HTTP_STATUS_CANCELLED -1
+#define HTTP_STATUS_CIRCUIT_OPEN -2 // host circuit breaker is open, request was never sent
+
 
 typedef struct httpPoolS httpPoolT;
+typedef struct httpCacheS httpCacheT;
+typedef struct httpCacheEntryS httpCacheEntryT;
+typedef struct httpTimerS httpTimerT;
+typedef struct httpHostS httpHostT;
+typedef struct httpSchedS httpSchedT;
+typedef struct httpDnsS httpDnsT;
+typedef struct httpTlsS httpTlsT;
+typedef struct httpHdrIndexS httpHdrIndexT;
+typedef struct httpJsonS httpJsonT;
+typedef struct httpScratchS httpScratchT;
+typedef struct httpExecS httpExecT;
+typedef struct httpSockS httpSockT;
+typedef struct httpConnS httpConnT;
+typedef struct httpUpstreamS httpUpstreamT;
+typedef struct httpReplicaS httpReplicaT;
+typedef struct httpLimitS httpLimitT;
+typedef struct httpBreakerS httpBreakerT;
+typedef struct httpRateS httpRateT;
+typedef uint64_t httpRqtIdT; // 0 is never a valid request id
+
+// request priority class (default normal)
+typedef enum
+{
+    HTTP_PRIO_NORMAL = 0,
+    HTTP_PRIO_HIGH,
+    HTTP_PRIO_BULK,
+    HTTP_PRIO_COUNT,
+} httpPriorityT;
+
+// dequeue policy between priority lanes
+typedef enum
+{
+    HTTP_SCHED_STRICT = 0,
+    HTTP_SCHED_WEIGHTED,
+} httpSchedModeT;
+
+// upstream group replica selection
+typedef enum
+{
+    HTTP_LB_LEAST_OUTSTANDING = 0,
+    HTTP_LB_EWMA, // lowest latency average weighted by outstanding requests
+    HTTP_LB_P2C,  // best of two random replicas
+} httpLbModeT;
+
+// adaptive concurrency algorithm
+typedef enum
+{
+    HTTP_LIMIT_AIMD = 0, // +1 while limit is in use, x0.9 on error or latency over tolerance
+    HTTP_LIMIT_GRADIENT, // limit x (baseline x tolerance / rtt) + sqrt(limit)
+} httpLimitModeT;
+
+// host circuit breaker state
+typedef enum
+{
+    HTTP_BREAKER_CLOSED = 0,
+    HTTP_BREAKER_OPEN,      // requests fail with HTTP_STATUS_CIRCUIT_OPEN
+    HTTP_BREAKER_HALF_OPEN, // a few probe requests go through
+} httpBreakerStateT;
+
+// JSON token type (strings exclude quotes, escapes are not decoded)
+typedef enum
+{
+    HTTP_JSON_UNDEF = 0,
+    HTTP_JSON_OBJECT,
+    HTTP_JSON_ARRAY,
+    HTTP_JSON_STRING,
+    HTTP_JSON_PRIMITIVE, // number, true, false, null
+} httpJsonTypeT;
+
+// httpRqtJson errors
+#define HTTP_JSON_ENOTOKEN -1 // tokenizer not enabled or transfer failed
+#define HTTP_JSON_ENOMEM -2   // more than opts->json tokens
+#define HTTP_JSON_EINVAL -3   // malformed document
+#define HTTP_JSON_EPART -4    // truncated document
+
+// token spans [start, end[ within httpRqt->body, size is member count for objects, element count for arrays, 1 for keys
+typedef struct
+{
+    httpJsonTypeT type;
+    long start;
+    long end;
+    int size;
+    int parent; // -1 for root
+} httpJsonTokT;
 
 typedef enum
 {
@@ -38,6 +130,18 @@ typedef struct
 } httpKeyValT;
 
 typedef void (*httpFreeCtxCbT)(void *userData);
+typedef struct httpRqtS httpRqtT;
+
+// streamed body chunk, return len to go on (0 aborts transfer with CURLE_WRITE_ERROR)
+typedef size_t (*httpSinkCbT)(httpRqtT *httpRqt, const char *data, size_t len);
+
+// deferred job, node is owned by caller (no allocation)
+typedef struct httpDeferS
+{
+    struct httpDeferS *next;
+    void (*callback)(void *ctx);
+    void *ctx;
+} httpDeferT;
 
 // curl options
 typedef struct
@@ -48,7 +152,7 @@ typedef struct
     const long timeout;
     const long sslchk;
     const long verbose;
-    const long maxsz;
+    const long maxsz;      // max decoded body size
     const long speedlimit;
     const long speedlow;
     const long follow;
@@ -60,13 +164,159 @@ typedef struct
     const char *tostr;
     const char *agent;
     int ldap;
+    const long nocache;
+    const long retries;    // max retry count on transient failure (0=none)
+    const long backoff;    // first retry delay in ms (default 100), doubled on each retry
+    const long backoffMax; // max retry delay in ms (default 10000)
+    const long hedge;      // duplicate GET still pending after host latency percentile (ie: 95), ignored with sink/stream
+    const long timeoutMs;  // total deadline in ms including retries (overloads timeout)
+    const long connectMs;  // connection deadline in ms
+    const uint64_t deadline;  // absolute deadline from httpNow(), ie: inherited from a server request
+    const httpRqtIdT parent;  // inherit parent request deadline, request is cancelled with its parent
+    const httpPriorityT priority; // admission lane and h2 stream weight
+    const long head;       // HEAD request, no body is transfered
+    const long compress;   // advertise gzip/deflate/br/zstd and decode while receiving
+    const long json;       // tokenize JSON body while receiving, max token count (ie: 256)
+    const long offload;    // run callback on pool executor thread (httpPoolSetExecutor), refused by httpSendMany and C++ awaiters
+    const char *orderKey;  // offloaded callbacks sharing a key run one at a time in completion order
+    const char *unixSocket; // connect to a unix socket path ('@name' for abstract namespace) instead of url host
+    const httpSinkCbT sink; // body goes to sink as it arrives instead of httpRqt->body (bodyLen still counts bytes)
+    const long stream;     // long-lived response (subscription), holds no adaptive limiter slot nor latency sample
     const httpKeyValT *headers;
     const httpFreeCtxCbT freeCtx;
 } httpOptsT;
 
-typedef struct httpRqtS httpRqtT;
+// pool socket profile, 0 keeps libcurl/kernel defaults
+typedef struct
+{
+    long nodelay;    // 1 disables Nagle (libcurl default), -1 enables it
+    long rcvbuf;     // SO_RCVBUF bytes (disables kernel autotuning)
+    long sndbuf;     // SO_SNDBUF bytes
+    long bufferSize; // libcurl receive buffer (CURLOPT_BUFFERSIZE)
+    long uploadSize; // libcurl upload buffer (CURLOPT_UPLOAD_BUFFERSIZE)
+    long keepIdle;   // TCP keepalive idle seconds (enables keepalive)
+    long keepIntvl;  // TCP keepalive probe interval seconds
+    long busyPoll;   // SO_BUSY_POLL microseconds
+    long adaptive;   // host average body bytes from which transfers get large buffers (0=off)
+} httpSockOptsT;
+
+// connection cache policy, 0 keeps libcurl defaults
+typedef struct
+{
+    long maxConnects; // multi connection cache size (CURLMOPT_MAXCONNECTS)
+    long idleMs;      // close connections idle for longer
+    long maxAgeMs;    // close connections older, load spreads on upstream scaling
+} httpConnPolicyT;
+
+// per host adaptive concurrency limiter, 0 selects defaults
+typedef struct
+{
+    httpLimitModeT mode;
+    long initial;     // starting limit (default 10)
+    long min;         // floor (default 1)
+    long max;         // ceiling (default 1000)
+    double tolerance; // rtt over baseline ratio seen as queuing (default 2.0)
+} httpLimitOptsT;
+
+// per host circuit breaker, 0 selects defaults
+typedef struct
+{
+    int failPercent;       // failures (libcurl errors, timeouts, 5xx) percent that opens circuit (default 50)
+    int minSamples;        // outcomes needed before opening (default 10)
+    int window;            // outcomes kept per host, max 32 (default 20)
+    long openMs;           // fast-fail delay before half-open (default 5000), doubles on each failed probe up to 16x
+    int probes;            // concurrent half-open probe requests (default 1)
+    int probeSuccess;      // successful probes that close circuit (default 1)
+    const char *probePath; // when set, pool GETs origin+probePath as soon as open delay expires
+} httpBreakerOptsT;
+
+// upstream group replica counters
+typedef struct
+{
+    const char *url;
+    long outstanding;
+    double ewmaMs;
+    uint64_t requests;
+    uint64_t failures;
+    int failRate; // recent error percent
+    int ejected;
+} httpReplicaStatsT;
+
+// per upstream (scheme://host:port) counters
+typedef struct
+{
+    uint64_t transfers; // completed transfers
+    uint64_t connects;  // new connections opened by transfers
+    uint64_t reused;    // transfers that reused a cached connection
+    uint64_t reaped;    // connections closed by idle/max age policy
+    long open;          // connections currently open (with connection policy)
+    long running;       // pending requests
+    long limit;         // current adaptive concurrency limit (0 without limiter)
+    long inflight;      // requests holding a limiter slot
+    long limited;       // requests waiting for a limiter slot
+    httpBreakerStateT breaker;
+    int breakerTrips;   // consecutive circuit openings
+    long paced;         // requests waiting for a rate token
+} httpHostStatsT;
+
 typedef httpRqtActionT (*httpRqtCbT)(httpRqtT *httpRqt);
 
+// scatter-gather completion policy
+typedef enum
+{
+    HTTP_MANY_ALL = 0,
+    HTTP_MANY_FIRST_SUCCESS, // first 2xx/3xx response
+    HTTP_MANY_QUORUM,        // 'quorum' successful responses, or quorum out of reach
+    HTTP_MANY_FIRST_ERROR,   // first failure (libcurl error, cancel, 4xx/5xx)
+} httpManyModeT;
+
+// scatter-gather request descriptor (POST when data!=NULL)
+typedef struct
+{
+    const char *url;
+    const httpOptsT *opts;
+    httpKeyValT *tokens;
+    void *data;
+    long datalen;
+} httpManyRqtT;
+
+typedef struct httpManyS httpManyT;
+typedef httpRqtActionT (*httpManyCbT)(httpManyT *many);
+
+// ranged download options, 0 selects defaults
+typedef struct
+{
+    int segments;          // parallel byte ranges (default 4, max 64)
+    curl_off_t minSegment; // smallest range, small objects get fewer segments (default 1MB)
+    const httpOptsT *opts; // probe and segment options (head/sink ignored), must stay valid until completion
+} httpRangedOptsT;
+
+typedef struct httpRangedS httpRangedT;
+typedef httpRqtActionT (*httpRangedCbT)(httpRangedT *ranged);
+
+// server-sent event, strings are only valid within callback
+typedef struct
+{
+    const char *event; // event type, "message" when server sent none (NULL in lines mode)
+    const char *data;  // data lines joined with '\n', NUL terminated
+    size_t dataLen;
+    const char *id;    // last event id, NULL until server sends one
+} httpSseEventT;
+
+typedef struct httpSseS httpSseT;
+typedef httpRqtActionT (*httpSseCbT)(httpSseT *sse, const httpSseEventT *event);
+
+// subscription options, 0 selects defaults
+typedef struct
+{
+    long lines;            // newline delimited chunked stream (ie: NDJSON), each line is an event
+    long reconnectMs;      // first reconnect delay (default 3000, server 'retry:' field overrides)
+    long reconnectMax;     // reconnect backoff cap in ms (default 60000)
+    long idleSec;          // reconnect when nothing came for idleSec, heartbeat comments included (0=never)
+    size_t maxEvent;       // larger events are dropped (default 1MB)
+    const httpOptsT *opts; // connection options (timeouts, retries and sink ignored), must stay valid until close
+} httpSseOptsT;
+
 // http request handle
 typedef struct httpRqtS
 {
@@ -75,11 +325,11 @@ typedef struct httpRqtS
     char *body;
     char *headers;
     char *ctype;
-    curl_off_t length;
+    curl_off_t length;     // decoded body length
+    curl_off_t wireBytes;  // body bytes received from network (compressed)
     long hdrLen;
     long bodyLen;
     long status;
-    char error[CURL_ERROR_SIZE];
     void *easy;
     struct timespec startTime;
     struct timespec stopTime;
@@ -87,6 +337,70 @@ typedef struct httpRqtS
     void *userData;
     httpRqtCbT callback;
     httpFreeCtxCbT freeCtx;
+    const char *replica; // upstream group replica that served request (upstream:// urls)
+
+    // private to http-client (do not touch from callback)
+    httpPoolT *pool; // owning slab, NULL for synchronous requests
+    httpRqtIdT id;
+    httpRqtIdT parent;
+    uint64_t deadline;
+    struct httpRqtS *activeNext;
+    struct httpRqtS *activePrev;
+    httpPriorityT priority;
+    int admitted;
+    int queued;
+    uint64_t queuedAt;
+    httpTimerT *waitTimer;
+    struct httpRqtS *queueNext;
+    struct httpRqtS *queuePrev;
+    long hedgePct;
+    long maxsz;
+    int tooLarge;
+    size_t bodySize;
+    size_t hdrSize;
+    httpScratchT *scratch;
+    size_t memCharged;
+    int paused;
+    struct httpRqtS *pauseNext;
+    struct httpRqtS *pausePrev;
+    char *url;
+    struct curl_slist *rqtHeaders;
+    struct curl_slist *resolve;
+    httpHdrIndexT *hdrIndex;
+    httpJsonT *json;
+    httpCacheEntryT *cacheEntry;
+    int cacheServed;
+    httpHostT *host;
+    int post;
+    int retryCount;
+    int retryMax;
+    long backoff;
+    long backoffMax;
+    httpTimerT *retryTimer;
+    struct httpRqtS *hedge;
+    struct httpRqtS *hedgeOf;
+    httpTimerT *hedgeTimer;
+    int hedgeDone;
+    int offload;
+    uint32_t execKey;
+    httpRqtActionT execStatus;
+    struct httpRqtS *execNext;
+    int sockLarge;
+    httpUpstreamT *upstream;
+    httpReplicaT *lbReplica;
+    int limited;
+    int limitHeld;
+    uint64_t limitStart;
+    int breakerProbe;
+    int paced;
+    int ratePassed;
+    int rateRetry;
+    httpSinkCbT sink;
+    int stream;
+    int compress;
+
+    // cold, last within request slot
+    char error[CURL_ERROR_SIZE];
 } httpRqtT;
 
 // mainloop glue API interface
@@ -94,6 +408,7 @@ typedef void *(*evtMainLoopCbT)();
 typedef int (*multiTimerCbT)(httpPoolT *httpPool, long timeout);
 typedef int (*multiSocketCbT)(httpPoolT *httpPool, CURL *easy, int sock, int action, void *sockp);
 typedef int (*evtRunLoopCbT)(httpPoolT *httpPool, long seconds);
+typedef int (*evtWakeupCbT)(httpPoolT *httpPool, int fd);
 
 // glue callbacks handle
 typedef struct
@@ -102,9 +417,194 @@ typedef struct
     evtRunLoopCbT evtRunLoop;
     multiTimerCbT multiTimer;
     multiSocketCbT multiSocket;
+    evtWakeupCbT evtWakeup; // optional, watch fd for input and call httpOnWakeupCB (worker threads results)
 
 } httpCallbacksT;
 
+// scatter-gather aggregate handle, results[idx] matches descriptor idx (NULL when not sent)
+typedef struct httpManyS
+{
+    int count;
+    int completed;
+    int success;
+    int failed;
+    int unsent;
+    httpRqtT **results;
+    void *userData;
+
+    // private to http-client
+    int magic;
+    int fired;
+    int quorum;
+    httpManyModeT mode;
+    httpManyCbT callback;
+    httpPoolT *pool;
+    httpRqtIdT *ids;
+    httpDeferT defer;
+} httpManyT;
+
+// one byte range of a ranged download
+typedef struct
+{
+    curl_off_t offset;
+    curl_off_t length;   // -1 for a single stream of unknown size
+    curl_off_t received;
+    long status;         // 206 per range (200 single stream), libcurl error or negative http-client status
+    uint64_t msTime;
+
+    // private to http-client
+    httpRangedT *ranged;
+    httpRqtIdT id;
+    int index;
+    int done;
+} httpSegmentT;
+
+// ranged download handle, written into 'path'
+typedef struct httpRangedS
+{
+    char *url;
+    char *path;
+    curl_off_t size;     // object size, -1 when unknown
+    long status;         // 200 when whole object is written, else first failing segment status
+    int ranged;          // 0 when object went as a single stream (no range support, unknown size or small object)
+    int count;
+    httpSegmentT *segments;
+    uint64_t msTime;     // HEAD probe included
+    void *userData;
+
+    // private to http-client
+    int magic;
+    int verbose;
+    httpPoolT *pool;
+    httpRangedCbT callback;
+    const httpOptsT *opts;
+    curl_off_t minSegment;
+    int max;
+    int fd;
+    int pending;
+    int busy;
+    int fallback;
+    long failure;
+    struct timespec startTime;
+    httpDeferT defer;
+} httpRangedT;
+
+// growable parser buffer, capacity is kept between events
+typedef struct
+{
+    char *text;
+    size_t len;
+    size_t size;
+} httpSseBufT;
+
+// event stream subscription handle
+typedef struct httpSseS
+{
+    char *url;
+    const char *lastId;  // Last-Event-ID sent on reconnect, NULL until server sends an id
+    long status;         // last connection status, final status once subscription is over
+    long connects;
+    long events;
+    long dropped;        // events over maxEvent
+    void *userData;
+
+    // private to http-client
+    int magic;
+    int verbose;
+    httpPoolT *pool;
+    httpSseCbT callback;
+    const httpOptsT *opts;
+    long lines;
+    long reconnectMs;
+    long reconnectMax;
+    long idleSec;
+    size_t maxEvent;
+    int failures;
+    httpRqtIdT id;
+    httpTimerT *timer;
+    int pending;
+    int busy;
+    int closing;
+    int checked;
+    int ignore;
+    int invalid;
+    int received;
+    int crSkip;
+    int lineSkip;
+    int overflow;
+    int idSet;
+    httpSseBufT line;
+    httpSseBufT data;
+    httpSseBufT type;
+    httpSseBufT nextId;
+    httpSseBufT last;
+} httpSseT;
+
+// pool statistics
+typedef struct
+{
+    uint64_t retries;
+    uint64_t retryDenied;
+    uint64_t resumed;
+    uint64_t hedged;
+    uint64_t hedgeWins;
+    uint64_t cancelled;
+    uint64_t prewarmed;
+    uint64_t prewarmFailed;
+    uint64_t dnsHits;
+    uint64_t dnsMisses;
+    uint64_t dnsRefreshes;
+    uint64_t dnsFailures;
+    uint64_t tlsHits;   // persisted session resumed
+    uint64_t tlsMisses; // persisted session offered but server did a full handshake
+    uint64_t tlsStored;
+    uint64_t wireBytes;
+    uint64_t decodedBytes;
+    uint64_t rqtSlots;    // request slots carved from slab
+    uint64_t rqtRecycled; // requests returned to slab
+    uint64_t bufferBytes; // body bytes currently held by requests
+    uint64_t bufferPeak;
+    uint64_t pauses;
+    uint64_t resumes;
+    uint64_t pausedNow;   // transfers waiting for memory budget
+    uint64_t offloaded;   // callbacks run on executor threads
+    uint64_t sockTuned;   // connections configured by socket profile
+    uint64_t sockLarge;   // transfers given large buffers (adaptive profile)
+    uint64_t connNew;     // connections opened by transfers
+    uint64_t connReused;  // transfers that reused a cached connection
+    uint64_t connOpened;  // sockets opened/closed under connection policy
+    uint64_t connClosed;
+    uint64_t connReaped;
+    uint64_t ejections;   // upstream replicas ejected on error rate
+    uint64_t limited;     // requests that waited for an adaptive limiter slot
+    uint64_t limitDrops;  // limiter decreases (AIMD)
+    uint64_t breakerTrips;     // host circuits opened
+    uint64_t breakerFastFails; // requests failed by an open circuit
+    uint64_t ratePaced;        // requests that waited for a rate token
+    uint64_t rateThrottled;    // 429 or Retry-After answers that held their host
+} httpPoolStatsT;
+
+// resolved address (text form)
+#define HTTP_DNS_MAX_ADDRS 8
+typedef struct
+{
+    int family;    // AF_INET|AF_INET6
+    char addr[46]; // INET6_ADDRSTRLEN
+} httpDnsAddrT;
+
+// blocking resolver called from a worker thread, return address count or -1
+typedef int (*httpResolverCbT)(const char *host, httpDnsAddrT *addrs, int max, long *ttl, void *ctx);
+
+// per priority lane statistics
+typedef struct
+{
+    uint64_t admitted;
+    uint64_t waited;   // requests that had to queue
+    uint64_t queued;   // current queue depth
+    uint64_t running;
+    uint64_t maxWaitMs;
+} httpLaneStatsT;
+
 // multi-pool handle
 typedef struct httpPoolS
 {
@@ -114,19 +614,180 @@ typedef struct httpPoolS
     void *evtLoop;
     void *evtTimer;
     httpCallbacksT *callback;
+    httpCacheT *cache;
+    httpSchedT *sched;
+    httpDnsT *dns;
+    httpTlsT *tls;
+    httpExecT *exec;
+    httpSockT *sock;
+    httpConnT *conns;
+    httpLimitT *limiter;
+    httpBreakerT *breaker;
+    httpRateT *rate;
+    httpPoolStatsT stats;
+
+    // private to http-client
+    httpRqtIdT rqtId;
+    httpRqtT *active;
+    httpRqtT *rqtFree;
+    size_t memBudget;
+    size_t memUsed;
+    size_t memPaused;
+    httpRqtT *pausedHead;
+    httpRqtT *pausedTail;
+    httpTimerT *budgetTimer;
+    httpUpstreamT *upstreams;
+    httpDeferT *deferHead;
+    httpDeferT *deferTail;
+    httpTimerT *deferTimer;
+    uint64_t curlDue;
+    int wakeFd; // eventfd watched by glue, -1 when workers results are polled from timer
+    httpTimerT **timers;
+    size_t timerCount;
+    size_t timerSize;
+    httpHostT **hosts;
+    size_t hostBuckets;
+    size_t hostCount;
+    long maxConnects;
+    double retryTokens;
+    uint64_t retryRefill;
+    long retryPercent;
+    long retryMinPerSec;
+    unsigned int seed;
 } httpPoolT;
 
+// response cache statistics
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t revalidated;
+    uint64_t stored;
+    uint64_t evicted;
+    size_t entries;
+    size_t bytes;
+    size_t maxBytes;
+    uint64_t diskHits;
+    size_t diskEntries;
+    size_t diskBytes;
+    size_t diskMaxBytes;
+} httpCacheStatsT;
+
 // glue proto to get mainloop callbacks
 httpCallbacksT *glueGetCbs(void);
 
-// API to build and lauch request (if httpPoolT==NULL then run synchronously)
+// API to build and lauch request (if httpPoolT==NULL then run synchronously), return request id or 0 on error
 int httpBuildQuery(const char *uid, char *response, size_t maxlen, const char *prefix, const char *url, httpKeyValT *query);
-int httpSendPost(httpPoolT *pool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *databuf, long datalen, httpRqtCbT callback, void *ctx);
-int httpSendGet(httpPoolT *pool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, httpRqtCbT callback, void *ctx);
+httpRqtIdT httpSendPost(httpPoolT *pool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *databuf, long datalen, httpRqtCbT callback, void *ctx);
+httpRqtIdT httpSendGet(httpPoolT *pool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, httpRqtCbT callback, void *ctx);
+
+// send requests in one batch, callback fires once with every result (early completion cancels pending requests)
+// quorum<=0 means count/2+1. Callback returning HTTP_HANDLE_FREE releases aggregate and results, else call httpManyFree
+int httpSendMany(httpPoolT *pool, const httpManyRqtT *rqts, int count, httpManyModeT mode, int quorum, httpManyCbT callback, void *ctx);
+void httpManyFree(httpManyT *many);
+
+// download url into 'path' with parallel byte ranges (single stream when server has no range support)
+// callback fires once, returning HTTP_HANDLE_FREE releases handle, else call httpRangedFree
+int httpDownloadRanged(httpPoolT *pool, const char *url, const char *path, const httpRangedOptsT *ropts, httpRangedCbT callback, void *ctx);
+void httpRangedFree(httpRangedT *ranged);
+
+// subscribe to a text/event-stream (or newline delimited) url, callback fires per event and reconnects carry Last-Event-ID
+// callback gets event=NULL once subscription is over (sse->status). Returning HTTP_HANDLE_FREE unsubscribes/releases handle
+httpSseT *httpSseSubscribe(httpPoolT *pool, const char *url, const httpSseOptsT *sopts, httpSseCbT callback, void *ctx);
+void httpSseClose(httpSseT *sse);
+
+// abort a pending request (and its children), callback is called with HTTP_STATUS_CANCELLED. Return -1 when request is already done
+int httpCancel(httpPoolT *pool, httpRqtIdT rqtId);
+
+// run job from pool event loop once current libcurl/timer callbacks returned (ie: after a request callback completed)
+int httpPoolDefer(httpPoolT *httpPool, httpDeferT *job);
+
+// monotonic clock in ms used for deadlines
+uint64_t httpNow(void);
 
 // init curl multi pool with an abstract mainloop and corresponding callbacks
 httpPoolT *httpCreatePool(void *evtLoop, httpCallbacksT *mainLoopCbs, int verbose);
 
+// final response header value (case insensitive name, ie: "etag"), NULL when missing. Valid until request is freed
+const char *httpRqtHeader(httpRqtT *httpRqt, const char *name);
+
+// JSON body tokens (opts->json), return token count or HTTP_JSON_Exxx. Valid until request is freed
+int httpRqtJson(httpRqtT *httpRqt, const httpJsonTokT **tokens);
+// dotted path query (ie: "keys.0.kid"), return token index or -1, value points within body (not NUL terminated)
+int httpJsonQuery(httpRqtT *httpRqt, const char *path, const char **value, long *len);
+
+// request lifetime memory (16 bytes aligned), released with request
+void *httpRqtScratch(httpRqtT *httpRqt, size_t size);
+
+// release a request handle kept by callback with HTTP_HANDLE_KEEP
+void httpRqtFree(httpRqtT *httpRqt);
+
+// pool counters (retries, hedging, ...)
+int httpPoolStats(httpPoolT *httpPool, httpPoolStatsT *stats);
+
+// retries may not exceed 'percent' of new requests plus 'minPerSec' (default 20%+10/s)
+int httpPoolSetRetryBudget(httpPoolT *httpPool, long percent, long minPerSec);
+
+// open DNS+TCP+TLS connections to upstreams ahead of traffic, return launched count or -1
+int httpPoolPrewarm(httpPoolT *httpPool, const char *urls[], int count);
+
+// resolve hosts from worker threads, cache them with TTL and feed transfers with CURLOPT_RESOLVE (resolver=NULL for system DNS)
+int httpPoolSetDnsCache(httpPoolT *httpPool, httpResolverCbT resolver, void *ctx);
+int httpPoolDnsPrefetch(httpPoolT *httpPool, const char *urls[], int count);
+
+// persist TLS sessions to 'path' encrypted with a 32 bytes key read from 'keyPath' (created when missing)
+int httpPoolSetTlsCache(httpPoolT *httpPool, const char *path, const char *keyPath);
+int httpPoolTlsCacheSave(httpPoolT *httpPool);
+
+// bound running requests (0=unlimited) and select dequeue policy between priority lanes
+int httpPoolSetScheduler(httpPoolT *httpPool, httpSchedModeT mode, long maxActive);
+// per lane admission slots (0=unlimited) and weight (default high=16 normal=4 bulk=1)
+int httpPoolSetLane(httpPoolT *httpPool, httpPriorityT priority, long slots, long weight);
+int httpPoolLaneStats(httpPoolT *httpPool, httpPriorityT priority, httpLaneStatsT *stats);
+
+// bound body bytes buffered by pool requests (0=unlimited), over budget transfers pause until requests are freed
+int httpPoolSetMemBudget(httpPoolT *httpPool, size_t maxBytes);
+
+// run callbacks of requests sent with opts->offload on 'workers' threads, return started worker count or -1
+int httpPoolSetExecutor(httpPoolT *httpPool, int workers);
+
+// socket profile applied to next transfers and connections (NULL restores defaults)
+int httpPoolSetSocket(httpPoolT *httpPool, const httpSockOptsT *opts);
+
+// connection cache size, idle timeout and max lifetime (idle/old connections are reaped from pool timer)
+int httpPoolSetConnPolicy(httpPoolT *httpPool, const httpConnPolicyT *policy);
+// per upstream counters (reuse ratio=reused/transfers), return -1 when no request went to url origin
+int httpPoolHostStats(httpPoolT *httpPool, const char *url, httpHostStatsT *stats);
+
+// route origin (ie: "http://broker:8080") to a unix socket path ('@name' for abstract namespace), path=NULL removes route
+int httpPoolSetUnixRoute(httpPoolT *httpPool, const char *origin, const char *path);
+
+// replica group reached with "upstream://name/path" urls (ie: httpBuildQuery prefix), httpRqt->replica reports serving replica
+int httpPoolAddUpstream(httpPoolT *httpPool, const char *name, const char *urls[], int count, httpLbModeT mode);
+// fill up to 'max' replica counters, return replica count or -1 for unknown group
+int httpPoolUpstreamStats(httpPoolT *httpPool, const char *name, httpReplicaStatsT *stats, int max);
+
+// adapt per host concurrency from latency and errors, over limit requests wait in front of scheduler (NULL disables)
+int httpPoolSetLimiter(httpPoolT *httpPool, const httpLimitOptsT *opts);
+
+// open host circuit on error rate, requests then complete at once with HTTP_STATUS_CIRCUIT_OPEN (NULL disables)
+int httpPoolSetBreaker(httpPoolT *httpPool, const httpBreakerOptsT *opts);
+
+// token bucket of 'rate' requests/s up to 'burst' (0=rate) for origin (NULL=every host without its own), rate<=0 removes it
+int httpPoolSetRateLimit(httpPoolT *httpPool, const char *origin, double rate, long burst);
+
+// attach an in-memory response cache (GET only) to the pool, maxBytes is the body+headers byte budget
+int httpPoolSetCache(httpPoolT *httpPool, size_t maxBytes);
+int httpPoolCacheStats(httpPoolT *httpPool, httpCacheStatsT *stats);
+
+// add a persistent memory-mapped tier behind pool cache, it survives process restarts
+int httpPoolSetDiskCache(httpPoolT *httpPool, const char *path, size_t maxBytes);
+
 // curl action callback to be called from glue layer
 int httpOnSocketCB(httpPoolT *httpPool, int sock, int action);
 int httpOnTimerCB(httpPoolT *httpPool);
+int httpOnWakeupCB(httpPoolT *httpPool);
+
+#ifdef __cplusplus
+}
+#endif
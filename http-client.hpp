@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Header only C++20 layer over http-client callback API (g++ -std=c++20).
+ *
+ *  httpclient::Task<long> fetch(httpclient::Pool &pool) {
+ *      httpclient::Response rsp = co_await pool.get("https://example.com");
+ *      co_return rsp.status();
+ *  }
+ *  long status = pool.run(fetch(pool));
+ *
+ * Request awaiter lives within coroutine frame and is passed as callback context, request callback
+ * keeps handle (HTTP_HANDLE_KEEP) and coroutine resumes from a pool deferred job on event loop thread,
+ * once http-client is done with request. Response owns request handle and frees it (no body copy).
+ */
+
+#pragma once
+
+#include "http-client.h"
+
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace httpclient
+{
+
+// move only owner of a completed request
+class Response
+{
+  public:
+    Response() = default;
+    explicit Response(httpRqtT *httpRqt) : rqt_(httpRqt) {}
+    Response(const Response &) = delete;
+    Response &operator=(const Response &) = delete;
+    Response(Response &&other) noexcept : rqt_(std::exchange(other.rqt_, nullptr)) {}
+    Response &operator=(Response &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            rqt_ = std::exchange(other.rqt_, nullptr);
+        }
+        return *this;
+    }
+    ~Response() { reset(); }
+
+    // false when request could not be sent
+    explicit operator bool() const { return rqt_ != nullptr; }
+
+    // http status, libcurl error (<100) or HTTP_STATUS_CANCELLED
+    long status() const { return rqt_ ? rqt_->status : 0; }
+    std::string_view body() const { return rqt_ && rqt_->body ? std::string_view(rqt_->body, rqt_->length) : std::string_view(); }
+    const char *header(const char *name) const { return rqt_ ? httpRqtHeader(rqt_, name) : nullptr; }
+    uint64_t msTime() const { return rqt_ ? rqt_->msTime : 0; }
+    httpRqtT *get() const { return rqt_; }
+
+    // hand over request handle, caller should httpRqtFree it
+    httpRqtT *release() { return std::exchange(rqt_, nullptr); }
+
+    void reset()
+    {
+        if (rqt_) httpRqtFree(std::exchange(rqt_, nullptr));
+    }
+
+  private:
+    httpRqtT *rqt_ = nullptr;
+};
+
+// co_await pool.get()/post(), returns a Response
+class RequestAwaiter
+{
+  public:
+    RequestAwaiter(httpPoolT *httpPool, const char *url, const httpOptsT *opts, httpKeyValT *tokens, void *data, long len, bool post)
+        : pool_(httpPool), url_(url), opts_(opts), tokens_(tokens), data_(data), len_(len), post_(post)
+    {
+        defer_.callback = onResume;
+        defer_.ctx = this;
+    }
+    RequestAwaiter(const RequestAwaiter &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        // completion defers coroutine resume, it must run on event loop thread
+        if (opts_ && opts_->offload) {
+            fprintf(stderr, "[coro-invalid] url=%s opts->offload is not supported for awaited requests (await_suspend)\n", url_);
+            return false;
+        }
+
+        handle_ = handle;
+        sending_ = true;
+        httpRqtIdT rqtId = post_ ? httpSendPost(pool_, url_, opts_, tokens_, data_, len_, onDone, this)
+                                 : httpSendGet(pool_, url_, opts_, tokens_, onDone, this);
+        sending_ = false;
+
+        // failed or completed synchronously (ie: cache hit), do not suspend
+        return rqtId && !rqt_;
+    }
+
+    Response await_resume() { return Response(std::exchange(rqt_, nullptr)); }
+
+  private:
+    static httpRqtActionT onDone(httpRqtT *httpRqt)
+    {
+        RequestAwaiter *self = static_cast<RequestAwaiter *>(httpRqt->userData);
+        self->rqt_ = httpRqt;
+
+        // http-client still uses request after callback, resume from next loop iteration
+        if (!self->sending_ && httpPoolDefer(self->pool_, &self->defer_)) std::abort();
+        return HTTP_HANDLE_KEEP;
+    }
+
+    static void onResume(void *ctx) { static_cast<RequestAwaiter *>(ctx)->handle_.resume(); }
+
+    httpPoolT *pool_;
+    const char *url_;
+    const httpOptsT *opts_;
+    httpKeyValT *tokens_;
+    void *data_;
+    long len_;
+    bool post_;
+    bool sending_ = false;
+    httpRqtT *rqt_ = nullptr;
+    std::coroutine_handle<> handle_;
+    httpDeferT defer_{};
+};
+
+template <typename T> class Task;
+
+namespace detail
+{
+// completion is reported either to an awaiting coroutine or to when_all counter
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation;
+    void (*onDone)(void *ctx) = nullptr;
+    void *ctx = nullptr;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+        {
+            // onDone may resume a parent that destroys this frame
+            PromiseBase &promise = handle.promise();
+            std::coroutine_handle<> next = promise.continuation ? promise.continuation : std::noop_coroutine();
+            if (promise.onDone) promise.onDone(promise.ctx);
+            return next;
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+};
+
+template <typename T> struct Promise : PromiseBase
+{
+    std::optional<T> value;
+    Task<T> get_return_object();
+    void return_value(T result) { value.emplace(std::move(result)); }
+    T take() { return std::move(*value); }
+};
+
+template <> struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+    void take() {}
+};
+} // namespace detail
+
+// lazy coroutine, starts when awaited or run by Pool::run/whenAll
+template <typename T = void> class Task
+{
+  public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type handle) : handle_(handle) {}
+    Task(const Task &) = delete;
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    ~Task()
+    {
+        if (handle_) handle_.destroy();
+    }
+
+    bool done() const { return !handle_ || handle_.done(); }
+
+    bool await_ready() const { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().take(); }
+
+    // start without awaiting coroutine, 'onDone' is called on completion
+    void start(void (*onDone)(void *ctx), void *ctx)
+    {
+        handle_.promise().onDone = onDone;
+        handle_.promise().ctx = ctx;
+        handle_.resume();
+    }
+    T take() { return handle_.promise().take(); }
+
+  private:
+    handle_type handle_;
+};
+
+namespace detail
+{
+template <typename T> Task<T> Promise<T>::get_return_object() { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+inline Task<void> Promise<void>::get_return_object() { return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this)); }
+
+// start every task and resume awaiting coroutine when last one completes
+template <typename T> class WhenAllAwaiter
+{
+  public:
+    explicit WhenAllAwaiter(std::vector<Task<T>> &tasks) : tasks_(tasks) {}
+
+    bool await_ready() const { return tasks_.empty(); }
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+        awaiting_ = awaiting;
+        pending_ = tasks_.size() + 1;
+        for (Task<T> &task : tasks_) task.start(onDone, this);
+        return --pending_ > 0;
+    }
+    void await_resume() {}
+
+  private:
+    static void onDone(void *ctx)
+    {
+        WhenAllAwaiter *self = static_cast<WhenAllAwaiter *>(ctx);
+        if (--self->pending_ == 0) self->awaiting_.resume();
+    }
+
+    std::vector<Task<T>> &tasks_;
+    std::coroutine_handle<> awaiting_;
+    size_t pending_ = 0;
+};
+} // namespace detail
+
+// structured concurrency, every child completes before awaiting coroutine resumes
+template <typename T> Task<std::vector<T>> whenAll(std::vector<Task<T>> tasks)
+{
+    co_await detail::WhenAllAwaiter<T>(tasks);
+    std::vector<T> results;
+    results.reserve(tasks.size());
+    for (Task<T> &task : tasks) results.push_back(task.take());
+    co_return results;
+}
+
+inline Task<void> whenAll(std::vector<Task<void>> tasks)
+{
+    co_await detail::WhenAllAwaiter<void>(tasks);
+}
+
+// non owning view of an http-client pool
+class Pool
+{
+  public:
+    explicit Pool(httpPoolT *httpPool) : pool_(httpPool) {}
+
+    RequestAwaiter get(const char *url, const httpOptsT *opts = nullptr, httpKeyValT *tokens = nullptr)
+    {
+        return RequestAwaiter(pool_, url, opts, tokens, nullptr, 0, false);
+    }
+    RequestAwaiter post(const char *url, void *data, long len, const httpOptsT *opts = nullptr, httpKeyValT *tokens = nullptr)
+    {
+        return RequestAwaiter(pool_, url, opts, tokens, data, len, true);
+    }
+
+    // drive pool event loop until task completes
+    template <typename T> T run(Task<T> task)
+    {
+        task.start(nullptr, nullptr);
+        while (!task.done()) pool_->callback->evtRunLoop(pool_, 1);
+        return task.take();
+    }
+
+    httpPoolT *handle() const { return pool_; }
+
+  private:
+    httpPoolT *pool_;
+};
+
+} // namespace httpclient
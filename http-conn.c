@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Connection cache policy. Multi connection cache size comes from CURLMOPT_MAXCONNECTS, idle
+ * timeout and max lifetime are passed to each transfer (CURLOPT_MAXAGE_CONN and
+ * CURLOPT_MAXLIFETIME_CONN) and libcurl enforces them when it looks for a connection to reuse.
+ * Without traffic libcurl never looks, connections are then reaped from a pool timer: sockets
+ * are opened/closed through CURLOPT_OPENSOCKETFUNCTION/CLOSESOCKETFUNCTION to know their age
+ * and host, expired ones are shut down when no transfer to their host is pending and libcurl
+ * closes them as dead on next lookup. New connections vs reused ones are counted per host.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CONN_SLOTS_MIN 64
+#define CONN_REAP_MIN_MS 100
+
+// tracked connection, indexed by socket
+typedef struct
+{
+    httpHostT *host;
+    uint64_t created;
+    uint64_t lastUsed;
+    int open;
+    int reaped;
+} connSlotT;
+
+struct httpConnS
+{
+    httpConnPolicyT policy;
+    connSlotT *slots;
+    int size;
+    long open;
+    httpTimerT *reaper;
+};
+
+static void connReaperArm(httpPoolT *httpPool);
+
+static uint64_t connPeriod(httpConnPolicyT *policy)
+{
+    long period = policy->idleMs;
+    if (policy->maxAgeMs && (!period || policy->maxAgeMs < period)) period = policy->maxAgeMs;
+    period /= 2;
+    return period < CONN_REAP_MIN_MS ? CONN_REAP_MIN_MS : period;
+}
+
+static void connReapCB(httpPoolT *httpPool, void *ctx)
+{
+    httpConnT *conns = httpPool->conns;
+    httpConnPolicyT *policy = &conns->policy;
+    uint64_t now = httpNowMs();
+    conns->reaper = NULL;
+
+    for (int sock = 0; sock < conns->size; sock++) {
+        connSlotT *slot = &conns->slots[sock];
+        if (!slot->open || slot->reaped || !slot->host || slot->host->running) continue;
+
+        int idle = policy->idleMs && now - slot->lastUsed >= (uint64_t)policy->idleMs;
+        int old = policy->maxAgeMs && now - slot->created >= (uint64_t)policy->maxAgeMs;
+        if (!idle && !old) continue;
+
+        // libcurl still owns socket, it sees a dead connection and closes it on next lookup
+        shutdown(sock, SHUT_RDWR);
+        slot->reaped = 1;
+        slot->host->connReaped++;
+        httpPool->stats.connReaped++;
+        if (httpPool->verbose > 1) fprintf(stderr, "-- httpConn: reap sock=%d %s origin=%s\n", sock, idle ? "idle" : "old", slot->host->origin);
+    }
+    connReaperArm(httpPool);
+}
+
+static void connReaperArm(httpPoolT *httpPool)
+{
+    httpConnT *conns = httpPool->conns;
+    if (conns->reaper || !conns->open || (!conns->policy.idleMs && !conns->policy.maxAgeMs)) return;
+    conns->reaper = httpTimerAdd(httpPool, connPeriod(&conns->policy), connReapCB, NULL);
+}
+
+static curl_socket_t connOpenCB(void *ctx, curlsocktype purpose, struct curl_sockaddr *address)
+{
+    httpRqtT *httpRqt = (httpRqtT *)ctx;
+    httpPoolT *httpPool = httpRqt->pool;
+    httpConnT *conns = httpPool->conns;
+
+    int sock = socket(address->family, address->socktype | SOCK_CLOEXEC, address->protocol);
+    if (sock < 0 || purpose != CURLSOCKTYPE_IPCXN) return sock < 0 ? CURL_SOCKET_BAD : sock;
+
+    if (sock >= conns->size) {
+        int size = conns->size ? conns->size : CONN_SLOTS_MIN;
+        while (size <= sock) size *= 2;
+        connSlotT *slots = realloc(conns->slots, size * sizeof(connSlotT));
+        if (!slots) return sock; // not tracked, libcurl policy still applies
+        memset(&slots[conns->size], 0, (size - conns->size) * sizeof(connSlotT));
+        conns->slots = slots;
+        conns->size = size;
+    }
+
+    connSlotT *slot = &conns->slots[sock];
+    slot->host = httpRqt->host;
+    slot->created = slot->lastUsed = httpNowMs();
+    slot->open = 1;
+    slot->reaped = 0;
+    conns->open++;
+    if (slot->host) slot->host->connOpen++;
+    httpPool->stats.connOpened++;
+    connReaperArm(httpPool);
+    return sock;
+}
+
+static int connCloseCB(void *ctx, curl_socket_t sock)
+{
+    httpPoolT *httpPool = (httpPoolT *)ctx;
+    httpConnT *conns = httpPool->conns;
+
+    if (sock >= 0 && sock < conns->size && conns->slots[sock].open) {
+        connSlotT *slot = &conns->slots[sock];
+        if (slot->host) slot->host->connOpen--;
+        memset(slot, 0, sizeof(connSlotT));
+        conns->open--;
+        httpPool->stats.connClosed++;
+    }
+    return close(sock);
+}
+
+// apply pool connection policy to a transfer
+void httpConnSetup(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpConnT *conns = httpPool->conns;
+    if (!conns) return;
+
+    // libcurl counts in seconds, round up
+    if (conns->policy.idleMs > 0) curl_easy_setopt(httpRqt->easy, CURLOPT_MAXAGE_CONN, (conns->policy.idleMs + 999) / 1000);
+    if (conns->policy.maxAgeMs > 0) curl_easy_setopt(httpRqt->easy, CURLOPT_MAXLIFETIME_CONN, (conns->policy.maxAgeMs + 999) / 1000);
+
+    // socket hooks are recorded within connection, close callback must outlive request
+    curl_easy_setopt(httpRqt->easy, CURLOPT_OPENSOCKETFUNCTION, connOpenCB);
+    curl_easy_setopt(httpRqt->easy, CURLOPT_OPENSOCKETDATA, httpRqt);
+    curl_easy_setopt(httpRqt->easy, CURLOPT_CLOSESOCKETFUNCTION, connCloseCB);
+    curl_easy_setopt(httpRqt->easy, CURLOPT_CLOSESOCKETDATA, httpPool);
+}
+
+// socket activity, connection is not idle
+void httpConnTouch(httpPoolT *httpPool, int sock)
+{
+    httpConnT *conns = httpPool->conns;
+    if (conns && sock >= 0 && sock < conns->size && conns->slots[sock].open) conns->slots[sock].lastUsed = httpNowMs();
+}
+
+// transfer completed, count connection reuse
+void httpConnOnDone(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpHostT *host = httpRqt->host;
+    long connects = 0;
+
+    if (!host || !httpRqt->easy) return;
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_NUM_CONNECTS, &connects);
+    host->transfers++;
+    if (connects) {
+        host->connects += connects;
+        httpPool->stats.connNew += connects;
+    } else {
+        host->reused++;
+        httpPool->stats.connReused++;
+    }
+}
+
+int httpPoolSetConnPolicy(httpPoolT *httpPool, const httpConnPolicyT *policy)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (!policy || policy->maxConnects < 0 || policy->idleMs < 0 || policy->maxAgeMs < 0) goto OnErrorExit;
+
+    // tracking table stays, open connections still call close hook
+    if (!httpPool->conns) {
+        httpPool->conns = calloc(1, sizeof(httpConnT));
+        if (!httpPool->conns) goto OnErrorExit;
+    }
+    httpPool->conns->policy = *policy;
+
+    if (policy->maxConnects) {
+        httpPool->maxConnects = policy->maxConnects;
+        curl_multi_setopt(httpPool->multi, CURLMOPT_MAXCONNECTS, httpPool->maxConnects);
+    }
+    if (httpPool->conns->reaper) {
+        httpTimerCancel(httpPool, httpPool->conns->reaper);
+        httpPool->conns->reaper = NULL;
+    }
+    connReaperArm(httpPool);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[conn-policy-fail] invalid policy or out of memory (httpPoolSetConnPolicy)\n");
+    return -1;
+}
+
+int httpPoolHostStats(httpPoolT *httpPool, const char *url, httpHostStatsT *stats)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpHostT *host = httpHostFind(httpPool, url);
+    if (!host) return -1;
+
+    stats->transfers = host->transfers;
+    stats->connects = host->connects;
+    stats->reused = host->reused;
+    stats->reaped = host->connReaped;
+    stats->open = host->connOpen;
+    stats->running = host->running;
+    stats->limit = (long)host->limit;
+    stats->inflight = host->inflight;
+    stats->limited = host->limitQueued;
+    stats->breaker = host->breakerState;
+    stats->breakerTrips = host->breakerTrips;
+    stats->paced = host->rateQueued;
+    return 0;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Persistent response cache tier. A fixed size file is mapped in memory and used as an
+ * append-only log of records, the hash index only lives in memory and is rebuilt at open time.
+ *
+ *  Note-1: crash recovery
+ *    Each record carries a crc32 and its magic is written last. At open time the log is
+ *    replayed until the first invalid record, which becomes the new append position. A zeroed
+ *    magic is always kept after the last record so stale data beyond the tail is never replayed.
+ *
+ *  Note-2: size cap
+ *    When the file is full, live records are packed at the beginning of the log (expired
+ *    records without validator are dropped). If this is not enough the log is reset. Packing
+ *    follows the same rule as appending: a record is moved with a zeroed magic, the terminator
+ *    goes after it, then its magic is published. A crash while packing replays the records
+ *    already packed, never an older record left beyond them.
+ *
+ *  Note-3: lookups
+ *    Found records point inside the mapping until next store (packing moves them), memory
+ *    tier copies them into its own entries when it promotes a record.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAGIC_HTTP_DISK 264813
+#define DC_FILE_MAGIC "HTTPDC01"
+#define DC_REC_MAGIC 0x52435448 // 'HTCR'
+#define DC_ALIGN(len) (((len) + 7) & ~((size_t)7))
+#define DC_INDEX_MIN 256
+
+typedef enum
+{
+    DC_URL,
+    DC_VARY_NAMES,
+    DC_VARY_KEY,
+    DC_ETAG,
+    DC_LASTMOD,
+    DC_CTYPE,
+    DC_HEADERS,
+    DC_BODY,
+    DC_FIELDS, // last
+} dcFieldE;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerLen;
+    uint64_t capacity;
+} dcHeaderT;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t crc;     // crc32 from 'hash' to end of record
+    uint32_t len;     // full record length (aligned)
+    uint32_t unused;
+    int64_t expires;  // out of crc, updated in place on revalidation
+    uint64_t hash;
+    int64_t status;
+    uint32_t fieldLen[DC_FIELDS]; // 0 when absent, else field length + '\0'
+    char data[];
+} dcRecordT;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t offset; // 0 == empty slot
+} dcSlotT;
+
+struct httpDiskCacheS
+{
+    int magic;
+    int verbose;
+    int fd;
+    char *map;
+    size_t capacity;
+    size_t start;
+    size_t tail;
+    size_t count;
+    size_t slots;
+    dcSlotT *index;
+};
+
+static uint32_t crcTable[256];
+
+static uint32_t dcCrc32(const void *data, size_t len)
+{
+    const unsigned char *buffer = data;
+    uint32_t crc = 0xFFFFFFFF;
+
+    if (!crcTable[1]) for (uint32_t idx = 0; idx < 256; idx++) {
+        uint32_t value = idx;
+        for (int bit = 0; bit < 8; bit++) value = (value >> 1) ^ ((value & 1) ? 0xEDB88320 : 0);
+        crcTable[idx] = value;
+    }
+
+    while (len--) crc = crcTable[(crc ^ *buffer++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t dcRecordCrc(const dcRecordT *record)
+{
+    return dcCrc32(&record->hash, record->len - offsetof(dcRecordT, hash));
+}
+
+// map record fields without copying them
+static void dcRecordParse(const dcRecordT *record, httpCacheRecT *rec)
+{
+    const char *fields[DC_FIELDS];
+    const char *cursor = record->data;
+
+    for (int idx = 0; idx < DC_FIELDS; idx++) {
+        fields[idx] = record->fieldLen[idx] ? cursor : NULL;
+        cursor += record->fieldLen[idx];
+    }
+
+    rec->url = fields[DC_URL];
+    rec->varyNames = fields[DC_VARY_NAMES];
+    rec->varyKey = fields[DC_VARY_KEY];
+    rec->etag = fields[DC_ETAG];
+    rec->lastmod = fields[DC_LASTMOD];
+    rec->ctype = fields[DC_CTYPE];
+    rec->headers = fields[DC_HEADERS];
+    rec->hdrLen = record->fieldLen[DC_HEADERS] ? record->fieldLen[DC_HEADERS] - 1 : 0;
+    rec->body = fields[DC_BODY];
+    rec->bodyLen = record->fieldLen[DC_BODY] ? record->fieldLen[DC_BODY] - 1 : 0;
+    rec->status = record->status;
+    rec->expires = __atomic_load_n(&record->expires, __ATOMIC_RELAXED);
+}
+
+static int dcRecordValid(httpDiskCacheT *disk, size_t offset)
+{
+    const dcRecordT *record = (dcRecordT *)&disk->map[offset];
+
+    if (offset + sizeof(dcRecordT) > disk->capacity) return 0;
+    if (record->magic != DC_REC_MAGIC) return 0;
+    if (record->len < sizeof(dcRecordT) || record->len != DC_ALIGN(record->len)) return 0;
+    if (offset + record->len > disk->capacity) return 0;
+
+    size_t total = sizeof(dcRecordT);
+    for (int idx = 0; idx < DC_FIELDS; idx++) total += record->fieldLen[idx];
+    if (DC_ALIGN(total) != record->len || !record->fieldLen[DC_URL] || !record->fieldLen[DC_VARY_KEY]) return 0;
+
+    return dcRecordCrc(record) == record->crc;
+}
+
+static int dcSameKey(httpDiskCacheT *disk, uint64_t offset, const char *url, const char *varyKey)
+{
+    httpCacheRecT rec;
+    dcRecordParse((dcRecordT *)&disk->map[offset], &rec);
+    return !strcmp(rec.url, url) && !strcmp(rec.varyKey, varyKey);
+}
+
+static int dcIndexResize(httpDiskCacheT *disk, size_t slots)
+{
+    dcSlotT *index = calloc(slots, sizeof(dcSlotT));
+    if (!index) return -1;
+
+    for (size_t idx = 0; idx < disk->slots; idx++) {
+        if (!disk->index[idx].offset) continue;
+        size_t pos = disk->index[idx].hash & (slots - 1);
+        while (index[pos].offset) pos = (pos + 1) & (slots - 1);
+        index[pos] = disk->index[idx];
+    }
+    free(disk->index);
+    disk->index = index;
+    disk->slots = slots;
+    return 0;
+}
+
+// insert record within index, newer record replaces the one with the same url+vary
+static void dcIndexInsert(httpDiskCacheT *disk, uint64_t hash, size_t offset)
+{
+    httpCacheRecT rec;
+    dcRecordParse((dcRecordT *)&disk->map[offset], &rec);
+
+    if ((disk->count + 1) * 2 > disk->slots && dcIndexResize(disk, disk->slots * 2)) return;
+
+    size_t pos = hash & (disk->slots - 1);
+    for (; disk->index[pos].offset; pos = (pos + 1) & (disk->slots - 1)) {
+        if (disk->index[pos].hash == hash && dcSameKey(disk, disk->index[pos].offset, rec.url, rec.varyKey)) {
+            disk->index[pos].offset = offset;
+            return;
+        }
+    }
+    disk->index[pos].hash = hash;
+    disk->index[pos].offset = offset;
+    disk->count++;
+}
+
+// mark end of log, it prevents stale records beyond tail to be replayed
+static void dcTerminate(httpDiskCacheT *disk)
+{
+    if (disk->tail + sizeof(uint32_t) <= disk->capacity)
+        __atomic_store_n((uint32_t *)&disk->map[disk->tail], 0, __ATOMIC_RELEASE);
+}
+
+static void dcIndexClear(httpDiskCacheT *disk)
+{
+    memset(disk->index, 0, disk->slots * sizeof(dcSlotT));
+    disk->count = 0;
+    disk->tail = disk->start;
+}
+
+static void dcReset(httpDiskCacheT *disk)
+{
+    dcIndexClear(disk);
+    dcTerminate(disk);
+}
+
+static int dcCompareOffset(const void *slot1, const void *slot2)
+{
+    uint64_t offset1 = ((const dcSlotT *)slot1)->offset;
+    uint64_t offset2 = ((const dcSlotT *)slot2)->offset;
+    return (offset1 > offset2) - (offset1 < offset2);
+}
+
+// pack live records at log beginning
+static void dcCompact(httpDiskCacheT *disk)
+{
+    time_t now = time(NULL);
+    size_t count = 0;
+    dcSlotT *live = malloc((disk->count + 1) * sizeof(dcSlotT));
+    if (!live) {
+        dcReset(disk);
+        return;
+    }
+
+    for (size_t idx = 0; idx < disk->slots; idx++) {
+        if (!disk->index[idx].offset) continue;
+        dcRecordT *record = (dcRecordT *)&disk->map[disk->index[idx].offset];
+        int validator = record->fieldLen[DC_ETAG] || record->fieldLen[DC_LASTMOD];
+        if (record->expires <= now && !validator) continue;
+        live[count++] = disk->index[idx];
+    }
+    qsort(live, count, sizeof(dcSlotT), dcCompareOffset);
+
+    // records only move toward the beginning, memmove is safe. Records already in place are
+    // left untouched, moved ones are unpublished while copied and log stays terminated after them
+    dcIndexClear(disk);
+    for (size_t idx = 0; idx < count; idx++) {
+        dcRecordT *record = (dcRecordT *)&disk->map[live[idx].offset];
+        size_t len = record->len;
+        size_t offset = disk->tail;
+        if (live[idx].offset != offset) {
+            dcTerminate(disk);
+            memmove(&disk->map[offset + sizeof(uint32_t)], (char *)record + sizeof(uint32_t), len - sizeof(uint32_t));
+            disk->tail += len;
+            dcTerminate(disk);
+            __atomic_store_n((uint32_t *)&disk->map[offset], DC_REC_MAGIC, __ATOMIC_RELEASE);
+        } else {
+            disk->tail += len;
+        }
+        dcIndexInsert(disk, live[idx].hash, offset);
+    }
+    dcTerminate(disk);
+    free(live);
+
+    if (disk->verbose)
+        fprintf(stderr, "[diskcache-compact] live=%ld used=%ld/%ld (dcCompact)\n", count, disk->tail, disk->capacity);
+}
+
+int httpDiskCacheFind(httpDiskCacheT *disk, uint64_t hash, size_t *cursor, httpCacheRecT *rec)
+{
+    assert(disk->magic == MAGIC_HTTP_DISK);
+
+    for (size_t pos = (hash + *cursor) & (disk->slots - 1); disk->index[pos].offset; pos = (pos + 1) & (disk->slots - 1)) {
+        (*cursor)++;
+        if (disk->index[pos].hash != hash) continue;
+        dcRecordParse((dcRecordT *)&disk->map[disk->index[pos].offset], rec);
+        return 1;
+    }
+    return 0;
+}
+
+void httpDiskCacheTouch(httpDiskCacheT *disk, uint64_t hash, const char *url, const char *varyKey, time_t expires)
+{
+    assert(disk->magic == MAGIC_HTTP_DISK);
+
+    for (size_t pos = hash & (disk->slots - 1); disk->index[pos].offset; pos = (pos + 1) & (disk->slots - 1)) {
+        if (disk->index[pos].hash != hash || !dcSameKey(disk, disk->index[pos].offset, url, varyKey)) continue;
+        dcRecordT *record = (dcRecordT *)&disk->map[disk->index[pos].offset];
+        __atomic_store_n(&record->expires, (int64_t)expires, __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+int httpDiskCacheStore(httpDiskCacheT *disk, uint64_t hash, const httpCacheRecT *rec)
+{
+    assert(disk->magic == MAGIC_HTTP_DISK);
+    const char *fields[DC_FIELDS] = {
+        [DC_URL] = rec->url,
+        [DC_VARY_NAMES] = rec->varyNames,
+        [DC_VARY_KEY] = rec->varyKey,
+        [DC_ETAG] = rec->etag,
+        [DC_LASTMOD] = rec->lastmod,
+        [DC_CTYPE] = rec->ctype,
+        [DC_HEADERS] = rec->headers ? rec->headers : "",
+        [DC_BODY] = rec->body ? rec->body : "",
+    };
+    uint32_t fieldLen[DC_FIELDS];
+    size_t total = sizeof(dcRecordT);
+
+    for (int idx = 0; idx < DC_FIELDS; idx++) {
+        if (idx == DC_HEADERS) fieldLen[idx] = rec->hdrLen + 1;
+        else if (idx == DC_BODY) fieldLen[idx] = rec->bodyLen + 1;
+        else fieldLen[idx] = fields[idx] ? strlen(fields[idx]) + 1 : 0;
+        total += fieldLen[idx];
+    }
+    size_t len = DC_ALIGN(total);
+
+    // keep room for terminator after record
+    if (len + sizeof(uint32_t) > disk->capacity - disk->start) goto OnErrorExit;
+    if (disk->tail + len + sizeof(uint32_t) > disk->capacity) dcCompact(disk);
+    if (disk->tail + len + sizeof(uint32_t) > disk->capacity) dcReset(disk);
+
+    dcRecordT *record = (dcRecordT *)&disk->map[disk->tail];
+    char *cursor = record->data;
+    for (int idx = 0; idx < DC_FIELDS; idx++) {
+        if (!fieldLen[idx]) continue;
+        memcpy(cursor, fields[idx], fieldLen[idx] - 1);
+        cursor[fieldLen[idx] - 1] = '\0';
+        cursor += fieldLen[idx];
+    }
+    memset(cursor, 0, len - total);
+    memcpy(record->fieldLen, fieldLen, sizeof(fieldLen));
+    record->len = len;
+    record->unused = 0;
+    record->expires = rec->expires;
+    record->hash = hash;
+    record->status = rec->status;
+    record->crc = dcRecordCrc(record);
+
+    // terminate log before publishing record magic
+    size_t offset = disk->tail;
+    disk->tail += len;
+    dcTerminate(disk);
+    __atomic_store_n(&record->magic, DC_REC_MAGIC, __ATOMIC_RELEASE);
+
+    dcIndexInsert(disk, hash, offset);
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+void httpDiskCacheStats(httpDiskCacheT *disk, httpCacheStatsT *stats)
+{
+    stats->diskEntries = disk->count;
+    stats->diskBytes = disk->tail;
+    stats->diskMaxBytes = disk->capacity;
+}
+
+// open/create cache file and replay its log
+httpDiskCacheT *httpDiskCacheOpen(const char *path, size_t maxBytes, int verbose)
+{
+    struct stat fstats;
+    dcHeaderT *header;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t capacity = (maxBytes + pageSize - 1) & ~(pageSize - 1);
+    httpDiskCacheT *disk = calloc(1, sizeof(httpDiskCacheT));
+
+    disk->magic = MAGIC_HTTP_DISK;
+    disk->verbose = verbose;
+    disk->start = DC_ALIGN(sizeof(dcHeaderT));
+    disk->map = MAP_FAILED;
+    disk->fd = -1;
+    if (capacity < (size_t)pageSize) {
+        errno = EINVAL; // no syscall failed, size is below one page
+        goto OnErrorExit;
+    }
+
+    disk->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (disk->fd < 0) goto OnErrorExit;
+
+    // only one process may append to the log
+    if (flock(disk->fd, LOCK_EX | LOCK_NB) < 0) goto OnErrorExit;
+    if (fstat(disk->fd, &fstats) < 0) goto OnErrorExit;
+
+    int reset = (size_t)fstats.st_size != capacity;
+    if (reset && ftruncate(disk->fd, capacity) < 0) goto OnErrorExit;
+
+    disk->map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->map == MAP_FAILED) goto OnErrorExit;
+    disk->capacity = capacity;
+
+    header = (dcHeaderT *)disk->map;
+    if (memcmp(header->magic, DC_FILE_MAGIC, sizeof(header->magic)) || header->version != 1 ||
+        header->headerLen != disk->start || header->capacity != capacity) reset = 1;
+
+    disk->slots = DC_INDEX_MIN;
+    disk->index = calloc(disk->slots, sizeof(dcSlotT));
+    if (!disk->index) goto OnErrorExit;
+
+    if (reset) {
+        memset(header, 0, disk->start);
+        header->version = 1;
+        header->headerLen = disk->start;
+        header->capacity = capacity;
+        dcReset(disk);
+        memcpy(header->magic, DC_FILE_MAGIC, sizeof(header->magic));
+        msync(disk->map, pageSize, MS_SYNC);
+    } else {
+        // replay log until first invalid/partial record
+        for (disk->tail = disk->start; dcRecordValid(disk, disk->tail); disk->tail += ((dcRecordT *)&disk->map[disk->tail])->len) {
+            dcIndexInsert(disk, ((dcRecordT *)&disk->map[disk->tail])->hash, disk->tail);
+        }
+        dcTerminate(disk);
+    }
+
+    if (verbose)
+        fprintf(stderr, "[diskcache-open] path=%s entries=%ld used=%ld/%ld (httpDiskCacheOpen)\n", path, disk->count, disk->tail, disk->capacity);
+    return disk;
+
+OnErrorExit:
+    fprintf(stderr, "[diskcache-open-fail] path=%s size=%ld error=%s (httpDiskCacheOpen)\n", path, maxBytes, strerror(errno));
+    if (disk->map != MAP_FAILED) munmap(disk->map, capacity);
+    if (disk->fd >= 0) close(disk->fd);
+    free(disk->index);
+    free(disk);
+    return NULL;
+}
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Pool level DNS cache. Lookups run on detached worker threads and never block the event loop,
+ * workers wake the loop through pool eventfd (results are polled from pool timer when glue has
+ * no evtWakeup). Cached addresses are pushed to transfers with CURLOPT_RESOLVE, start address
+ * rotates on each request for round robin. Entries still in use are refreshed before TTL expiry,
+ * unused ones are freed once expired and libcurl resolves them again itself.
+ *
+ *  Note: default resolver queries A/AAAA records with res_nquery to get TTL, names unknown to DNS
+ *  (/etc/hosts) fallback to getaddrinfo with a default TTL. Tests may provide a stub resolver.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <assert.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define DNS_BUCKETS 64
+#define DNS_MIN_TTL 5
+#define DNS_MAX_TTL 3600
+#define DNS_DFLT_TTL 60
+#define DNS_POLL_MS 5
+#define DNS_REFRESH_PERCENT 80
+
+typedef struct dnsEntryS
+{
+    struct dnsEntryS *next;
+    httpDnsAddrT addrs[HTTP_DNS_MAX_ADDRS];
+    int count;
+    uint64_t expires;
+    unsigned int rr;
+    int pending;
+    int used;
+    httpTimerT *refresh;
+    char host[];
+} dnsEntryT;
+
+// lookup job, owned by worker until pushed on done list
+typedef struct dnsJobS
+{
+    struct dnsJobS *next;
+    httpDnsT *dns;
+    dnsEntryT *entry;
+    httpDnsAddrT addrs[HTTP_DNS_MAX_ADDRS];
+    int count;
+    long ttl;
+    char host[];
+} dnsJobT;
+
+struct httpDnsS
+{
+    httpPoolT *httpPool;
+    httpResolverCbT resolver;
+    void *ctx;
+    dnsEntryT *buckets[DNS_BUCKETS];
+    size_t entries;
+    int pending;
+    httpTimerT *poll;
+    pthread_mutex_t lock;
+    dnsJobT *done;
+};
+
+static uint64_t dnsHash(const char *host)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *host; host++) hash = (hash ^ (unsigned char)*host) * 1099511628211ULL;
+    return hash;
+}
+
+static int dnsQuery(res_state state, const char *host, int type, httpDnsAddrT *addrs, int max, long *ttl)
+{
+    unsigned char answer[NS_PACKETSZ * 4];
+    ns_msg msg;
+    ns_rr record;
+    int count = 0;
+
+    int len = res_nquery(state, host, ns_c_in, type, answer, sizeof(answer));
+    if (len < 0 || ns_initparse(answer, len, &msg)) return 0;
+
+    for (int idx = 0; idx < ns_msg_count(msg, ns_s_an) && count < max; idx++) {
+        if (ns_parserr(&msg, ns_s_an, idx, &record)) break;
+        if (ns_rr_type(record) != type) continue; // CNAME chain
+
+        int family = (type == ns_t_a) ? AF_INET : AF_INET6;
+        if (!inet_ntop(family, ns_rr_rdata(record), addrs[count].addr, sizeof(addrs[count].addr))) continue;
+        addrs[count].family = family;
+        if ((long)ns_rr_ttl(record) < *ttl) *ttl = ns_rr_ttl(record);
+        count++;
+    }
+    return count;
+}
+
+// default resolver (runs on worker thread)
+static int dnsResolve(const char *host, httpDnsAddrT *addrs, int max, long *ttl, void *ctx)
+{
+    struct __res_state state;
+    int count = 0;
+
+    *ttl = DNS_MAX_TTL;
+    memset(&state, 0, sizeof(state));
+    if (!res_ninit(&state)) {
+        count = dnsQuery(&state, host, ns_t_a, addrs, max, ttl);
+        count += dnsQuery(&state, host, ns_t_aaaa, &addrs[count], max - count, ttl);
+        res_nclose(&state);
+    }
+    if (count) return count;
+
+    // not a DNS name (ie: /etc/hosts)
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *result, *info;
+    if (getaddrinfo(host, NULL, &hints, &result)) return -1;
+    for (info = result; info && count < max; info = info->ai_next) {
+        void *addr;
+        if (info->ai_family == AF_INET) addr = &((struct sockaddr_in *)info->ai_addr)->sin_addr;
+        else if (info->ai_family == AF_INET6) addr = &((struct sockaddr_in6 *)info->ai_addr)->sin6_addr;
+        else continue;
+        if (!inet_ntop(info->ai_family, addr, addrs[count].addr, sizeof(addrs[count].addr))) continue;
+        addrs[count].family = info->ai_family;
+        count++;
+    }
+    freeaddrinfo(result);
+    *ttl = DNS_DFLT_TTL;
+    return count ? count : -1;
+}
+
+static void *dnsWorker(void *ctx)
+{
+    dnsJobT *job = (dnsJobT *)ctx;
+    httpDnsT *dns = job->dns;
+
+    job->count = dns->resolver(job->host, job->addrs, HTTP_DNS_MAX_ADDRS, &job->ttl, dns->ctx);
+
+    pthread_mutex_lock(&dns->lock);
+    job->next = dns->done;
+    dns->done = job;
+    pthread_mutex_unlock(&dns->lock);
+    httpWakeSignal(dns->httpPool);
+    return NULL;
+}
+
+static void dnsLookup(httpPoolT *httpPool, dnsEntryT *entry);
+
+static void dnsEntryFree(httpDnsT *dns, dnsEntryT *entry)
+{
+    dnsEntryT **prev = &dns->buckets[dnsHash(entry->host) % DNS_BUCKETS];
+    while (*prev != entry) prev = &(*prev)->next;
+    *prev = entry->next;
+    dns->entries--;
+    free(entry);
+}
+
+static void dnsRefreshCB(httpPoolT *httpPool, void *ctx)
+{
+    dnsEntryT *entry = (dnsEntryT *)ctx;
+    uint64_t now = httpNowMs();
+    entry->refresh = NULL;
+
+    // in use, lookup again before expiry
+    if (entry->used) {
+        httpPool->stats.dnsRefreshes++;
+        dnsLookup(httpPool, entry);
+        return;
+    }
+
+    // nobody used it since last lookup, keep it until expiry then free it (a lookup owns it while pending)
+    if (entry->pending) return;
+    if (entry->count && now < entry->expires) {
+        entry->refresh = httpTimerAdd(httpPool, entry->expires - now, dnsRefreshCB, entry);
+        return;
+    }
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpDns: host=%s expired\n", entry->host);
+    dnsEntryFree(httpPool->dns, entry);
+}
+
+// collect worker results from event loop
+static void dnsPollCB(httpPoolT *httpPool, void *ctx)
+{
+    httpDnsT *dns = (httpDnsT *)ctx;
+    dnsJobT *job, *next;
+    dns->poll = NULL;
+
+    pthread_mutex_lock(&dns->lock);
+    job = dns->done;
+    dns->done = NULL;
+    pthread_mutex_unlock(&dns->lock);
+
+    for (; job; job = next) {
+        dnsEntryT *entry = job->entry;
+        next = job->next;
+        dns->pending--;
+        entry->pending = 0;
+
+        if (job->count <= 0) {
+            httpPool->stats.dnsFailures++;
+            if (httpPool->verbose) fprintf(stderr, "[dns-lookup-fail] host=%s (dnsPollCB)\n", entry->host);
+            entry->used = 0; // retried only when asked again, freed otherwise
+            if (!entry->refresh) entry->refresh = httpTimerAdd(httpPool, DNS_MIN_TTL * 1000, dnsRefreshCB, entry);
+        } else {
+            long ttl = job->ttl;
+            if (ttl < DNS_MIN_TTL) ttl = DNS_MIN_TTL;
+            if (ttl > DNS_MAX_TTL) ttl = DNS_MAX_TTL;
+
+            memcpy(entry->addrs, job->addrs, job->count * sizeof(httpDnsAddrT));
+            entry->count = job->count;
+            entry->expires = httpNowMs() + ttl * 1000;
+            entry->used = 0;
+            if (entry->refresh) httpTimerCancel(httpPool, entry->refresh);
+            entry->refresh = httpTimerAdd(httpPool, ttl * 10 * DNS_REFRESH_PERCENT, dnsRefreshCB, entry);
+            if (httpPool->verbose > 1) fprintf(stderr, "-- httpDns: host=%s addrs=%d first=%s ttl=%lds\n", entry->host, entry->count, entry->addrs[0].addr, ttl);
+        }
+        free(job);
+    }
+
+    if (dns->pending && httpPool->wakeFd < 0) dns->poll = httpTimerAdd(httpPool, DNS_POLL_MS, dnsPollCB, dns);
+}
+
+// pool eventfd readable, a worker pushed its result
+void httpDnsCollect(httpPoolT *httpPool)
+{
+    httpDnsT *dns = httpPool->dns;
+    if (!dns) return;
+    if (dns->poll) {
+        httpTimerCancel(httpPool, dns->poll);
+        dns->poll = NULL;
+    }
+    dnsPollCB(httpPool, dns);
+}
+
+static void dnsLookup(httpPoolT *httpPool, dnsEntryT *entry)
+{
+    httpDnsT *dns = httpPool->dns;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (entry->pending) return;
+    dnsJobT *job = calloc(1, sizeof(dnsJobT) + strlen(entry->host) + 1);
+    if (!job) goto OnErrorExit;
+    job->dns = dns;
+    job->entry = entry;
+    strcpy(job->host, entry->host);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, dnsWorker, job);
+    pthread_attr_destroy(&attr);
+    if (err) goto OnErrorExit;
+
+    entry->pending = 1;
+    dns->pending++;
+    if (!dns->poll && httpPool->wakeFd < 0) dns->poll = httpTimerAdd(httpPool, DNS_POLL_MS, dnsPollCB, dns);
+    return;
+
+OnErrorExit:
+    fprintf(stderr, "[dns-worker-fail] fail to start lookup host=%s (dnsLookup)\n", entry->host);
+    free(job);
+}
+
+static dnsEntryT *dnsEntryGet(httpDnsT *dns, const char *host)
+{
+    dnsEntryT **bucket = &dns->buckets[dnsHash(host) % DNS_BUCKETS];
+
+    for (dnsEntryT *entry = *bucket; entry; entry = entry->next) {
+        if (!strcmp(entry->host, host)) return entry;
+    }
+
+    dnsEntryT *entry = calloc(1, sizeof(dnsEntryT) + strlen(host) + 1);
+    if (!entry) return NULL;
+    strcpy(entry->host, host);
+    entry->next = *bucket;
+    *bucket = entry;
+    dns->entries++;
+    return entry;
+}
+
+// split 'scheme://host:port' origin, ip literals do not need any resolution
+static int dnsUrlHost(const char *url, char *host, size_t maxlen, long *port)
+{
+    char origin[DFLT_HEADER_MAX_LEN];
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    if (httpUrlOrigin(url, origin, sizeof(origin))) return -1;
+    const char *start = strstr(origin, "://") + 3;
+    const char *colon = strrchr(start, ':');
+    if (*start == '[' || !colon || colon == start) return -1;
+    if ((size_t)(colon - start) >= maxlen) return -1;
+
+    snprintf(host, maxlen, "%.*s", (int)(colon - start), start);
+    *port = strtol(colon + 1, NULL, 10);
+    if (inet_pton(AF_INET, host, addr) == 1) return -1;
+    return 0;
+}
+
+// return CURLOPT_RESOLVE list for url (NULL when libcurl should resolve by itself)
+struct curl_slist *httpDnsResolveList(httpPoolT *httpPool, const char *url)
+{
+    httpDnsT *dns = httpPool->dns;
+    char host[256], resolve[DFLT_HEADER_MAX_LEN];
+    long port;
+
+    if (!dns || dnsUrlHost(url, host, sizeof(host), &port)) return NULL;
+    dnsEntryT *entry = dnsEntryGet(dns, host);
+    if (!entry) return NULL;
+
+    // expired or unknown, lookup in background and drop stale libcurl entry
+    if (!entry->count || httpNowMs() >= entry->expires) {
+        httpPool->stats.dnsMisses++;
+        dnsLookup(httpPool, entry);
+        if (!entry->count) return NULL;
+        entry->count = 0;
+        snprintf(resolve, sizeof(resolve), "-%s:%ld", host, port);
+        return curl_slist_append(NULL, resolve);
+    }
+
+    // rotate first address for round robin between records
+    int len = snprintf(resolve, sizeof(resolve), "%s:%ld:", host, port);
+    unsigned int start = entry->rr++;
+    for (int idx = 0; idx < entry->count && len < (int)sizeof(resolve); idx++) {
+        httpDnsAddrT *addr = &entry->addrs[(start + idx) % entry->count];
+        len += snprintf(&resolve[len], sizeof(resolve) - len, (addr->family == AF_INET6) ? "%s[%s]" : "%s%s", idx ? "," : "", addr->addr);
+    }
+    if (len >= (int)sizeof(resolve)) return NULL;
+
+    entry->used = 1;
+    httpPool->stats.dnsHits++;
+    return curl_slist_append(NULL, resolve);
+}
+
+int httpPoolSetDnsCache(httpPoolT *httpPool, httpResolverCbT resolver, void *ctx)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpDnsT *dns = httpPool->dns;
+
+    if (!dns) {
+        dns = calloc(1, sizeof(httpDnsT));
+        if (!dns) goto OnErrorExit;
+        pthread_mutex_init(&dns->lock, NULL);
+        dns->httpPool = httpPool;
+        httpPool->dns = dns;
+        (void)httpWakeSetup(httpPool); // fallback on polling
+    }
+    dns->resolver = resolver ? resolver : dnsResolve;
+    dns->ctx = ctx;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[dns-cache-fail] fail to allocate dns cache (httpPoolSetDnsCache)\n");
+    return -1;
+}
+
+int httpPoolDnsPrefetch(httpPoolT *httpPool, const char *urls[], int count)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    char host[256];
+    long port;
+    int launched = 0;
+
+    if (!httpPool->dns || count < 0) goto OnErrorExit;
+
+    for (int idx = 0; idx < count; idx++) {
+        if (dnsUrlHost(urls[idx], host, sizeof(host), &port)) continue;
+        dnsEntryT *entry = dnsEntryGet(httpPool->dns, host);
+        if (!entry) continue;
+        entry->used = 1; // refresh it until first request
+        dnsLookup(httpPool, entry);
+        launched++;
+    }
+    return launched;
+
+OnErrorExit:
+    fprintf(stderr, "[dns-prefetch-fail] dns cache not enabled or invalid count=%d (httpPoolDnsPrefetch)\n", count);
+    return -1;
+}
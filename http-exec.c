@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Completion executor. Requests sent with opts->offload have their callback run on a worker
+ * thread while event loop keeps driving sockets. Request handle is handed over as is (no body
+ * copy), once callback returned the worker pushes it on a done list and signals pool eventfd,
+ * event loop collects it to release easy handle and recycle request (a pool timer polls the
+ * list when glue has no evtWakeup). Keyed requests (opts->orderKey) are pinned to one worker
+ * and run in completion order, unkeyed ones are spread round robin and idle workers steal
+ * them from busy ones.
+ *
+ *  Note: offloaded callbacks must not call pool API (send, cancel, defer, httpRqtFree), a kept
+ *  request is released later from event loop thread.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EXEC_MAX_WORKERS 64
+#define EXEC_POLL_MS 1
+
+typedef struct
+{
+    httpRqtT *head;
+    httpRqtT *tail;
+} execQueueT;
+
+typedef struct
+{
+    httpExecT *exec;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    execQueueT pinned; // keyed requests, never stolen
+    execQueueT shared;
+} execWorkerT;
+
+struct httpExecS
+{
+    httpPoolT *httpPool;
+    int count;
+    unsigned int next;
+    long pending;
+    httpTimerT *poll;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t seq;
+    httpRqtT *done;
+    execWorkerT workers[];
+};
+
+static void execAppend(execQueueT *queue, httpRqtT *httpRqt)
+{
+    httpRqt->execNext = NULL;
+    if (queue->tail) queue->tail->execNext = httpRqt;
+    else queue->head = httpRqt;
+    queue->tail = httpRqt;
+}
+
+static httpRqtT *execPop(execQueueT *queue)
+{
+    httpRqtT *httpRqt = queue->head;
+    if (!httpRqt) return NULL;
+    queue->head = httpRqt->execNext;
+    if (!queue->head) queue->tail = NULL;
+    httpRqt->execNext = NULL;
+    return httpRqt;
+}
+
+// own queues first, then steal oldest shared request from siblings
+static httpRqtT *execTake(execWorkerT *worker)
+{
+    httpExecT *exec = worker->exec;
+    httpRqtT *httpRqt;
+
+    pthread_mutex_lock(&worker->lock);
+    httpRqt = execPop(&worker->pinned);
+    if (!httpRqt) httpRqt = execPop(&worker->shared);
+    pthread_mutex_unlock(&worker->lock);
+    if (httpRqt) return httpRqt;
+
+    int self = (int)(worker - exec->workers);
+    for (int idx = 1; idx < exec->count && !httpRqt; idx++) {
+        execWorkerT *victim = &exec->workers[(self + idx) % exec->count];
+        pthread_mutex_lock(&victim->lock);
+        httpRqt = execPop(&victim->shared);
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return httpRqt;
+}
+
+static void *execWorker(void *ctx)
+{
+    execWorkerT *worker = (execWorkerT *)ctx;
+    httpExecT *exec = worker->exec;
+
+    for (;;) {
+        // sequence is read before looking at queues, a push in between prevents sleeping
+        pthread_mutex_lock(&exec->lock);
+        uint64_t seen = exec->seq;
+        pthread_mutex_unlock(&exec->lock);
+
+        httpRqtT *httpRqt = execTake(worker);
+        if (!httpRqt) {
+            pthread_mutex_lock(&exec->lock);
+            while (exec->seq == seen) pthread_cond_wait(&exec->wake, &exec->lock);
+            pthread_mutex_unlock(&exec->lock);
+            continue;
+        }
+
+        httpRqt->execStatus = httpRqt->callback(httpRqt);
+
+        pthread_mutex_lock(&exec->lock);
+        httpRqt->execNext = exec->done;
+        exec->done = httpRqt;
+        pthread_mutex_unlock(&exec->lock);
+        httpWakeSignal(exec->httpPool);
+    }
+    return NULL;
+}
+
+// release requests whose callback returned, from event loop
+static void execPollCB(httpPoolT *httpPool, void *ctx)
+{
+    httpExecT *exec = (httpExecT *)ctx;
+    httpRqtT *httpRqt, *next;
+    exec->poll = NULL;
+
+    pthread_mutex_lock(&exec->lock);
+    httpRqt = exec->done;
+    exec->done = NULL;
+    pthread_mutex_unlock(&exec->lock);
+
+    for (; httpRqt; httpRqt = next) {
+        next = httpRqt->execNext;
+        httpRqt->execNext = NULL;
+        exec->pending--;
+        httpRqtSettle(httpRqt, httpRqt->execStatus);
+    }
+
+    if (exec->pending && httpPool->wakeFd < 0) exec->poll = httpTimerAdd(httpPool, EXEC_POLL_MS, execPollCB, exec);
+}
+
+// pool eventfd readable, a worker pushed a request whose callback returned
+void httpExecCollect(httpPoolT *httpPool)
+{
+    httpExecT *exec = httpPool->exec;
+    if (!exec) return;
+    if (exec->poll) {
+        httpTimerCancel(httpPool, exec->poll);
+        exec->poll = NULL;
+    }
+    execPollCB(httpPool, exec);
+}
+
+// hand over completed request to a worker, return -1 when callback should run inline
+int httpExecPush(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpExecT *exec = httpPool->exec;
+    if (!exec) return -1;
+
+    if (!exec->poll && httpPool->wakeFd < 0) {
+        exec->poll = httpTimerAdd(httpPool, EXEC_POLL_MS, execPollCB, exec);
+        if (!exec->poll) return -1;
+    }
+
+    int pinned = (httpRqt->execKey != 0);
+    execWorkerT *worker = &exec->workers[(pinned ? httpRqt->execKey : exec->next++) % exec->count];
+    pthread_mutex_lock(&worker->lock);
+    execAppend(pinned ? &worker->pinned : &worker->shared, httpRqt);
+    pthread_mutex_unlock(&worker->lock);
+
+    // pinned request needs its own worker awake, any worker may take a shared one
+    pthread_mutex_lock(&exec->lock);
+    exec->seq++;
+    if (pinned) pthread_cond_broadcast(&exec->wake);
+    else pthread_cond_signal(&exec->wake);
+    pthread_mutex_unlock(&exec->lock);
+
+    exec->pending++;
+    httpPool->stats.offloaded++;
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpExec: offload worker=%d pinned=%d url=%s\n", (int)(worker - exec->workers), pinned, httpRqt->url);
+    return 0;
+}
+
+// hash order key, 0 means unordered
+uint32_t httpExecKey(const char *key)
+{
+    uint32_t hash = 2166136261U; // FNV-1a
+    if (!key) return 0;
+    for (; *key; key++) hash = (hash ^ (unsigned char)*key) * 16777619U;
+    return hash ? hash : 1;
+}
+
+int httpPoolSetExecutor(httpPoolT *httpPool, int workers)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpExecT *exec;
+
+    if (httpPool->exec || workers <= 0 || workers > EXEC_MAX_WORKERS) goto OnErrorExit;
+    exec = calloc(1, sizeof(httpExecT) + workers * sizeof(execWorkerT));
+    if (!exec) goto OnErrorExit;
+    pthread_mutex_init(&exec->lock, NULL);
+    pthread_cond_init(&exec->wake, NULL);
+    exec->httpPool = httpPool;
+    (void)httpWakeSetup(httpPool); // fallback on polling
+
+    // workers live as long as process, like pool itself. They wait on lock until count is final
+    pthread_mutex_lock(&exec->lock);
+    for (int idx = 0; idx < workers; idx++) {
+        execWorkerT *worker = &exec->workers[idx];
+        worker->exec = exec;
+        pthread_mutex_init(&worker->lock, NULL);
+        if (pthread_create(&worker->thread, NULL, execWorker, worker)) break;
+        pthread_detach(worker->thread);
+        exec->count++;
+    }
+    pthread_mutex_unlock(&exec->lock);
+    if (!exec->count) {
+        free(exec);
+        goto OnErrorExit;
+    }
+
+    httpPool->exec = exec;
+    if (httpPool->verbose) fprintf(stderr, "-- httpExec: workers=%d\n", exec->count);
+    return exec->count;
+
+OnErrorExit:
+    fprintf(stderr, "[exec-create-fail] executor already set or invalid workers=%d (httpPoolSetExecutor)\n", workers);
+    return -1;
+}
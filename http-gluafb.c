@@ -89,6 +89,21 @@ OnErrorExit:
     return -1;
 }
 
+// pool eventfd written by worker threads
+static void glueOnWakeupCB (struct ev_fd *efd, int fd, uint32_t revents, void *ctx)
+{
+    httpPoolT *httpPool= (httpPoolT*)ctx;
+    (void)httpOnWakeupCB(httpPool);
+}
+
+static int glueSetWakeupCB (httpPoolT *httpPool, int fd)
+{
+    struct ev_fd *efd;
+    int err= afb_ev_mgr_add_fd(&efd, fd, EPOLLIN, glueOnWakeupCB, httpPool, 0, 0);
+    if (err < 0) return -1;
+    return 0;
+}
+
 // map libafb ontimer with multi version
 static void glueOnTimerCB(int signal, void *ctx)
 {
@@ -119,6 +134,7 @@ OnErrorExit:
 static httpCallbacksT libafbCbs = {
     .multiTimer = glueSetTimerCB,
     .multiSocket = glueSetSocketCB,
+    .evtWakeup = glueSetWakeupCB,
     .evtMainLoop = NULL,
     .evtRunLoop = NULL,
     .sl
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Response header index. Built incrementally from httpHeadersCB (libcurl delivers exactly one
+ * header line per call), names are lower-cased and hashed, name/value pairs are packed NUL
+ * terminated within one buffer and found through an open addressing table. A new status line
+ * (redirect, 100-continue) resets the index, it always describes the final response only.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HDR_MIN_ENTRIES 16
+#define HDR_MIN_BUFFER 512
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t name;  // offset within buffer
+    uint32_t value; // offset within buffer
+} hdrEntryT;
+
+struct httpHdrIndexS
+{
+    char *buffer;
+    size_t bufLen;
+    size_t bufSize;
+    hdrEntryT *entries;
+    uint32_t count;
+    uint32_t size;   // entries allocated, slot table has 2*size slots
+    uint32_t *slots; // entry index + 1, 0 when empty
+};
+
+static uint32_t hdrHash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u; // FNV-1a on lower case
+    for (size_t idx = 0; idx < len; idx++) hash = (hash ^ (unsigned char)tolower(name[idx])) * 16777619u;
+    return hash;
+}
+
+static void hdrSlotInsert(httpHdrIndexT *index, uint32_t entry)
+{
+    uint32_t mask = index->size * 2 - 1;
+    uint32_t slot = index->entries[entry].hash & mask;
+    while (index->slots[slot]) slot = (slot + 1) & mask;
+    index->slots[slot] = entry + 1;
+}
+
+static int hdrGrow(httpHdrIndexT *index)
+{
+    uint32_t size = index->size ? index->size * 2 : HDR_MIN_ENTRIES;
+    hdrEntryT *entries = realloc(index->entries, size * sizeof(hdrEntryT));
+    if (!entries) return -1;
+    index->entries = entries;
+
+    uint32_t *slots = calloc(size * 2, sizeof(uint32_t));
+    if (!slots) return -1;
+    free(index->slots);
+    index->slots = slots;
+    index->size = size;
+
+    for (uint32_t idx = 0; idx < index->count; idx++) hdrSlotInsert(index, idx);
+    return 0;
+}
+
+static void hdrReset(httpHdrIndexT *index)
+{
+    index->count = 0;
+    index->bufLen = 0;
+    if (index->slots) memset(index->slots, 0, index->size * 2 * sizeof(uint32_t));
+}
+
+// add one raw header line ("Name: value\r\n" or status line)
+int httpHdrIndexAdd(httpRqtT *httpRqt, const char *line, size_t len)
+{
+    httpHdrIndexT *index = httpRqt->hdrIndex;
+    if (!index) {
+        index = httpRqt->hdrIndex = calloc(1, sizeof(httpHdrIndexT));
+        if (!index) return -1;
+    }
+
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+    if (len >= 5 && !strncmp(line, "HTTP/", 5)) {
+        hdrReset(index);
+        return 0;
+    }
+
+    const char *colon = memchr(line, ':', len);
+    if (!colon || colon == line) return 0; // empty line closing headers or folded line
+
+    size_t nameLen = colon - line;
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    size_t valueLen = end - value;
+
+    if (index->count == index->size && hdrGrow(index)) return -1;
+    if (index->bufLen + nameLen + valueLen + 2 > index->bufSize) {
+        size_t size = index->bufSize ? index->bufSize : HDR_MIN_BUFFER;
+        while (index->bufLen + nameLen + valueLen + 2 > size) size *= 2;
+        char *buffer = realloc(index->buffer, size);
+        if (!buffer) return -1;
+        index->buffer = buffer;
+        index->bufSize = size;
+    }
+
+    hdrEntryT *entry = &index->entries[index->count];
+    entry->hash = hdrHash(line, nameLen);
+    entry->name = index->bufLen;
+    for (size_t idx = 0; idx < nameLen; idx++) index->buffer[index->bufLen++] = tolower(line[idx]);
+    index->buffer[index->bufLen++] = '\0';
+    entry->value = index->bufLen;
+    memcpy(&index->buffer[index->bufLen], value, valueLen);
+    index->bufLen += valueLen;
+    index->buffer[index->bufLen++] = '\0';
+
+    hdrSlotInsert(index, index->count++);
+    return 0;
+}
+
+// rebuild index from a raw header blob (ie: response served from cache)
+int httpHdrIndexParse(httpRqtT *httpRqt)
+{
+    const char *line = httpRqt->headers, *end = httpRqt->headers + httpRqt->hdrLen;
+
+    if (httpRqt->hdrIndex) hdrReset(httpRqt->hdrIndex);
+    while (line && line < end) {
+        const char *next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (httpHdrIndexAdd(httpRqt, line, next - line)) return -1;
+        line = next;
+    }
+    return 0;
+}
+
+void httpHdrIndexFree(httpHdrIndexT *index)
+{
+    if (!index) return;
+    free(index->buffer);
+    free(index->entries);
+    free(index->slots);
+    free(index);
+}
+
+// drop headers from a previous attempt
+void httpHdrIndexClear(httpRqtT *httpRqt)
+{
+    if (httpRqt->hdrIndex) hdrReset(httpRqt->hdrIndex);
+}
+
+const char *httpRqtHeader(httpRqtT *httpRqt, const char *name)
+{
+    httpHdrIndexT *index = httpRqt->hdrIndex;
+    if (!index || !index->count) return NULL;
+
+    uint32_t hash = hdrHash(name, strlen(name));
+    uint32_t mask = index->size * 2 - 1;
+    for (uint32_t slot = hash & mask; index->slots[slot]; slot = (slot + 1) & mask) {
+        hdrEntryT *entry = &index->entries[index->slots[slot] - 1];
+        if (entry->hash == hash && !strcasecmp(&index->buffer[entry->name], name)) return &index->buffer[entry->value];
+    }
+    return NULL;
+}
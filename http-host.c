@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Per upstream (scheme://host:port) state attached to a pool. Hosts are created on first
+ * request and live as long as the pool.
+ *
+ *  Note: prewarm
+ *    libcurl never hands CURLOPT_CONNECT_ONLY connections over to regular transfers. Prewarm
+ *    sends a HEAD request instead, DNS entry and the TCP/TLS (or h2) connection then stay
+ *    within multi caches and are reused by first real request.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOST_DFLT_BUCKETS 32
+#define HOST_PREWARM_TIMEOUT_MS 5000
+
+// extract lower case 'scheme://host:port' from url, default port is added when missing
+int httpUrlOrigin(const char *url, char *origin, size_t maxlen)
+{
+    const char *scheme = strstr(url, "://");
+    const char *host, *end, *port = NULL;
+    size_t index = 0;
+
+    if (!scheme) goto OnErrorExit;
+    host = scheme + 3;
+    end = host + strcspn(host, "/?#");
+
+    // skip userinfo
+    const char *at = memchr(host, '@', end - host);
+    if (at) host = at + 1;
+
+    // ipv6 literal may contain ':'
+    const char *colon = (*host == '[') ? memchr(host, ']', end - host) : host;
+    if (colon) colon = memchr(colon, ':', end - colon);
+    if (colon) {
+        port = colon + 1;
+        end = colon;
+    }
+
+    for (const char *cursor = url; cursor < scheme; cursor++) {
+        if (index + 1 >= maxlen) goto OnErrorExit;
+        origin[index++] = tolower(*cursor);
+    }
+    int len = snprintf(&origin[index], maxlen - index, "://%.*s", (int)(end - host), host);
+    if (len < 0 || index + len >= maxlen) goto OnErrorExit;
+    for (size_t idx = index; idx < index + len; idx++) origin[idx] = tolower(origin[idx]);
+    index += len;
+
+    if (port) len = snprintf(&origin[index], maxlen - index, ":%.*s", (int)strcspn(port, "/?#"), port);
+    else if (!strncasecmp(url, "https:", 6)) len = snprintf(&origin[index], maxlen - index, ":443");
+    else if (!strncasecmp(url, "http:", 5)) len = snprintf(&origin[index], maxlen - index, ":80");
+    else if (!strncasecmp(url, "ldaps:", 6)) len = snprintf(&origin[index], maxlen - index, ":636");
+    else if (!strncasecmp(url, "ldap:", 5)) len = snprintf(&origin[index], maxlen - index, ":389");
+    else len = 0;
+    if (len < 0 || index + len >= maxlen) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    return -1;
+}
+
+static uint64_t hostHash(const char *origin)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *origin; origin++) hash = (hash ^ (unsigned char)*origin) * 1099511628211ULL;
+    return hash;
+}
+
+static void hostResize(httpPoolT *httpPool)
+{
+    size_t buckets = httpPool->hostBuckets ? httpPool->hostBuckets * 2 : HOST_DFLT_BUCKETS;
+    httpHostT **hosts = calloc(buckets, sizeof(httpHostT *));
+    if (!hosts) return;
+
+    for (size_t idx = 0; idx < httpPool->hostBuckets; idx++) {
+        httpHostT *host, *next;
+        for (host = httpPool->hosts[idx]; host; host = next) {
+            next = host->next;
+            host->next = hosts[host->hash & (buckets - 1)];
+            hosts[host->hash & (buckets - 1)] = host;
+        }
+    }
+    free(httpPool->hosts);
+    httpPool->hosts = hosts;
+    httpPool->hostBuckets = buckets;
+}
+
+static httpHostT *hostLookup(httpPoolT *httpPool, const char *origin, uint64_t hash)
+{
+    if (!httpPool->hostBuckets) return NULL;
+    for (httpHostT *host = httpPool->hosts[hash & (httpPool->hostBuckets - 1)]; host; host = host->next) {
+        if (host->hash == hash && !strcmp(host->origin, origin)) return host;
+    }
+    return NULL;
+}
+
+// return url host handle or NULL when no request went to it yet
+httpHostT *httpHostFind(httpPoolT *httpPool, const char *url)
+{
+    char origin[DFLT_HEADER_MAX_LEN];
+    if (httpUrlOrigin(url, origin, sizeof(origin))) return NULL;
+    return hostLookup(httpPool, origin, hostHash(origin));
+}
+
+// return url host handle, create it on first call
+httpHostT *httpHostGet(httpPoolT *httpPool, const char *url)
+{
+    char origin[DFLT_HEADER_MAX_LEN];
+    if (httpUrlOrigin(url, origin, sizeof(origin))) return NULL;
+
+    uint64_t hash = hostHash(origin);
+    httpHostT *found = hostLookup(httpPool, origin, hash);
+    if (found) return found;
+
+    if (httpPool->hostCount >= httpPool->hostBuckets) hostResize(httpPool);
+    if (!httpPool->hostBuckets) return NULL;
+
+    httpHostT *host = calloc(1, sizeof(httpHostT) + strlen(origin) + 1);
+    if (!host) return NULL;
+    strcpy(host->origin, origin);
+    host->hash = hash;
+    host->next = httpPool->hosts[hash & (httpPool->hostBuckets - 1)];
+    httpPool->hosts[hash & (httpPool->hostBuckets - 1)] = host;
+    httpPool->hostCount++;
+
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpHost: new upstream origin=%s\n", origin);
+    return host;
+}
+
+// keep a sliding window of successful request latencies
+void httpHostLatency(httpHostT *host, uint64_t msTime)
+{
+    host->latency[host->latencyCount++ % HOST_LATENCY_SAMPLES] = (uint32_t)msTime;
+}
+
+static int hostCompareLatency(const void *value1, const void *value2)
+{
+    uint32_t latency1 = *(const uint32_t *)value1;
+    uint32_t latency2 = *(const uint32_t *)value2;
+    return (latency1 > latency2) - (latency1 < latency2);
+}
+
+// return latency percentile in ms or -1 when not enough samples
+long httpHostPercentile(httpHostT *host, int percentile)
+{
+    uint32_t samples[HOST_LATENCY_SAMPLES];
+    size_t count = host->latencyCount < HOST_LATENCY_SAMPLES ? host->latencyCount : HOST_LATENCY_SAMPLES;
+
+    if (count < HOST_LATENCY_MIN_SAMPLES) return -1;
+    memcpy(samples, host->latency, count * sizeof(uint32_t));
+    qsort(samples, count, sizeof(uint32_t), hostCompareLatency);
+
+    size_t index = (count * percentile) / 100;
+    if (index >= count) index = count - 1;
+    return samples[index];
+}
+
+// connect transfer to a unix socket, libcurl pools those connections per path
+void httpUnixSetup(httpRqtT *httpRqt, const char *path)
+{
+    if (path[0] == '@') curl_easy_setopt(httpRqt->easy, CURLOPT_ABSTRACT_UNIX_SOCKET, path + 1);
+    else curl_easy_setopt(httpRqt->easy, CURLOPT_UNIX_SOCKET_PATH, path);
+    if (httpRqt->verbose > 1) fprintf(stderr, "-- httpUnix: path=%s url=%s\n", path, httpRqt->url);
+}
+
+int httpPoolSetUnixRoute(httpPoolT *httpPool, const char *origin, const char *path)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    char *unixPath = NULL;
+
+    httpHostT *host = httpHostGet(httpPool, origin);
+    if (!host || (path && (!path[0] || !strcmp(path, "@")))) goto OnErrorExit;
+    if (path && !(unixPath = strdup(path))) goto OnErrorExit;
+
+    free(host->unixPath);
+    host->unixPath = unixPath;
+    if (httpPool->verbose) fprintf(stderr, "-- httpUnix: route origin=%s path=%s\n", host->origin, path ? path : "(none)");
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[unix-route-fail] invalid origin=%s or path=%s (httpPoolSetUnixRoute)\n", origin, path ? path : "(none)");
+    return -1;
+}
+
+static httpRqtActionT prewarmDoneCB(httpRqtT *httpRqt)
+{
+    httpPoolT *httpPool = (httpPoolT *)httpRqt->userData;
+
+    // any http answer (even 405) means connection is established
+    if (httpRqt->status >= 100) {
+        httpPool->stats.prewarmed++;
+        if (httpPool->verbose) fprintf(stderr, "-- httpPrewarm: connected in %lums url=%s\n", httpRqt->msTime, httpRqt->url);
+    } else {
+        httpPool->stats.prewarmFailed++;
+        fprintf(stderr, "[prewarm-fail] status=%ld url=%s (httpPoolPrewarm)\n", httpRqt->status, httpRqt->url);
+    }
+    return HTTP_HANDLE_FREE;
+}
+
+int httpPoolPrewarm(httpPoolT *httpPool, const char *urls[], int count)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpOptsT opts = {
+        .head = 1,
+        .nocache = 1,
+        .timeoutMs = HOST_PREWARM_TIMEOUT_MS,
+        .priority = HTTP_PRIO_HIGH,
+    };
+    int launched = 0;
+
+    if (count < 0 || (count && !urls)) goto OnErrorExit;
+
+    // default connection cache is sized from attached handles (x4), keep room for prewarmed ones
+    if ((long)count * 4 > httpPool->maxConnects) {
+        httpPool->maxConnects = (long)count * 4;
+        curl_multi_setopt(httpPool->multi, CURLMOPT_MAXCONNECTS, httpPool->maxConnects);
+    }
+
+    for (int idx = 0; idx < count; idx++) {
+        if (httpSendGet(httpPool, urls[idx], &opts, NULL, prewarmDoneCB, httpPool)) launched++;
+        else fprintf(stderr, "[prewarm-fail] fail to launch url=%s (httpPoolPrewarm)\n", urls[idx]);
+    }
+    return launched;
+
+OnErrorExit:
+    fprintf(stderr, "[prewarm-invalid] count=%d (httpPoolPrewarm)\n", count);
+    return -1;
+}
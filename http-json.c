@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Incremental JSON tokenizer. Each httpBodyCB chunk is scanned as it lands, tokens are
+ * (type, start, end, size, parent) offsets within httpRqt->body stored in a table sized once
+ * from opts->json, no allocation happens while parsing. A string or primitive split between two
+ * chunks simply stays open until next one. Completion callback walks tokens or queries a path.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct httpJsonS
+{
+    httpJsonTokT *tokens;
+    int size;
+    int count;
+    int super;  // open container or key waiting for its value, -1 at top level
+    int open;   // string or primitive being scanned, -1 when none
+    int escape;
+    int error;
+    long pos;   // next body byte to scan
+};
+
+httpJsonT *httpJsonNew(long maxTokens)
+{
+    httpJsonT *json = calloc(1, sizeof(httpJsonT));
+    if (!json) return NULL;
+
+    json->tokens = malloc(maxTokens * sizeof(httpJsonTokT));
+    if (!json->tokens) {
+        free(json);
+        return NULL;
+    }
+    json->size = maxTokens;
+    json->super = json->open = -1;
+    return json;
+}
+
+void httpJsonFree(httpJsonT *json)
+{
+    if (!json) return;
+    free(json->tokens);
+    free(json);
+}
+
+// body was replaced (retry, hedge winner, cached response), tokens are rebuilt on next feed
+void httpJsonReset(httpRqtT *httpRqt)
+{
+    httpJsonT *json = httpRqt->json;
+    if (!json) return;
+    json->count = json->escape = json->error = 0;
+    json->super = json->open = -1;
+    json->pos = 0;
+}
+
+static httpJsonTokT *jsonAlloc(httpJsonT *json, httpJsonTypeT type, long start)
+{
+    // object members are keys, a key holds one value, document holds one root
+    if (json->super < 0 && json->count) goto OnInvalid;
+    if (json->super >= 0) {
+        httpJsonTokT *super = &json->tokens[json->super];
+        if (super->type == HTTP_JSON_OBJECT && type != HTTP_JSON_STRING) goto OnInvalid;
+        if (super->type == HTTP_JSON_STRING && super->size) goto OnInvalid;
+    }
+    if (json->count == json->size) {
+        json->error = HTTP_JSON_ENOMEM;
+        return NULL;
+    }
+
+    httpJsonTokT *tok = &json->tokens[json->count++];
+    tok->type = type;
+    tok->start = start;
+    tok->end = -1;
+    tok->size = 0;
+    tok->parent = json->super;
+    if (json->super >= 0) json->tokens[json->super].size++;
+    return tok;
+
+OnInvalid:
+    json->error = HTTP_JSON_EINVAL;
+    return NULL;
+}
+
+static void jsonClose(httpJsonT *json, httpJsonTypeT type, long pos)
+{
+    int idx = json->super;
+
+    // closing an object right after a member value
+    if (idx >= 0 && json->tokens[idx].type == HTTP_JSON_STRING) {
+        if (!json->tokens[idx].size) goto OnInvalid;
+        idx = json->tokens[idx].parent;
+    }
+    if (idx < 0 || json->tokens[idx].type != type) goto OnInvalid;
+
+    json->tokens[idx].end = pos + 1;
+    json->super = json->tokens[idx].parent;
+    return;
+
+OnInvalid:
+    json->error = HTTP_JSON_EINVAL;
+}
+
+static int jsonDelimiter(char c)
+{
+    return c == ',' || c == ']' || c == '}' || c == ':' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// scan body bytes received since last call
+void httpJsonFeed(httpRqtT *httpRqt)
+{
+    httpJsonT *json = httpRqt->json;
+    const char *body = httpRqt->body;
+
+    if (!json || json->pos > httpRqt->bodyLen) return;
+
+    for (; json->pos < httpRqt->bodyLen && !json->error; json->pos++) {
+        long pos = json->pos;
+        char c = body[pos];
+
+        if (json->open >= 0) {
+            httpJsonTokT *tok = &json->tokens[json->open];
+            if (tok->type == HTTP_JSON_STRING) {
+                if (json->escape) json->escape = 0;
+                else if (c == '\\') json->escape = 1;
+                else if (c == '"') {
+                    tok->end = pos;
+                    json->open = -1;
+                } else if ((unsigned char)c < 0x20) json->error = HTTP_JSON_EINVAL;
+                continue;
+            }
+
+            // primitive ends on first delimiter, which is then processed as usual
+            if (!jsonDelimiter(c)) {
+                if ((unsigned char)c < 0x20 || c == '"' || c == '{' || c == '[') json->error = HTTP_JSON_EINVAL;
+                continue;
+            }
+            tok->end = pos;
+            json->open = -1;
+        }
+
+        switch (c) {
+        case '{':
+        case '[':
+            if (!jsonAlloc(json, c == '{' ? HTTP_JSON_OBJECT : HTTP_JSON_ARRAY, pos)) break;
+            json->super = json->count - 1;
+            break;
+
+        case '}':
+        case ']':
+            jsonClose(json, c == '}' ? HTTP_JSON_OBJECT : HTTP_JSON_ARRAY, pos);
+            break;
+
+        case '"':
+            if (!jsonAlloc(json, HTTP_JSON_STRING, pos + 1)) break;
+            json->open = json->count - 1;
+            break;
+
+        case ':':
+            // last token must be a complete key within an object
+            if (json->super < 0 || json->tokens[json->super].type != HTTP_JSON_OBJECT || !json->count) goto OnInvalid;
+            if (json->tokens[json->count - 1].type != HTTP_JSON_STRING || json->tokens[json->count - 1].parent != json->super) goto OnInvalid;
+            json->super = json->count - 1;
+            break;
+
+        case ',':
+            if (json->super >= 0 && json->tokens[json->super].type == HTTP_JSON_STRING) json->super = json->tokens[json->super].parent;
+            break;
+
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+
+        default:
+            if (!(c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')) goto OnInvalid;
+            if (!jsonAlloc(json, HTTP_JSON_PRIMITIVE, pos)) break;
+            json->open = json->count - 1;
+            break;
+
+        OnInvalid:
+            json->error = HTTP_JSON_EINVAL;
+        }
+    }
+}
+
+int httpRqtJson(httpRqtT *httpRqt, const httpJsonTokT **tokens)
+{
+    httpJsonT *json = httpRqt->json;
+
+    // transfer error or cancellation replaced body with an error message
+    if (!json || httpRqt->status < 100) return HTTP_JSON_ENOTOKEN;
+
+    // cached or hedged responses were not seen by httpBodyCB
+    httpJsonFeed(httpRqt);
+    if (json->error) return json->error;
+
+    // a root primitive is only closed by end of document
+    if (json->open >= 0 && json->tokens[json->open].type == HTTP_JSON_PRIMITIVE && json->open == 0) {
+        json->tokens[0].end = json->pos;
+        json->open = -1;
+    }
+    if (!json->count || json->open >= 0 || json->super >= 0) return HTTP_JSON_EPART;
+
+    if (tokens) *tokens = json->tokens;
+    return json->count;
+}
+
+// index of first token after 'idx' subtree
+static int jsonSkip(const httpJsonTokT *tokens, int count, int idx)
+{
+    long end = tokens[idx].end;
+    for (idx++; idx < count && tokens[idx].start < end; idx++);
+    return idx;
+}
+
+int httpJsonQuery(httpRqtT *httpRqt, const char *path, const char **value, long *len)
+{
+    const httpJsonTokT *tokens;
+    int count = httpRqtJson(httpRqt, &tokens);
+    if (count <= 0) return -1;
+
+    int idx = 0;
+    while (path && *path) {
+        const char *end = strchrnul(path, '.');
+        size_t keyLen = end - path;
+        const httpJsonTokT *tok = &tokens[idx];
+        int child = idx + 1, found = -1;
+
+        if (tok->type == HTTP_JSON_OBJECT) {
+            for (int member = 0; member < tok->size && child < count; member++) {
+                const httpJsonTokT *key = &tokens[child];
+                if ((size_t)(key->end - key->start) == keyLen && !memcmp(&httpRqt->body[key->start], path, keyLen)) {
+                    found = child + 1;
+                    break;
+                }
+                child = jsonSkip(tokens, count, child + 1);
+            }
+        } else if (tok->type == HTTP_JSON_ARRAY) {
+            char *tail;
+            long rank = strtol(path, &tail, 10);
+            if (tail != end || rank < 0 || rank >= tok->size) return -1;
+            for (long elem = 0; elem < rank; elem++) child = jsonSkip(tokens, count, child);
+            found = child;
+        }
+        if (found < 0 || found >= count) return -1;
+
+        idx = found;
+        path = *end ? end + 1 : end;
+    }
+
+    if (value) *value = &httpRqt->body[tokens[idx].start];
+    if (len) *len = tokens[idx].end - tokens[idx].start;
+    return idx;
+}
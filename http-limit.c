@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Adaptive per host concurrency. Each upstream gets an in-flight limit adjusted from request
+ * round-trip time (admission to completion, queue wait excluded) and errors. Requests over
+ * limit wait in a per host FIFO in front of priority lanes, a busy host does not block other
+ * hosts. AIMD adds one slot when the limit is in use and shrinks it on error or when RTT goes
+ * over tolerance x baseline. Gradient mode scales limit by baseline/RTT ratio plus a sqrt(limit)
+ * headroom. Baseline is the minimum RTT of previous sample window, it follows upstream changes.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LIMIT_DFLT_INITIAL 10
+#define LIMIT_DFLT_MAX 1000
+#define LIMIT_DFLT_TOLERANCE 2.0
+#define LIMIT_BACKOFF 0.9
+#define LIMIT_SMOOTHING 0.2
+#define LIMIT_WINDOW 100 // samples per baseline window
+
+struct httpLimitS
+{
+    httpLimitOptsT opts;
+};
+
+static uint64_t limitNowUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void limitInit(httpLimitT *limiter, httpHostT *host)
+{
+    if (host->limit > 0) return;
+    host->limit = (double)limiter->opts.initial;
+    host->rttWinMin = UINT64_MAX;
+}
+
+static void limitPush(httpHostT *host, httpRqtT *httpRqt)
+{
+    httpRqt->queueNext = NULL;
+    httpRqt->queuePrev = host->limitTail;
+    if (host->limitTail) host->limitTail->queueNext = httpRqt;
+    else host->limitHead = httpRqt;
+    host->limitTail = httpRqt;
+    httpRqt->limited = 1;
+    host->limitQueued++;
+}
+
+static void limitRemove(httpHostT *host, httpRqtT *httpRqt)
+{
+    if (httpRqt->queuePrev) httpRqt->queuePrev->queueNext = httpRqt->queueNext;
+    else host->limitHead = httpRqt->queueNext;
+    if (httpRqt->queueNext) httpRqt->queueNext->queuePrev = httpRqt->queuePrev;
+    else host->limitTail = httpRqt->queuePrev;
+    httpRqt->queueNext = httpRqt->queuePrev = NULL;
+    httpRqt->limited = 0;
+    host->limitQueued--;
+}
+
+static void limitHold(httpHostT *host, httpRqtT *httpRqt)
+{
+    httpRqt->limitHeld = 1;
+    httpRqt->limitStart = 0;
+    host->inflight++;
+}
+
+// hand waiting requests over to scheduler while host has room, not reentered by their completion
+static void limitDispatch(httpPoolT *httpPool, httpHostT *host)
+{
+    if (host->limitDispatching) return;
+    host->limitDispatching = 1;
+    while (host->limitHead && (!httpPool->limiter || host->inflight < (long)host->limit)) {
+        httpRqtT *httpRqt = host->limitHead;
+        limitRemove(host, httpRqt);
+        limitHold(host, httpRqt);
+        if (httpSchedAdmit(httpPool, httpRqt)) httpRqtComplete(httpPool, httpRqt, CURLE_FAILED_INIT);
+    }
+    host->limitDispatching = 0;
+}
+
+// new limit from one completed request
+static void limitSample(httpLimitT *limiter, httpPoolT *httpPool, httpHostT *host, uint64_t start, int failed, long inflight)
+{
+    uint64_t now = limitNowUs();
+    uint64_t rtt = now - start;
+    httpLimitOptsT *opts = &limiter->opts;
+    double limit = host->limit;
+
+    // baseline is previous window minimum, first window uses its running minimum
+    if (rtt < host->rttWinMin) host->rttWinMin = rtt;
+    if (!host->rttMin || host->rttMin > host->rttWinMin) host->rttMin = host->rttWinMin;
+    if (++host->rttSamples >= LIMIT_WINDOW) {
+        host->rttMin = host->rttWinMin;
+        host->rttWinMin = UINT64_MAX;
+        host->rttSamples = 0;
+    }
+    double tolerated = opts->tolerance * (double)(host->rttMin ? host->rttMin : 1);
+
+    if (opts->mode == HTTP_LIMIT_GRADIENT) {
+        double gradient = failed ? 0.5 : tolerated / (double)(rtt ? rtt : 1);
+        if (gradient > 1.0) gradient = 1.0;
+        if (gradient < 0.5) gradient = 0.5;
+        double target = limit * gradient + sqrt(limit);
+        limit = limit * (1.0 - LIMIT_SMOOTHING) + target * LIMIT_SMOOTHING;
+    } else if (failed || rtt > tolerated) {
+        // requests sent before last decrease saw previous limit, one decrease per congested window
+        if (start < host->limitCut) return;
+        limit = limit * LIMIT_BACKOFF;
+        host->limitCut = now;
+        httpPool->stats.limitDrops++;
+    } else if (inflight + 1 >= (long)limit) {
+        limit += 1.0; // limit is in use, probe one more slot
+    }
+
+    if (limit < opts->min) limit = opts->min;
+    if (limit > opts->max) limit = opts->max;
+    if (httpPool->verbose > 1 && (long)limit != (long)host->limit)
+        fprintf(stderr, "-- httpLimit: origin=%s limit=%ld rtt=%luus base=%luus failed=%d\n", host->origin, (long)limit, rtt, host->rttMin, failed);
+    host->limit = limit;
+}
+
+// request goes to scheduler now (0) or waits for a host slot (1)
+int httpLimitAdmit(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpLimitT *limiter = httpPool->limiter;
+    httpHostT *host = httpRqt->host;
+
+    // subscriptions would hold a slot for days and feed their lifetime as RTT
+    if (!limiter || !host || httpRqt->limitHeld || httpRqt->stream) return 0;
+    limitInit(limiter, host);
+
+    if (!host->limitHead && host->inflight < (long)host->limit) {
+        limitHold(host, httpRqt);
+        return 0;
+    }
+    limitPush(host, httpRqt);
+    httpPool->stats.limited++;
+    httpRqtWait(httpPool, httpRqt);
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpLimit: wait origin=%s inflight=%ld limit=%ld\n", host->origin, host->inflight, (long)host->limit);
+    return 1;
+}
+
+// request attempt goes to network now, lane wait and retry backoff stay out of RTT
+void httpLimitStart(httpRqtT *httpRqt)
+{
+    if (httpRqt->limitHeld) httpRqt->limitStart = limitNowUs();
+}
+
+// request completed or cancelled, free its host slot and feed limiter
+void httpLimitRelease(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpHostT *host = httpRqt->host;
+    if (!host) return;
+
+    if (httpRqt->limited) {
+        limitRemove(host, httpRqt);
+        return;
+    }
+    if (!httpRqt->limitHeld) return;
+
+    long inflight = host->inflight--;
+    uint64_t start = httpRqt->limitStart;
+    httpRqt->limitHeld = 0;
+    httpRqt->limitStart = 0;
+
+    // cancelled or never sent, says nothing about upstream
+    if (httpPool->limiter && httpRqt->status > 0 && start) {
+        int failed = (httpRqt->status < 100 || httpRqt->status == 429 || httpRqt->status >= 500);
+        limitSample(httpPool->limiter, httpPool, host, start, failed, inflight);
+    }
+    limitDispatch(httpPool, host);
+}
+
+int httpPoolSetLimiter(httpPoolT *httpPool, const httpLimitOptsT *opts)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpLimitT *limiter = httpPool->limiter;
+
+    // disabled, waiting requests go to scheduler
+    if (!opts) {
+        httpPool->limiter = NULL;
+        free(limiter);
+        for (size_t idx = 0; idx < httpPool->hostBuckets; idx++) {
+            for (httpHostT *host = httpPool->hosts[idx]; host; host = host->next) limitDispatch(httpPool, host);
+        }
+        return 0;
+    }
+    if (opts->mode != HTTP_LIMIT_AIMD && opts->mode != HTTP_LIMIT_GRADIENT) goto OnErrorExit;
+    if (opts->initial < 0 || opts->min < 0 || opts->max < 0 || opts->tolerance < 0) goto OnErrorExit;
+
+    if (!limiter && !(limiter = calloc(1, sizeof(httpLimitT)))) goto OnErrorExit;
+    limiter->opts = *opts;
+    if (!limiter->opts.initial) limiter->opts.initial = LIMIT_DFLT_INITIAL;
+    if (!limiter->opts.min) limiter->opts.min = 1;
+    if (!limiter->opts.max) limiter->opts.max = LIMIT_DFLT_MAX;
+    if (limiter->opts.tolerance < 1.0) limiter->opts.tolerance = LIMIT_DFLT_TOLERANCE;
+    if (limiter->opts.min > limiter->opts.max) {
+        if (!httpPool->limiter) free(limiter);
+        goto OnErrorExit;
+    }
+    httpPool->limiter = limiter;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[limiter-invalid] invalid mode or bounds (httpPoolSetLimiter)\n");
+    return -1;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Scatter-gather requests. One allocation holds aggregate handle, results, request ids and
+ * per request callback contexts. Every response is kept (HTTP_HANDLE_KEEP) within results and
+ * aggregate callback fires once, when all requests are done or earlier on first success,
+ * quorum or first error. Early completion cancels pending requests so results are final. The
+ * aggregate callback runs as a pool deferred job, never from within a request callback.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAGIC_HTTP_MANY 741852
+
+typedef struct
+{
+    httpManyT *many;
+    int index;
+} manyItemT;
+
+static int manyIsDone(httpManyT *many)
+{
+    if (many->completed + many->unsent == many->count) return 1;
+
+    switch (many->mode) {
+    case HTTP_MANY_FIRST_SUCCESS:
+        return many->success > 0;
+    case HTTP_MANY_QUORUM:
+        // quorum reached or out of reach
+        return many->success >= many->quorum || many->count - many->unsent - many->failed < many->quorum;
+    case HTTP_MANY_FIRST_ERROR:
+        return many->failed > 0;
+    default:
+        return 0;
+    }
+}
+
+static void manyFire(void *ctx)
+{
+    httpManyT *many = (httpManyT *)ctx;
+
+    // early completion, pending requests complete as cancelled
+    for (int idx = 0; idx < many->count; idx++) {
+        if (!many->results[idx] && many->ids[idx]) httpCancel(many->pool, many->ids[idx]);
+    }
+
+    if (many->pool->verbose > 1)
+        fprintf(stderr, "-- httpMany: done count=%d success=%d failed=%d unsent=%d\n", many->count, many->success, many->failed, many->unsent);
+
+    httpRqtActionT status = many->callback(many);
+    if (status == HTTP_HANDLE_FREE) httpManyFree(many);
+}
+
+static httpRqtActionT manyItemCB(httpRqtT *httpRqt)
+{
+    manyItemT *item = (manyItemT *)httpRqt->userData;
+    httpManyT *many = item->many;
+
+    many->results[item->index] = httpRqt;
+    httpRqt->freeCtx = NULL; // request context is owned by aggregate
+    many->completed++;
+    if (httpRqt->status >= 200 && httpRqt->status < 400) many->success++;
+    else many->failed++;
+
+    if (!many->fired && manyIsDone(many)) {
+        many->fired = 1;
+        if (httpPoolDefer(many->pool, &many->defer)) many->fired = 0;
+    }
+
+    // aggregate owns responses
+    return HTTP_HANDLE_KEEP;
+}
+
+int httpSendMany(httpPoolT *httpPool, const httpManyRqtT *rqts, int count, httpManyModeT mode, int quorum, httpManyCbT callback, void *ctx)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (count <= 0 || !callback) goto OnErrorExit;
+
+    // item callback defers aggregate completion, it must run on event loop thread
+    for (int idx = 0; idx < count; idx++) {
+        if (rqts[idx].opts && rqts[idx].opts->offload) {
+            fprintf(stderr, "[many-invalid] url=%s opts->offload is not supported within aggregate (httpSendMany)\n", rqts[idx].url);
+            goto OnErrorExit;
+        }
+    }
+
+    // handle, results, ids and item contexts are contiguous
+    size_t size = sizeof(httpManyT) + count * (sizeof(httpRqtT *) + sizeof(httpRqtIdT) + sizeof(manyItemT));
+    httpManyT *many = calloc(1, size);
+    if (!many) goto OnErrorExit;
+    many->results = (httpRqtT **)(many + 1);
+    many->ids = (httpRqtIdT *)(many->results + count);
+    manyItemT *items = (manyItemT *)(many->ids + count);
+
+    many->magic = MAGIC_HTTP_MANY;
+    many->pool = httpPool;
+    many->count = count;
+    many->mode = mode;
+    many->quorum = (quorum > 0 && quorum <= count) ? quorum : count / 2 + 1;
+    many->callback = callback;
+    many->userData = ctx;
+    many->defer.callback = manyFire;
+    many->defer.ctx = many;
+
+    for (int idx = 0; idx < count; idx++) {
+        items[idx].many = many;
+        items[idx].index = idx;
+
+        // a synchronous completion (ie: cache hit) may already satisfy early completion
+        if (many->fired) {
+            many->unsent++;
+            continue;
+        }
+
+        if (rqts[idx].data) many->ids[idx] = httpSendPost(httpPool, rqts[idx].url, rqts[idx].opts, rqts[idx].tokens, rqts[idx].data, rqts[idx].datalen, manyItemCB, &items[idx]);
+        else many->ids[idx] = httpSendGet(httpPool, rqts[idx].url, rqts[idx].opts, rqts[idx].tokens, manyItemCB, &items[idx]);
+
+        if (!many->ids[idx] && !many->results[idx]) {
+            fprintf(stderr, "[many-send-fail] url=%s (httpSendMany)\n", rqts[idx].url);
+            many->unsent++;
+        }
+    }
+
+    // every request failed to send, aggregate still completes once
+    if (!many->fired && manyIsDone(many)) {
+        many->fired = 1;
+        if (httpPoolDefer(httpPool, &many->defer)) manyFire(many);
+    }
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[many-invalid] count=%d (httpSendMany)\n", count);
+    return -1;
+}
+
+void httpManyFree(httpManyT *many)
+{
+    assert(many->magic == MAGIC_HTTP_MANY);
+    for (int idx = 0; idx < many->count; idx++) {
+        if (many->results[idx]) httpRqtFree(many->results[idx]);
+    }
+    free(many);
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Internal API shared between http-*.c modules. Not exposed to applications.
+ */
+
+#pragma once
+
+#include "http-client.h"
+
+#include <time.h>
+
+// response header index (http-header.c)
+int httpHdrIndexAdd(httpRqtT *httpRqt, const char *line, size_t len);
+int httpHdrIndexParse(httpRqtT *httpRqt);
+void httpHdrIndexClear(httpRqtT *httpRqt);
+void httpHdrIndexFree(httpHdrIndexT *index);
+
+// request slots and buffers (http-slab.c)
+httpRqtT *httpRqtNew(httpPoolT *httpPool);
+void httpRqtRecycle(httpRqtT *httpRqt);
+void httpScratchFree(httpRqtT *httpRqt);
+int httpRqtReserve(char **buffer, size_t *size, size_t need);
+
+// pool memory budget (http-budget.c)
+int httpBudgetCharge(httpRqtT *httpRqt, size_t size);
+void httpBudgetDrop(httpRqtT *httpRqt);
+void httpBudgetRelease(httpRqtT *httpRqt);
+
+// incremental JSON tokenizer (http-json.c)
+httpJsonT *httpJsonNew(long maxTokens);
+void httpJsonFree(httpJsonT *json);
+void httpJsonReset(httpRqtT *httpRqt);
+void httpJsonFeed(httpRqtT *httpRqt);
+
+// search a 'name: value' header within a request header list
+const char *httpSlistLookup(const struct curl_slist *list, const char *name, size_t *len);
+
+// cached response fields shared by memory and persistent tiers (strings are NUL terminated)
+typedef struct
+{
+    const char *url;
+    const char *varyNames;
+    const char *varyKey;
+    const char *etag;
+    const char *lastmod;
+    const char *ctype;
+    const char *headers;
+    const char *body;
+    long hdrLen;
+    long bodyLen;
+    long status;
+    time_t expires;
+} httpCacheRecT;
+
+// response cache hooks (http-cache.c)
+httpCacheEntryT *httpCacheLookup(httpCacheT *cache, const char *url, const struct curl_slist *rqtHeaders);
+int httpCacheIsFresh(httpCacheEntryT *entry);
+struct curl_slist *httpCacheValidators(httpCacheEntryT *entry, struct curl_slist *rqtHeaders);
+int httpCacheServe(httpCacheEntryT *entry, httpRqtT *httpRqt);
+void httpCacheOnDone(httpCacheT *cache, httpRqtT *httpRqt);
+void httpCacheRelease(httpCacheEntryT *entry);
+
+// persistent mmap'd cache tier (http-diskcache.c), returned records point within mapping until next store
+typedef struct httpDiskCacheS httpDiskCacheT;
+httpDiskCacheT *httpDiskCacheOpen(const char *path, size_t maxBytes, int verbose);
+int httpDiskCacheFind(httpDiskCacheT *disk, uint64_t hash, size_t *cursor, httpCacheRecT *rec);
+int httpDiskCacheStore(httpDiskCacheT *disk, uint64_t hash, const httpCacheRecT *rec);
+void httpDiskCacheTouch(httpDiskCacheT *disk, uint64_t hash, const char *url, const char *varyKey, time_t expires);
+void httpDiskCacheStats(httpDiskCacheT *disk, httpCacheStatsT *stats);
+
+// request completion with libcurl status (http-client.c)
+void httpRqtComplete(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus);
+
+// release transfer resources once callback returned, free request on HTTP_HANDLE_FREE (http-client.c)
+void httpRqtSettle(httpRqtT *httpRqt, httpRqtActionT status);
+
+// completion executor (http-exec.c)
+int httpExecPush(httpPoolT *httpPool, httpRqtT *httpRqt);
+uint32_t httpExecKey(const char *key);
+void httpExecCollect(httpPoolT *httpPool);
+
+// set attempt timeout from request deadline, return -1 when deadline is over (http-client.c)
+int httpRqtDeadline(httpRqtT *httpRqt);
+
+// complete queued request when its deadline is over, cancelled once it leaves queues (http-client.c)
+void httpRqtWait(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpRqtWaitDone(httpPoolT *httpPool, httpRqtT *httpRqt);
+
+// hand over an admitted request to libcurl multi, return -1 on failure (http-client.c)
+int httpRqtStart(httpPoolT *httpPool, httpRqtT *httpRqt);
+
+// priority lanes admission (http-sched.c)
+int httpSchedAdmit(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpSchedRelease(httpPoolT *httpPool, httpRqtT *httpRqt);
+long httpSchedStreamWeight(httpPoolT *httpPool, httpPriorityT priority);
+
+// pool timer jobs multiplexed on glue timer (http-timer.c)
+typedef void (*httpTimerCbT)(httpPoolT *httpPool, void *ctx);
+uint64_t httpNowMs(void);
+httpTimerT *httpTimerAdd(httpPoolT *httpPool, uint64_t delay, httpTimerCbT callback, void *ctx);
+void httpTimerCancel(httpPoolT *httpPool, httpTimerT *timer);
+void httpTimerRun(httpPoolT *httpPool);
+int httpTimerArm(httpPoolT *httpPool);
+int httpWakeSetup(httpPoolT *httpPool);
+void httpWakeSignal(httpPoolT *httpPool);
+
+// per upstream state (http-host.c)
+#define HOST_LATENCY_SAMPLES 64
+#define HOST_LATENCY_MIN_SAMPLES 8
+struct httpHostS
+{
+    httpHostT *next;
+    uint64_t hash;
+    uint32_t latency[HOST_LATENCY_SAMPLES];
+    uint32_t latencyCount;
+    uint64_t bodyAvg; // adaptive socket profile
+    long running;     // pending requests
+    uint64_t transfers;
+    uint64_t connects;
+    uint64_t reused;
+    uint64_t connReaped;
+    long connOpen;
+    char *unixPath;   // unix socket route
+    double limit;     // adaptive concurrency (http-limit.c)
+    long inflight;
+    long limitQueued;
+    uint64_t limitCut; // last decrease (us)
+    httpRqtT *limitHead;
+    httpRqtT *limitTail;
+    int limitDispatching;
+    uint64_t rttMin;  // baseline rtt (us)
+    uint64_t rttWinMin;
+    int rttSamples;
+    httpBreakerStateT breakerState; // circuit breaker (http-breaker.c)
+    uint32_t breakerOutcomes;
+    int breakerSamples;
+    int breakerTrips;
+    uint64_t breakerUntil;
+    int probeRunning;
+    int probeOk;
+    httpTimerT *breakerTimer;
+    int rateSet;       // token bucket (http-rate.c)
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t rateRefill;
+    uint64_t rateUntil; // held by 429/Retry-After
+    long rateQueued;
+    httpRqtT *rateHead;
+    httpRqtT *rateTail;
+    httpTimerT *rateTimer;
+    int rateDispatching;
+    char origin[];
+};
+int httpUrlOrigin(const char *url, char *origin, size_t maxlen);
+httpHostT *httpHostGet(httpPoolT *httpPool, const char *url);
+httpHostT *httpHostFind(httpPoolT *httpPool, const char *url);
+void httpUnixSetup(httpRqtT *httpRqt, const char *path);
+void httpHostLatency(httpHostT *host, uint64_t msTime);
+long httpHostPercentile(httpHostT *host, int percentile);
+
+// pool dns cache (http-dns.c)
+struct curl_slist *httpDnsResolveList(httpPoolT *httpPool, const char *url);
+void httpDnsCollect(httpPoolT *httpPool);
+
+// persistent tls sessions (http-tls.c)
+void httpTlsSetup(httpPoolT *httpPool, httpRqtT *httpRqt);
+
+// pool socket profile (http-sock.c)
+void httpSockSetup(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpSockLearn(httpPoolT *httpPool, httpRqtT *httpRqt);
+
+// connection cache policy (http-conn.c)
+void httpConnSetup(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpConnOnDone(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpConnTouch(httpPoolT *httpPool, int sock);
+
+// upstream groups (http-upstream.c)
+int httpUpstreamIs(const char *url);
+const char *httpUpstreamPick(httpPoolT *httpPool, httpRqtT *httpRqt, const char *url);
+void httpUpstreamDone(httpPoolT *httpPool, httpRqtT *httpRqt);
+
+// adaptive concurrency limiter (http-limit.c)
+int httpLimitAdmit(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpLimitRelease(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpLimitStart(httpRqtT *httpRqt);
+
+// per host circuit breaker (http-breaker.c)
+int httpBreakerAdmit(httpPoolT *httpPool, httpRqtT *httpRqt, httpHostT *host);
+void httpBreakerDone(httpPoolT *httpPool, httpRqtT *httpRqt);
+int httpBreakerIsOpen(httpPoolT *httpPool, httpHostT *host);
+
+// per host token bucket (http-rate.c)
+int httpRateAdmit(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpRateRelease(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpRateFeedback(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus);
+
+// retry and hedging policies (http-retry.c)
+void httpRetryInit(httpPoolT *httpPool);
+void httpRetryOpts(httpRqtT *httpRqt, const httpOptsT *opts);
+void httpRetryDeposit(httpPoolT *httpPool);
+long httpRetryDelay(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus);
+long httpRetryAfter(httpRqtT *httpRqt);
+int httpRetrySchedule(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus);
+void httpRetryResume(httpPoolT *httpPool, httpRqtT *httpRqt);
+void httpHedgeArm(httpPoolT *httpPool, httpRqtT *httpRqt, long percentile);
+httpRqtT *httpHedgeOnDone(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode *estatus);
+void httpHedgeCancel(httpPoolT *httpPool, httpRqtT *httpRqt);
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Parallel byte-range download. A HEAD request gets object size and Accept-Ranges, file is
+ * preallocated and split into N "Range: bytes=a-b" GETs that run on their own connections,
+ * each segment body goes straight to its file offset with pwrite (request sink, nothing is
+ * buffered). Servers without ranges, objects of unknown size, failed HEAD or a GET answering
+ * 200 to a range fall back to a single stream. One completion reports object status and
+ * per segment timing, it runs as a pool deferred job like scatter-gather aggregates.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAGIC_HTTP_RANGED 963852
+#define RANGED_DFLT_SEGMENTS 4
+#define RANGED_MAX_SEGMENTS 64
+#define RANGED_DFLT_MIN_SEGMENT (1024 * 1024)
+
+static void rangedStart(httpRangedT *ranged, int count);
+
+// probe and segments share caller options, body never goes to cache or memory
+static httpOptsT rangedOpts(const httpOptsT *opts, long head, httpSinkCbT sink)
+{
+    static const httpOptsT none;
+    if (!opts) opts = &none;
+
+    httpOptsT out = {
+        .username = opts->username,
+        .password = opts->password,
+        .timeout = opts->timeout,
+        .sslchk = opts->sslchk,
+        .verbose = opts->verbose,
+        .speedlimit = opts->speedlimit,
+        .speedlow = opts->speedlow,
+        .follow = opts->follow,
+        .maxredir = opts->maxredir,
+        .cainfo = opts->cainfo,
+        .sslcert = opts->sslcert,
+        .sslkey = opts->sslkey,
+        .agent = opts->agent,
+        .nocache = 1,
+        .retries = opts->retries,
+        .backoff = opts->backoff,
+        .backoffMax = opts->backoffMax,
+        .timeoutMs = opts->timeoutMs,
+        .connectMs = opts->connectMs,
+        .deadline = opts->deadline,
+        .parent = opts->parent,
+        .priority = opts->priority,
+        .head = head,
+        .unixSocket = opts->unixSocket,
+        .headers = opts->headers,
+        .sink = sink,
+    };
+    return out;
+}
+
+static void rangedFire(void *ctx)
+{
+    httpRangedT *ranged = (httpRangedT *)ctx;
+    struct timespec now;
+
+    close(ranged->fd);
+    ranged->fd = -1;
+
+    // first failing segment gives object status (siblings are then cancelled), a short segment is a partial file
+    ranged->status = ranged->failure ? ranged->failure : 200;
+    for (int idx = 0; idx < ranged->count && ranged->status == 200; idx++) {
+        httpSegmentT *segment = &ranged->segments[idx];
+        if (segment->length >= 0 && segment->received != segment->length) ranged->status = CURLE_PARTIAL_FILE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ranged->msTime = (now.tv_nsec - ranged->startTime.tv_nsec) / 1000000 + (now.tv_sec - ranged->startTime.tv_sec) * 1000;
+    if (ranged->pool->verbose) fprintf(stderr, "-- httpRanged: done status=%ld size=%ld segments=%d ranged=%d in %lums path=%s\n", ranged->status, (long)ranged->size, ranged->count, ranged->ranged, ranged->msTime, ranged->path);
+
+    httpRqtActionT status = ranged->callback(ranged);
+    if (status == HTTP_HANDLE_FREE) httpRangedFree(ranged);
+}
+
+static void rangedDone(httpRangedT *ranged)
+{
+    if (ranged->pending || ranged->busy) return;
+
+    // a server that ignored ranges wrote nothing, restart as a single stream
+    if (ranged->fallback == 1) {
+        ranged->fallback = 2;
+        ranged->ranged = 0;
+        rangedStart(ranged, 1);
+        return;
+    }
+    if (httpPoolDefer(ranged->pool, &ranged->defer)) rangedFire(ranged);
+}
+
+// stop sibling segments, object cannot complete anymore
+static void rangedAbort(httpRangedT *ranged)
+{
+    ranged->busy = 1;
+    for (int idx = 0; idx < ranged->count; idx++) {
+        if (ranged->segments[idx].id) httpCancel(ranged->pool, ranged->segments[idx].id);
+    }
+    ranged->busy = 0;
+}
+
+static size_t rangedSinkCB(httpRqtT *httpRqt, const char *data, size_t len)
+{
+    httpSegmentT *segment = (httpSegmentT *)httpRqt->userData;
+    httpRangedT *ranged = segment->ranged;
+    long status = 0;
+
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &status);
+    if (ranged->ranged && status == 200) {
+        ranged->fallback = 1;
+        return 0;
+    }
+    if (status != 200 && status != 206) return len; // error page, not part of object
+
+    if (segment->length >= 0 && httpRqt->bodyLen + (curl_off_t)len > segment->length) return 0;
+    off_t offset = segment->offset + httpRqt->bodyLen;
+    for (size_t done = 0; done < len;) {
+        ssize_t count = pwrite(ranged->fd, data + done, len - done, offset + done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) {
+            fprintf(stderr, "[ranged-write-fail] path=%s offset=%ld error=%s (rangedSinkCB)\n", ranged->path, (long)(offset + done), strerror(errno));
+            return 0;
+        }
+        done += count;
+    }
+    return len;
+}
+
+static httpRqtActionT rangedSegmentCB(httpRqtT *httpRqt)
+{
+    httpSegmentT *segment = (httpSegmentT *)httpRqt->userData;
+    httpRangedT *ranged = segment->ranged;
+
+    segment->id = 0;
+    segment->done = 1;
+    segment->status = httpRqt->status;
+    segment->received = httpRqt->bodyLen;
+    segment->msTime = httpRqt->msTime;
+    ranged->pending--;
+    if (ranged->pool->verbose > 1) fprintf(stderr, "-- httpRanged: segment=%d status=%ld bytes=%ld in %lums\n", segment->index, segment->status, (long)segment->received, segment->msTime);
+
+    int failed = (segment->status != 200 && segment->status != 206);
+    if (failed && !ranged->failure) {
+        ranged->failure = segment->status;
+        if (!ranged->busy) rangedAbort(ranged);
+    }
+    rangedDone(ranged);
+    return HTTP_HANDLE_FREE;
+}
+
+static void rangedStart(httpRangedT *ranged, int count)
+{
+    httpOptsT opts = rangedOpts(ranged->opts, 0, rangedSinkCB);
+    char range[64];
+    httpKeyValT tokens[] = {
+        {.tag = "Range", .value = range},
+        {NULL},
+    };
+
+    // preallocated file, segments write in place (fallocate keeps extents contiguous)
+    if (ranged->size > 0 && posix_fallocate(ranged->fd, 0, ranged->size) && ftruncate(ranged->fd, ranged->size))
+        fprintf(stderr, "[ranged-alloc-fail] path=%s size=%ld error=%s (rangedStart)\n", ranged->path, (long)ranged->size, strerror(errno));
+
+    curl_off_t chunk = (count > 1) ? ranged->size / count : 0;
+    ranged->count = count;
+    ranged->pending = count;
+    ranged->failure = 0;
+    ranged->busy = 1;
+    for (int idx = 0; idx < count; idx++) {
+        httpSegmentT *segment = &ranged->segments[idx];
+        memset(segment, 0, sizeof(httpSegmentT));
+        segment->ranged = ranged;
+        segment->index = idx;
+        segment->offset = idx * chunk;
+        segment->length = (count > 1) ? (idx == count - 1 ? ranged->size - segment->offset : chunk) : ranged->size;
+        snprintf(range, sizeof(range), "bytes=%ld-%ld", (long)segment->offset, (long)(segment->offset + segment->length - 1));
+
+        // a send may complete synchronously (ie: open circuit), segment callback then already ran
+        httpRqtIdT id = httpSendGet(ranged->pool, ranged->url, &opts, count > 1 ? tokens : NULL, rangedSegmentCB, segment);
+        if (segment->done) continue;
+        if (id) {
+            segment->id = id;
+        } else {
+            segment->status = CURLE_FAILED_INIT;
+            if (!ranged->failure) ranged->failure = CURLE_FAILED_INIT;
+            ranged->pending--;
+        }
+    }
+    ranged->busy = 0;
+    if (ranged->verbose) fprintf(stderr, "-- httpRanged: start segments=%d size=%ld url=%s\n", count, (long)ranged->size, ranged->url);
+
+    // a segment failed while others were launched
+    if (ranged->failure && ranged->pending) rangedAbort(ranged);
+    rangedDone(ranged);
+}
+
+static httpRqtActionT rangedProbeCB(httpRqtT *httpRqt)
+{
+    httpRangedT *ranged = (httpRangedT *)httpRqt->userData;
+    curl_off_t size = -1;
+    int count = 1;
+
+    if (httpRqt->status >= 200 && httpRqt->status < 300 && httpRqt->easy) {
+        const char *ranges = httpRqtHeader(httpRqt, "accept-ranges");
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+        if (size > 0 && ranges && !strcasecmp(ranges, "bytes")) {
+            curl_off_t fit = size / ranged->minSegment;
+            count = fit < ranged->max ? (int)fit : ranged->max;
+            if (count < 1) count = 1;
+        }
+    }
+
+    // unknown size or no range support, one plain GET
+    ranged->size = size;
+    ranged->ranged = (count > 1);
+    rangedStart(ranged, count);
+    return HTTP_HANDLE_FREE;
+}
+
+int httpDownloadRanged(httpPoolT *httpPool, const char *url, const char *path, const httpRangedOptsT *ropts, httpRangedCbT callback, void *ctx)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpRangedT *ranged = NULL;
+    int segments = (ropts && ropts->segments) ? ropts->segments : RANGED_DFLT_SEGMENTS;
+
+    if (!url || !path || !callback || segments < 1 || segments > RANGED_MAX_SEGMENTS) goto OnErrorExit;
+    if (ropts && ropts->minSegment < 0) goto OnErrorExit;
+
+    // handle and segments are contiguous
+    ranged = calloc(1, sizeof(httpRangedT) + segments * sizeof(httpSegmentT));
+    if (!ranged) goto OnErrorExit;
+    ranged->magic = MAGIC_HTTP_RANGED;
+    ranged->segments = (httpSegmentT *)(ranged + 1);
+    ranged->fd = -1;
+    ranged->pool = httpPool;
+    ranged->verbose = httpPool->verbose;
+    ranged->callback = callback;
+    ranged->userData = ctx;
+    ranged->max = segments;
+    ranged->minSegment = (ropts && ropts->minSegment) ? ropts->minSegment : RANGED_DFLT_MIN_SEGMENT;
+    ranged->opts = ropts ? ropts->opts : NULL;
+    ranged->size = -1;
+    ranged->defer.callback = rangedFire;
+    ranged->defer.ctx = ranged;
+    clock_gettime(CLOCK_MONOTONIC, &ranged->startTime);
+    if (!(ranged->url = strdup(url)) || !(ranged->path = strdup(path))) goto OnErrorExit;
+
+    ranged->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ranged->fd < 0) goto OnErrorExit;
+
+    httpOptsT opts = rangedOpts(ranged->opts, 1, NULL);
+    if (!httpSendGet(httpPool, url, &opts, NULL, rangedProbeCB, ranged)) goto OnErrorExit;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[ranged-invalid] url=%s path=%s segments=%d error=%s (httpDownloadRanged)\n", url ? url : "(null)", path ? path : "(null)", segments, strerror(errno));
+    if (ranged) {
+        if (ranged->fd >= 0) close(ranged->fd);
+        free(ranged->url);
+        free(ranged->path);
+        free(ranged);
+    }
+    return -1;
+}
+
+void httpRangedFree(httpRangedT *ranged)
+{
+    assert(ranged->magic == MAGIC_HTTP_RANGED);
+    if (ranged->fd >= 0) close(ranged->fd);
+    free(ranged->url);
+    free(ranged->path);
+    free(ranged);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Per host request rate. Each host (or pool default) token bucket refills at 'rate' requests
+ * per second up to 'burst', a request takes one token when it is admitted. Requests without
+ * token wait in a per host FIFO in front of concurrency limiter and priority lanes, a pool
+ * timer armed for next token release them, nothing polls. A 429 answer (or 503 with
+ * Retry-After) empties host bucket and holds its requests until Retry-After delay (1s when
+ * missing), with or without configured rate. Retries take a token too, they wait with new
+ * requests but keep their scheduler and limiter slots. Routes are origins: a route to an
+ * upstream group replica is paced on replica origin.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RATE_DFLT_HOLD_MS 1000
+#define RATE_MAX_HOLD_MS 300000
+
+struct httpRateS
+{
+    double rate; // pool default, hosts without their own bucket
+    double burst;
+};
+
+static void rateArm(httpPoolT *httpPool, httpHostT *host);
+
+// host bucket, pool default unless host has its own
+static double rateOf(httpPoolT *httpPool, httpHostT *host, double *burst)
+{
+    if (host->rateSet) {
+        *burst = host->burst;
+        return host->rate;
+    }
+    *burst = httpPool->rate ? httpPool->rate->burst : 0;
+    return httpPool->rate ? httpPool->rate->rate : 0;
+}
+
+static void rateRefill(httpPoolT *httpPool, httpHostT *host, uint64_t now)
+{
+    double burst, rate = rateOf(httpPool, host, &burst);
+    if (!host->rateRefill) host->tokens = burst; // first use, bucket is full
+    else if (now > host->rateRefill) host->tokens += (double)(now - host->rateRefill) * rate / 1000.0;
+    else return; // held by server feedback, refill starts when hold ends
+    if (host->tokens > burst) host->tokens = burst;
+    host->rateRefill = now;
+}
+
+// request may go on now: host not held and a token is available (or no rate)
+static int rateTake(httpPoolT *httpPool, httpHostT *host, uint64_t now)
+{
+    double burst, rate = rateOf(httpPool, host, &burst);
+    if (now < host->rateUntil) return 0;
+    if (rate <= 0) return 1;
+
+    rateRefill(httpPool, host, now);
+    if (host->tokens < 1.0) return 0;
+    host->tokens -= 1.0;
+    return 1;
+}
+
+static void rateRemove(httpHostT *host, httpRqtT *httpRqt)
+{
+    if (httpRqt->queuePrev) httpRqt->queuePrev->queueNext = httpRqt->queueNext;
+    else host->rateHead = httpRqt->queueNext;
+    if (httpRqt->queueNext) httpRqt->queueNext->queuePrev = httpRqt->queuePrev;
+    else host->rateTail = httpRqt->queuePrev;
+    httpRqt->queueNext = httpRqt->queuePrev = NULL;
+    httpRqt->paced = 0;
+    host->rateQueued--;
+}
+
+// release requests holding a token, not reentered by their completion
+static void rateDispatch(httpPoolT *httpPool, httpHostT *host)
+{
+    uint64_t now = httpNowMs();
+
+    if (host->rateDispatching) return;
+    host->rateDispatching = 1;
+    while (host->rateHead && rateTake(httpPool, host, now)) {
+        httpRqtT *httpRqt = host->rateHead;
+        rateRemove(host, httpRqt);
+        httpRqt->ratePassed = 1;
+        if (httpRqt->rateRetry) {
+            httpRqt->rateRetry = 0;
+            httpRetryResume(httpPool, httpRqt);
+        } else if (httpSchedAdmit(httpPool, httpRqt)) {
+            httpRqtComplete(httpPool, httpRqt, CURLE_FAILED_INIT);
+        }
+    }
+    host->rateDispatching = 0;
+    rateArm(httpPool, host);
+}
+
+static void rateTimerCB(httpPoolT *httpPool, void *ctx)
+{
+    httpHostT *host = (httpHostT *)ctx;
+    host->rateTimer = NULL;
+    rateDispatch(httpPool, host);
+}
+
+// wake up when host hold expires or next token is due
+static void rateArm(httpPoolT *httpPool, httpHostT *host)
+{
+    if (!host->rateHead || host->rateTimer) return;
+
+    uint64_t now = httpNowMs();
+    double burst, rate = rateOf(httpPool, host, &burst);
+    uint64_t delay = host->rateUntil > now ? host->rateUntil - now : 0;
+    if (rate > 0 && host->tokens < 1.0) {
+        uint64_t refill = (uint64_t)((1.0 - host->tokens) * 1000.0 / rate) + 1;
+        if (refill > delay) delay = refill;
+    }
+    host->rateTimer = httpTimerAdd(httpPool, delay ? delay : 1, rateTimerCB, host);
+}
+
+// request goes to scheduler now (0) or waits for a host token (1)
+int httpRateAdmit(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpHostT *host = httpRqt->host;
+    if (!host || httpRqt->ratePassed) return 0;
+    if (!host->rateHead && rateTake(httpPool, host, httpNowMs())) {
+        httpRqt->ratePassed = 1;
+        return 0;
+    }
+
+    httpRqt->queueNext = NULL;
+    httpRqt->queuePrev = host->rateTail;
+    if (host->rateTail) host->rateTail->queueNext = httpRqt;
+    else host->rateHead = httpRqt;
+    host->rateTail = httpRqt;
+    httpRqt->paced = 1;
+    host->rateQueued++;
+    httpPool->stats.ratePaced++;
+    httpRqtWait(httpPool, httpRqt);
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpRate: wait origin=%s queued=%ld url=%s\n", host->origin, host->rateQueued, httpRqt->url);
+
+    rateArm(httpPool, host);
+    return 1;
+}
+
+// request completed or cancelled while waiting for a token
+void httpRateRelease(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (httpRqt->paced && httpRqt->host) rateRemove(httpRqt->host, httpRqt);
+    httpRqt->ratePassed = 0;
+    httpRqt->rateRetry = 0;
+}
+
+// server says slow down, hold host for Retry-After and drop saved tokens
+void httpRateFeedback(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus)
+{
+    httpHostT *host = httpRqt->host;
+    long status = 0;
+
+    if (!host || estatus != CURLE_OK) return;
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &status);
+    if (status != 429 && status != 503) return;
+
+    long hold = httpRetryAfter(httpRqt);
+    if (!hold && status == 503) return; // plain server error, circuit breaker business
+    if (!hold) hold = RATE_DFLT_HOLD_MS;
+    if (hold > RATE_MAX_HOLD_MS) hold = RATE_MAX_HOLD_MS;
+
+    uint64_t now = httpNowMs();
+    if (now + hold > host->rateUntil) host->rateUntil = now + hold;
+    host->tokens = 0;
+    host->rateRefill = host->rateUntil; // bucket refills from end of hold
+    httpPool->stats.rateThrottled++;
+    if (httpPool->verbose) fprintf(stderr, "-- httpRate: throttled origin=%s status=%ld hold=%ldms\n", host->origin, status, hold);
+}
+
+// origin=NULL sets pool default, rate<=0 removes bucket
+int httpPoolSetRateLimit(httpPoolT *httpPool, const char *origin, double rate, long burst)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpHostT *host = NULL;
+
+    if (burst < 0) goto OnErrorExit;
+    if (burst == 0) burst = rate > 1.0 ? (long)rate : 1;
+
+    if (origin) {
+        host = httpHostGet(httpPool, origin);
+        if (!host) goto OnErrorExit;
+        host->rateSet = (rate > 0);
+        host->rate = rate;
+        host->burst = (double)burst;
+        host->rateRefill = 0;
+    } else if (rate > 0) {
+        if (!httpPool->rate && !(httpPool->rate = calloc(1, sizeof(httpRateT)))) goto OnErrorExit;
+        httpPool->rate->rate = rate;
+        httpPool->rate->burst = (double)burst;
+    } else {
+        free(httpPool->rate);
+        httpPool->rate = NULL;
+    }
+
+    // waiting requests follow new rate
+    for (size_t idx = 0; idx < httpPool->hostBuckets; idx++) {
+        for (httpHostT *next = httpPool->hosts[idx]; next; next = next->next) {
+            if (host && next != host) continue;
+            if (next->rateTimer) {
+                httpTimerCancel(httpPool, next->rateTimer);
+                next->rateTimer = NULL;
+            }
+            rateDispatch(httpPool, next);
+        }
+    }
+    if (httpPool->verbose) fprintf(stderr, "-- httpRate: origin=%s rate=%.2f/s burst=%ld\n", origin ? origin : "(default)", rate, burst);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[rate-invalid] origin=%s rate=%.2f burst=%ld (httpPoolSetRateLimit)\n", origin ? origin : "(default)", rate, burst);
+    return -1;
+}
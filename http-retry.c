@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Retry and hedging policies.
+ *
+ *  Note-1: retries
+ *    Transient failures are retried with exponential backoff and jitter from pool timer. A pool
+ *    wide retry budget (token bucket fed by a ratio of new requests plus a minimum rate) prevents
+ *    retries from amplifying an outage. POST is only retried when request never reached server.
+ *    Interrupted GET resume with a range request when server advertised 'Accept-Ranges: bytes'.
+ *
+ *  Note-2: hedging
+ *    When enabled a GET still pending after the host latency percentile is duplicated. First
+ *    successful answer wins, its content is moved into the original request and the loser is
+ *    cancelled. Callback only sees the original request.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RETRY_DFLT_BACKOFF 100
+#define RETRY_DFLT_BACKOFF_MAX 10000
+#define RETRY_DFLT_PERCENT 20
+#define RETRY_DFLT_MIN_PER_SEC 10
+
+static int retryTransientError(CURLcode estatus)
+{
+    switch (estatus) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_RANGE_ERROR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int retryTransientStatus(long status)
+{
+    return status == 408 || status == 429 || status == 502 || status == 503 || status == 504;
+}
+
+// failure before any byte was sent, even a POST may safely be replayed
+static int retryNotSent(CURLcode estatus)
+{
+    return estatus == CURLE_COULDNT_RESOLVE_HOST || estatus == CURLE_COULDNT_CONNECT;
+}
+
+// token bucket fed by new requests and a minimum refill rate
+static int retryBudgetTake(httpPoolT *httpPool)
+{
+    uint64_t now = httpNowMs();
+    double capacity = 10.0 + httpPool->retryMinPerSec * 10.0;
+
+    if (httpPool->retryRefill) httpPool->retryTokens += (now - httpPool->retryRefill) * httpPool->retryMinPerSec / 1000.0;
+    httpPool->retryRefill = now;
+    if (httpPool->retryTokens > capacity) httpPool->retryTokens = capacity;
+
+    if (httpPool->retryTokens < 1.0) return 0;
+    httpPool->retryTokens -= 1.0;
+    return 1;
+}
+
+void httpRetryDeposit(httpPoolT *httpPool)
+{
+    double capacity = 10.0 + httpPool->retryMinPerSec * 10.0;
+    httpPool->retryTokens += httpPool->retryPercent / 100.0;
+    if (httpPool->retryTokens > capacity) httpPool->retryTokens = capacity;
+}
+
+// server may ask for a minimal delay in seconds or as an http date
+long httpRetryAfter(httpRqtT *httpRqt)
+{
+    const char *value = httpRqtHeader(httpRqt, "retry-after");
+    if (!value) return 0;
+    if (*value >= '0' && *value <= '9') return strtol(value, NULL, 10) * 1000;
+
+    time_t date = curl_getdate(value, NULL);
+    time_t now = time(NULL);
+    return (date > now) ? (date - now) * 1000 : 0;
+}
+
+// return retry delay in ms and reset request for a new attempt, -1 when request should complete
+long httpRetryDelay(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus)
+{
+    long status = 0;
+    int resume = 0;
+
+    if (httpRqt->retryCount >= httpRqt->retryMax) return -1;
+
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &status);
+    if (estatus == CURLE_OK && !retryTransientStatus(status)) return -1;
+    if (estatus != CURLE_OK && !retryTransientError(estatus)) return -1;
+    if (httpRqt->post && !retryNotSent(estatus)) return -1;
+
+    if (httpPool && !retryBudgetTake(httpPool)) {
+        httpPool->stats.retryDenied++;
+        if (httpPool->verbose) fprintf(stderr, "[retry-budget-exhausted] url=%s (httpRetryDelay)\n", httpRqt->url);
+        return -1;
+    }
+
+    // exponential backoff with equal jitter
+    long delay = httpRqt->backoff << (httpRqt->retryCount < 16 ? httpRqt->retryCount : 16);
+    if (delay > httpRqt->backoffMax || delay <= 0) delay = httpRqt->backoffMax;
+    delay = delay / 2 + (httpPool ? rand_r(&httpPool->seed) : rand()) % (delay / 2 + 1);
+
+    long after = httpRetryAfter(httpRqt);
+    if (after > delay) delay = after;
+
+    // next attempt would start after request deadline
+    if (httpRqt->deadline && httpNowMs() + delay >= httpRqt->deadline) return -1;
+
+    // interrupted download restart from where it stopped when server supports ranges
+    // (not when encoded, bodyLen counts decoded bytes while server ranges apply to encoded ones)
+    if (estatus != CURLE_OK && estatus != CURLE_RANGE_ERROR && !httpRqt->post && !httpRqt->sink && !httpRqt->compress && httpRqt->bodyLen > 0 && (status == 200 || status == 206)) {
+        const char *ranges = httpRqtHeader(httpRqt, "accept-ranges");
+        if (status == 206 || (ranges && !strcasecmp(ranges, "bytes"))) resume = 1;
+    }
+
+    if (resume) {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)httpRqt->bodyLen);
+        if (httpPool) httpPool->stats.resumed++;
+    } else {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+        httpRqt->bodyLen = 0;
+        if (httpRqt->body) httpRqt->body[0] = '\0';
+        httpJsonReset(httpRqt);
+        httpBudgetRelease(httpRqt);
+    }
+    httpRqt->hdrLen = 0;
+    if (httpRqt->headers) httpRqt->headers[0] = '\0';
+    httpHdrIndexClear(httpRqt);
+    httpRqt->status = 0;
+    httpRqt->error[0] = '\0';
+    httpRqt->retryCount++;
+
+    if (httpPool) httpPool->stats.retries++;
+    if (httpRqt->verbose)
+        fprintf(stderr, "[request-retry] attempt=%d delay=%ldms resume=%ld error='%s' status=%ld url=%s\n",
+                httpRqt->retryCount, delay, resume ? httpRqt->bodyLen : 0, curl_easy_strerror(estatus), status, httpRqt->url);
+    return delay;
+}
+
+// new attempt goes back to libcurl, scheduler and limiter slots are still held
+void httpRetryResume(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpRqtWaitDone(httpPool, httpRqt);
+    if (httpRqtDeadline(httpRqt)) {
+        httpRqtComplete(httpPool, httpRqt, CURLE_OPERATION_TIMEDOUT);
+        return;
+    }
+
+    httpLimitStart(httpRqt);
+    CURLMcode mstatus = curl_multi_add_handle(httpPool->multi, httpRqt->easy);
+    if (mstatus != CURLM_OK) {
+        fprintf(stderr, "[retry-add-fail] curl_multi_add_handle fail url=%s error=%s (retryFire)\n", httpRqt->url, curl_multi_strerror(mstatus));
+        httpRqtComplete(httpPool, httpRqt, CURLE_FAILED_INIT);
+    }
+}
+
+static void retryFire(httpPoolT *httpPool, void *ctx)
+{
+    httpRqtT *httpRqt = (httpRqtT *)ctx;
+    httpRqt->retryTimer = NULL;
+
+    // a retry takes a host token like any request, it waits behind a 429 hold
+    httpRqt->ratePassed = 0;
+    if (httpRateAdmit(httpPool, httpRqt)) {
+        httpRqt->rateRetry = 1;
+        return;
+    }
+    httpRetryResume(httpPool, httpRqt);
+}
+
+// schedule a new attempt from pool timer, return 1 when request was rescheduled
+int httpRetrySchedule(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode estatus)
+{
+    long delay = httpRetryDelay(httpPool, httpRqt, estatus);
+    if (delay < 0 || httpBreakerIsOpen(httpPool, httpRqt->host)) return 0;
+
+    httpRqt->retryTimer = httpTimerAdd(httpPool, delay, retryFire, httpRqt);
+    return httpRqt->retryTimer != NULL;
+}
+
+int httpPoolSetRetryBudget(httpPoolT *httpPool, long percent, long minPerSec)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (percent < 0 || minPerSec < 0) goto OnErrorExit;
+
+    httpPool->retryPercent = percent;
+    httpPool->retryMinPerSec = minPerSec;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[retry-budget-invalid] percent=%ld minPerSec=%ld should be >=0 (httpPoolSetRetryBudget)\n", percent, minPerSec);
+    return -1;
+}
+
+void httpRetryInit(httpPoolT *httpPool)
+{
+    httpPool->retryPercent = RETRY_DFLT_PERCENT;
+    httpPool->retryMinPerSec = RETRY_DFLT_MIN_PER_SEC;
+    httpPool->retryTokens = 10.0;
+    httpPool->seed = (unsigned int)httpNowMs();
+}
+
+void httpRetryOpts(httpRqtT *httpRqt, const httpOptsT *opts)
+{
+    httpRqt->retryMax = opts ? opts->retries : 0;
+    httpRqt->backoff = (opts && opts->backoff > 0) ? opts->backoff : RETRY_DFLT_BACKOFF;
+    httpRqt->backoffMax = (opts && opts->backoffMax > 0) ? opts->backoffMax : RETRY_DFLT_BACKOFF_MAX;
+}
+
+// release the duplicated request, its easy handle was removed from multi by caller (url and headers belong to primary)
+static void hedgeRelease(httpRqtT *shadow)
+{
+    httpRqtFree(shadow);
+}
+
+// move winner content into primary request, shadow recycles primary buffers and easy handle
+static void hedgeAdopt(httpRqtT *primary, httpRqtT *shadow)
+{
+    httpBudgetDrop(primary);
+    CURL *easy = primary->easy;
+    primary->easy = shadow->easy;
+    shadow->easy = easy;
+    curl_easy_setopt(primary->easy, CURLOPT_PRIVATE, primary);
+    curl_easy_setopt(primary->easy, CURLOPT_WRITEDATA, primary);
+    curl_easy_setopt(primary->easy, CURLOPT_HEADERDATA, primary);
+    curl_easy_setopt(primary->easy, CURLOPT_ERRORBUFFER, primary->error);
+    curl_easy_setopt(primary->easy, CURLOPT_SOCKOPTDATA, primary);
+    memcpy(primary->error, shadow->error, sizeof(primary->error));
+
+    char *body = primary->body, *headers = primary->headers;
+    size_t bodySize = primary->bodySize, hdrSize = primary->hdrSize;
+    primary->body = shadow->body;
+    primary->bodySize = shadow->bodySize;
+    primary->bodyLen = shadow->bodyLen;
+    primary->headers = shadow->headers;
+    primary->hdrSize = shadow->hdrSize;
+    primary->hdrLen = shadow->hdrLen;
+    shadow->body = body;
+    shadow->bodySize = bodySize;
+    shadow->headers = headers;
+    shadow->hdrSize = hdrSize;
+
+    // budget charge follows body buffer
+    size_t memCharged = primary->memCharged;
+    primary->memCharged = shadow->memCharged;
+    shadow->memCharged = memCharged;
+
+    httpHdrIndexT *index = primary->hdrIndex;
+    primary->hdrIndex = shadow->hdrIndex;
+    shadow->hdrIndex = index;
+    httpJsonReset(primary);
+}
+
+static int hedgeFailed(httpRqtT *httpRqt, CURLcode estatus)
+{
+    long status = 0;
+    if (estatus != CURLE_OK) return 1;
+    curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &status);
+    return status >= 500 || status == 429;
+}
+
+// one side of a hedged pair is done. Return primary request when pair is complete, NULL when still waiting
+httpRqtT *httpHedgeOnDone(httpPoolT *httpPool, httpRqtT *httpRqt, CURLcode *estatus)
+{
+    httpRqtT *primary = httpRqt->hedgeOf ? httpRqt->hedgeOf : httpRqt;
+    httpRqtT *shadow = primary->hedge;
+    int failed = hedgeFailed(httpRqt, *estatus);
+
+    if (httpRqt == shadow) {
+        // shadow lost while primary still running, forget it
+        if (failed && !primary->hedgeDone) {
+            primary->hedge = NULL;
+            hedgeRelease(shadow);
+            return NULL;
+        }
+        if (!primary->hedgeDone) curl_multi_remove_handle(httpPool->multi, primary->easy);
+        hedgeAdopt(primary, shadow);
+        primary->hedge = NULL;
+        hedgeRelease(shadow);
+        if (!failed) httpPool->stats.hedgeWins++;
+        return primary;
+    }
+
+    // primary failed, give a chance to its shadow
+    if (failed) {
+        primary->hedgeDone = 1;
+        return NULL;
+    }
+
+    // primary won, cancel shadow
+    curl_multi_remove_handle(httpPool->multi, shadow->easy);
+    primary->hedge = NULL;
+    hedgeRelease(shadow);
+    return primary;
+}
+
+static void hedgeFire(httpPoolT *httpPool, void *ctx)
+{
+    httpRqtT *primary = (httpRqtT *)ctx;
+    primary->hedgeTimer = NULL;
+
+    httpRqtT *shadow = httpRqtNew(httpPool);
+    if (!shadow) return;
+    shadow->verbose = primary->verbose;
+    shadow->hedgeOf = primary;
+    shadow->url = primary->url;
+    shadow->deadline = primary->deadline;
+    shadow->maxsz = primary->maxsz;
+
+    // same options (headers list is shared with primary)
+    if (shadow->easy) curl_easy_cleanup(shadow->easy);
+    shadow->easy = curl_easy_duphandle(primary->easy);
+    if (!shadow->easy) goto OnErrorExit;
+    curl_easy_setopt(shadow->easy, CURLOPT_PRIVATE, shadow);
+    curl_easy_setopt(shadow->easy, CURLOPT_WRITEDATA, shadow);
+    curl_easy_setopt(shadow->easy, CURLOPT_HEADERDATA, shadow);
+    curl_easy_setopt(shadow->easy, CURLOPT_ERRORBUFFER, shadow->error);
+    curl_easy_setopt(shadow->easy, CURLOPT_SOCKOPTDATA, shadow);
+    shadow->sockLarge = primary->sockLarge;
+    if (httpRqtDeadline(shadow)) goto OnErrorExit;
+
+    if (curl_multi_add_handle(httpPool->multi, shadow->easy) != CURLM_OK) goto OnErrorExit;
+    primary->hedge = shadow;
+    httpPool->stats.hedged++;
+
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpHedge: duplicate slow request url=%s\n", primary->url);
+    return;
+
+OnErrorExit:
+    hedgeRelease(shadow);
+}
+
+// arm hedging timer from host latency percentile
+void httpHedgeArm(httpPoolT *httpPool, httpRqtT *httpRqt, long percentile)
+{
+    if (!httpRqt->host || httpRqt->post || percentile <= 0) return;
+
+    // duplicate cannot share a sink, winner body would never reach it
+    if (httpRqt->sink || httpRqt->stream) return;
+
+    long delay = httpHostPercentile(httpRqt->host, percentile > 100 ? 100 : percentile);
+    if (delay < 0) return;
+
+    httpRqt->hedgeTimer = httpTimerAdd(httpPool, delay, hedgeFire, httpRqt);
+}
+
+// request is completed or cancelled, drop pending timers and duplicate
+void httpHedgeCancel(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (httpRqt->hedgeTimer) {
+        httpTimerCancel(httpPool, httpRqt->hedgeTimer);
+        httpRqt->hedgeTimer = NULL;
+    }
+    if (httpRqt->hedge) {
+        curl_multi_remove_handle(httpPool->multi, httpRqt->hedge->easy);
+        hedgeRelease(httpRqt->hedge);
+        httpRqt->hedge = NULL;
+    }
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Priority lanes. Each request class owns its admission slots and a FIFO queue, when pool
+ * wide slots are exhausted the next request is picked either in strict priority order or
+ * with a smooth weighted round robin between lanes. Lane weight is also used as HTTP/2
+ * stream weight. Without scheduler requests go straight to libcurl multi.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct
+{
+    long slots; // 0=unlimited
+    long weight;
+    long current;
+    long running;
+    httpRqtT *head;
+    httpRqtT *tail;
+    httpLaneStatsT stats;
+} schedLaneT;
+
+struct httpSchedS
+{
+    httpSchedModeT mode;
+    long maxActive; // 0=unlimited
+    long running;
+    int dispatching;
+    schedLaneT lanes[HTTP_PRIO_COUNT];
+};
+
+// strict dequeue order
+static const httpPriorityT schedOrder[HTTP_PRIO_COUNT] = {HTTP_PRIO_HIGH, HTTP_PRIO_NORMAL, HTTP_PRIO_BULK};
+static const long schedDfltWeight[HTTP_PRIO_COUNT] = {
+    [HTTP_PRIO_NORMAL] = 4,
+    [HTTP_PRIO_HIGH] = 16,
+    [HTTP_PRIO_BULK] = 1,
+};
+
+static httpSchedT *schedGet(httpPoolT *httpPool)
+{
+    if (httpPool->sched) return httpPool->sched;
+
+    httpSchedT *sched = calloc(1, sizeof(httpSchedT));
+    if (!sched) return NULL;
+    for (int prio = 0; prio < HTTP_PRIO_COUNT; prio++) sched->lanes[prio].weight = schedDfltWeight[prio];
+    httpPool->sched = sched;
+    return sched;
+}
+
+static int schedHasSlot(httpSchedT *sched, schedLaneT *lane)
+{
+    if (sched->maxActive && sched->running >= sched->maxActive) return 0;
+    if (lane->slots && lane->running >= lane->slots) return 0;
+    return 1;
+}
+
+static void schedPush(schedLaneT *lane, httpRqtT *httpRqt)
+{
+    httpRqt->queueNext = NULL;
+    httpRqt->queuePrev = lane->tail;
+    if (lane->tail) lane->tail->queueNext = httpRqt;
+    else lane->head = httpRqt;
+    lane->tail = httpRqt;
+    httpRqt->queued = 1;
+    lane->stats.queued++;
+}
+
+static void schedRemove(schedLaneT *lane, httpRqtT *httpRqt)
+{
+    if (httpRqt->queuePrev) httpRqt->queuePrev->queueNext = httpRqt->queueNext;
+    else lane->head = httpRqt->queueNext;
+    if (httpRqt->queueNext) httpRqt->queueNext->queuePrev = httpRqt->queuePrev;
+    else lane->tail = httpRqt->queuePrev;
+    httpRqt->queueNext = httpRqt->queuePrev = NULL;
+    httpRqt->queued = 0;
+    lane->stats.queued--;
+}
+
+// lane holding next request to start, -1 when nothing may start
+static int schedPick(httpSchedT *sched)
+{
+    if (sched->maxActive && sched->running >= sched->maxActive) return -1;
+
+    if (sched->mode == HTTP_SCHED_STRICT) {
+        for (int idx = 0; idx < HTTP_PRIO_COUNT; idx++) {
+            schedLaneT *lane = &sched->lanes[schedOrder[idx]];
+            if (lane->head && schedHasSlot(sched, lane)) return schedOrder[idx];
+        }
+        return -1;
+    }
+
+    // smooth weighted round robin between eligible lanes
+    long total = 0;
+    int best = -1;
+    for (int prio = 0; prio < HTTP_PRIO_COUNT; prio++) {
+        schedLaneT *lane = &sched->lanes[prio];
+        if (!lane->head || !schedHasSlot(sched, lane)) continue;
+        lane->current += lane->weight;
+        total += lane->weight;
+        if (best < 0 || lane->current > sched->lanes[best].current) best = prio;
+    }
+    if (best >= 0) sched->lanes[best].current -= total;
+    return best;
+}
+
+static int schedStart(httpPoolT *httpPool, httpSchedT *sched, httpRqtT *httpRqt)
+{
+    schedLaneT *lane = &sched->lanes[httpRqt->priority];
+
+    httpRqt->admitted = 1;
+    lane->running++;
+    sched->running++;
+    lane->stats.admitted++;
+
+    if (httpRqtStart(httpPool, httpRqt)) {
+        httpRqt->admitted = 0;
+        lane->running--;
+        sched->running--;
+        return -1;
+    }
+    return 0;
+}
+
+// start queued requests while slots are available, a request completed while starting
+// (ie: expired deadline) releases its slot to this loop instead of recursing into it
+static void schedDispatch(httpPoolT *httpPool, httpSchedT *sched)
+{
+    int prio;
+
+    if (sched->dispatching) return;
+    sched->dispatching = 1;
+    while ((prio = schedPick(sched)) >= 0) {
+        schedLaneT *lane = &sched->lanes[prio];
+        httpRqtT *httpRqt = lane->head;
+        schedRemove(lane, httpRqt);
+
+        uint64_t waited = httpNowMs() - httpRqt->queuedAt;
+        if (waited > lane->stats.maxWaitMs) lane->stats.maxWaitMs = waited;
+        if (httpPool->verbose > 1) fprintf(stderr, "-- httpSched: dequeue prio=%d waited=%lums url=%s\n", prio, waited, httpRqt->url);
+
+        if (schedStart(httpPool, sched, httpRqt)) httpRqtComplete(httpPool, httpRqt, CURLE_FAILED_INIT);
+    }
+    sched->dispatching = 0;
+}
+
+// start request now or queue it within its lane, return -1 when request could not be started
+int httpSchedAdmit(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpSchedT *sched = httpPool->sched;
+
+    // paced by host token bucket or adaptive limit, they admit request again later
+    if (httpRateAdmit(httpPool, httpRqt)) return 0;
+    if (httpLimitAdmit(httpPool, httpRqt)) return 0;
+    if (!sched) return httpRqtStart(httpPool, httpRqt);
+
+    schedLaneT *lane = &sched->lanes[httpRqt->priority];
+    if (!lane->head && schedHasSlot(sched, lane)) return schedStart(httpPool, sched, httpRqt);
+
+    httpRqt->queuedAt = httpNowMs();
+    schedPush(lane, httpRqt);
+    lane->stats.waited++;
+    httpRqtWait(httpPool, httpRqt);
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpSched: queue prio=%d depth=%lu url=%s\n", httpRqt->priority, lane->stats.queued, httpRqt->url);
+    return 0;
+}
+
+// request completed or cancelled, free its slot or drop it from queue
+void httpSchedRelease(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpSchedT *sched = httpPool->sched;
+    if (!sched) return;
+
+    schedLaneT *lane = &sched->lanes[httpRqt->priority];
+    if (httpRqt->queued) {
+        schedRemove(lane, httpRqt);
+        return;
+    }
+    if (!httpRqt->admitted) return;
+
+    httpRqt->admitted = 0;
+    lane->running--;
+    sched->running--;
+    schedDispatch(httpPool, sched);
+}
+
+// HTTP/2 stream weight [1-256] from lane weight (curl default 16 for normal lane)
+long httpSchedStreamWeight(httpPoolT *httpPool, httpPriorityT priority)
+{
+    long weight = (httpPool && httpPool->sched) ? httpPool->sched->lanes[priority].weight : schedDfltWeight[priority];
+    weight = weight * 4;
+    if (weight < 1) weight = 1;
+    if (weight > 256) weight = 256;
+    return weight;
+}
+
+int httpPoolSetScheduler(httpPoolT *httpPool, httpSchedModeT mode, long maxActive)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (mode != HTTP_SCHED_STRICT && mode != HTTP_SCHED_WEIGHTED) goto OnErrorExit;
+    if (maxActive < 0) goto OnErrorExit;
+
+    httpSchedT *sched = schedGet(httpPool);
+    if (!sched) goto OnErrorExit;
+    sched->mode = mode;
+    sched->maxActive = maxActive;
+    schedDispatch(httpPool, sched);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[sched-invalid] mode=%d maxActive=%ld (httpPoolSetScheduler)\n", mode, maxActive);
+    return -1;
+}
+
+int httpPoolSetLane(httpPoolT *httpPool, httpPriorityT priority, long slots, long weight)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (priority < 0 || priority >= HTTP_PRIO_COUNT || slots < 0 || weight < 1) goto OnErrorExit;
+
+    httpSchedT *sched = schedGet(httpPool);
+    if (!sched) goto OnErrorExit;
+    sched->lanes[priority].slots = slots;
+    sched->lanes[priority].weight = weight;
+    schedDispatch(httpPool, sched);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[lane-invalid] priority=%d slots=%ld weight=%ld (httpPoolSetLane)\n", priority, slots, weight);
+    return -1;
+}
+
+int httpPoolLaneStats(httpPoolT *httpPool, httpPriorityT priority, httpLaneStatsT *stats)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    if (!httpPool->sched || priority < 0 || priority >= HTTP_PRIO_COUNT) return -1;
+
+    *stats = httpPool->sched->lanes[priority].stats;
+    stats->running = httpPool->sched->lanes[priority].running;
+    return 0;
+}
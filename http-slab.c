@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Request slots. Pool requests are carved by chunks and go back to a pool free list when freed,
+ * keeping what next request would allocate again: body/headers buffers (up to SLAB_KEEP_BYTES),
+ * header index, easy handle (curl_easy_reset) and first scratch chunk. Scratch is a bump
+ * allocator with request lifetime, it is released wholesale with the request.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_CHUNK_SLOTS 32
+#define SLAB_KEEP_BYTES (16 * 1024) // larger buffers are released with request
+#define SCRATCH_MIN_SIZE 512
+#define SCRATCH_ALIGN 16
+
+struct httpScratchS
+{
+    httpScratchT *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+static int slabCarve(httpPoolT *httpPool)
+{
+    httpRqtT *slots = calloc(SLAB_CHUNK_SLOTS, sizeof(httpRqtT));
+    if (!slots) return -1;
+
+    // chunks live as long as pool, slots are linked through activeNext while free
+    for (int idx = 0; idx < SLAB_CHUNK_SLOTS; idx++) {
+        slots[idx].activeNext = httpPool->rqtFree;
+        httpPool->rqtFree = &slots[idx];
+    }
+    httpPool->stats.rqtSlots += SLAB_CHUNK_SLOTS;
+    return 0;
+}
+
+// new request handle, synchronous requests (no pool) are simply allocated
+httpRqtT *httpRqtNew(httpPoolT *httpPool)
+{
+    httpRqtT *httpRqt;
+
+    if (!httpPool) {
+        httpRqt = calloc(1, sizeof(httpRqtT));
+        if (!httpRqt) return NULL;
+    } else {
+        if (!httpPool->rqtFree && slabCarve(httpPool)) return NULL;
+        httpRqt = httpPool->rqtFree;
+        httpPool->rqtFree = httpRqt->activeNext;
+        httpRqt->activeNext = NULL;
+        httpRqt->pool = httpPool;
+    }
+    httpRqt->magic = MAGIC_HTTP_RQT;
+    return httpRqt;
+}
+
+static httpScratchT *scratchRelease(httpScratchT *scratch, int keep)
+{
+    while (scratch && (scratch->next || !keep || scratch->size > SLAB_KEEP_BYTES)) {
+        httpScratchT *next = scratch->next;
+        free(scratch);
+        scratch = next;
+    }
+    if (scratch) scratch->used = 0;
+    return scratch;
+}
+
+static void slabKeep(char **buffer, size_t *size)
+{
+    if (*buffer && *size > 0 && *size <= SLAB_KEEP_BYTES) {
+        (*buffer)[0] = '\0';
+        return;
+    }
+    free(*buffer);
+    *buffer = NULL;
+    *size = 0;
+}
+
+// give request slot back to its pool, caller already released request owned resources
+void httpRqtRecycle(httpRqtT *httpRqt)
+{
+    httpPoolT *httpPool = httpRqt->pool;
+
+    slabKeep(&httpRqt->body, &httpRqt->bodySize);
+    slabKeep(&httpRqt->headers, &httpRqt->hdrSize);
+    httpHdrIndexClear(httpRqt);
+
+    // a transfer stopped while paused leaves its easy handle in paused state
+    if (httpRqt->easy && httpRqt->paused) {
+        curl_easy_cleanup(httpRqt->easy);
+        httpRqt->easy = NULL;
+    }
+    if (httpRqt->easy) curl_easy_reset(httpRqt->easy);
+
+    char *body = httpRqt->body, *headers = httpRqt->headers;
+    size_t bodySize = httpRqt->bodySize, hdrSize = httpRqt->hdrSize;
+    httpHdrIndexT *hdrIndex = httpRqt->hdrIndex;
+    CURL *easy = httpRqt->easy;
+    httpScratchT *scratch = scratchRelease(httpRqt->scratch, 1);
+
+    memset(httpRqt, 0, sizeof(httpRqtT));
+    httpRqt->body = body;
+    httpRqt->bodySize = bodySize;
+    httpRqt->headers = headers;
+    httpRqt->hdrSize = hdrSize;
+    httpRqt->hdrIndex = hdrIndex;
+    httpRqt->easy = easy;
+    httpRqt->scratch = scratch;
+
+    httpRqt->activeNext = httpPool->rqtFree;
+    httpPool->rqtFree = httpRqt;
+    httpPool->stats.rqtRecycled++;
+}
+
+void httpScratchFree(httpRqtT *httpRqt)
+{
+    httpRqt->scratch = scratchRelease(httpRqt->scratch, 0);
+}
+
+void *httpRqtScratch(httpRqtT *httpRqt, size_t size)
+{
+    httpScratchT *chunk = httpRqt->scratch;
+
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunkSize = chunk ? chunk->size * 2 : SCRATCH_MIN_SIZE;
+        while (chunkSize < size) chunkSize *= 2;
+
+        chunk = malloc(sizeof(httpScratchT) + chunkSize);
+        if (!chunk) return NULL;
+        chunk->next = httpRqt->scratch;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        httpRqt->scratch = chunk;
+    }
+
+    void *data = &chunk->data[chunk->used];
+    chunk->used += size;
+    return data;
+}
+
+// grow a request buffer geometrically to hold 'need' bytes plus trailing NUL
+int httpRqtReserve(char **buffer, size_t *size, size_t need)
+{
+    if (!*buffer) *size = 0; // buffer was taken over by application
+    if (need < *size) return 0;
+
+    size_t grow = *size ? *size : 256;
+    while (grow <= need) grow *= 2;
+
+    char *data = realloc(*buffer, grow);
+    if (!data) return -1;
+    *buffer = data;
+    *size = grow;
+    return 0;
+}
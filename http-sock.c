@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Pool socket profile. libcurl options (nodelay, buffer sizes, keepalive) are set on each
+ * transfer, kernel ones (SO_RCVBUF, SO_SNDBUF, SO_BUSY_POLL) from CURLOPT_SOCKOPTFUNCTION when
+ * a connection is created, reused connections keep their settings. In adaptive mode each host
+ * keeps an average of its body sizes, hosts whose average reaches profile threshold get large
+ * libcurl buffers (and four times SO_RCVBUF when set) on their next transfers.
+ *
+ *  Note: setting SO_RCVBUF disables Linux receive buffer autotuning, leave rcvbuf=0 unless
+ *  bandwidth delay product is known.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define SOCK_LARGE_BUFFER CURL_MAX_READ_SIZE
+#define SOCK_LARGE_RCVBUF_FACTOR 4
+#define SOCK_AVG_SHIFT 3 // body size average weights last transfer 1/8
+
+struct httpSockS
+{
+    httpSockOptsT opts;
+};
+
+static void sockSet(httpPoolT *httpPool, int sock, int level, int name, int value, const char *label)
+{
+    if (setsockopt(sock, level, name, &value, sizeof(value)) && httpPool->verbose)
+        fprintf(stderr, "[sock-opt-fail] sock=%d %s=%d error=%s (sockOptCB)\n", sock, label, value, strerror(errno));
+}
+
+// new connection socket, before connect
+static int sockOptCB(void *ctx, curl_socket_t sock, curlsocktype purpose)
+{
+    httpRqtT *httpRqt = (httpRqtT *)ctx;
+    httpPoolT *httpPool = httpRqt->pool;
+
+    // profile may have been removed since transfer setup
+    if (purpose != CURLSOCKTYPE_IPCXN || !httpPool->sock) return CURL_SOCKOPT_OK;
+    httpSockOptsT *opts = &httpPool->sock->opts;
+
+    long rcvbuf = opts->rcvbuf;
+    if (rcvbuf && httpRqt->sockLarge) rcvbuf *= SOCK_LARGE_RCVBUF_FACTOR;
+    if (rcvbuf > 0) sockSet(httpPool, sock, SOL_SOCKET, SO_RCVBUF, (int)rcvbuf, "rcvbuf");
+    if (opts->sndbuf > 0) sockSet(httpPool, sock, SOL_SOCKET, SO_SNDBUF, (int)opts->sndbuf, "sndbuf");
+#ifdef SO_BUSY_POLL
+    if (opts->busyPoll > 0) sockSet(httpPool, sock, SOL_SOCKET, SO_BUSY_POLL, (int)opts->busyPoll, "busypoll");
+#endif
+    httpPool->stats.sockTuned++;
+
+    // unix sockets and proxies still connect, profile is best effort
+    return CURL_SOCKOPT_OK;
+}
+
+// apply pool socket profile to a transfer
+void httpSockSetup(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpSockT *sock = httpPool->sock;
+    if (!sock) return;
+    httpSockOptsT *opts = &sock->opts;
+
+    httpRqt->sockLarge = (opts->adaptive > 0 && httpRqt->host && httpRqt->host->bodyAvg >= (uint64_t)opts->adaptive);
+    if (httpRqt->sockLarge) {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_BUFFERSIZE, (long)SOCK_LARGE_BUFFER);
+        httpPool->stats.sockLarge++;
+        if (httpPool->verbose > 1) fprintf(stderr, "-- httpSock: large buffers avg=%lu url=%s\n", httpRqt->host->bodyAvg, httpRqt->url);
+    } else if (opts->bufferSize > 0) {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_BUFFERSIZE, opts->bufferSize);
+    }
+    if (opts->uploadSize > 0) curl_easy_setopt(httpRqt->easy, CURLOPT_UPLOAD_BUFFERSIZE, opts->uploadSize);
+    if (opts->nodelay) curl_easy_setopt(httpRqt->easy, CURLOPT_TCP_NODELAY, opts->nodelay > 0 ? 1L : 0L);
+    if (opts->keepIdle > 0) {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(httpRqt->easy, CURLOPT_TCP_KEEPIDLE, opts->keepIdle);
+        if (opts->keepIntvl > 0) curl_easy_setopt(httpRqt->easy, CURLOPT_TCP_KEEPINTVL, opts->keepIntvl);
+    }
+    if (opts->rcvbuf > 0 || opts->sndbuf > 0 || opts->busyPoll > 0) {
+        curl_easy_setopt(httpRqt->easy, CURLOPT_SOCKOPTFUNCTION, sockOptCB);
+        curl_easy_setopt(httpRqt->easy, CURLOPT_SOCKOPTDATA, httpRqt);
+    }
+}
+
+// feed host body size average used by adaptive mode
+void httpSockLearn(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpHostT *host = httpRqt->host;
+    if (!httpPool->sock || !httpPool->sock->opts.adaptive || !host) return;
+
+    uint64_t size = (uint64_t)httpRqt->wireBytes;
+    if (!host->bodyAvg) host->bodyAvg = size;
+    else host->bodyAvg = host->bodyAvg - (host->bodyAvg >> SOCK_AVG_SHIFT) + (size >> SOCK_AVG_SHIFT);
+}
+
+int httpPoolSetSocket(httpPoolT *httpPool, const httpSockOptsT *opts)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+
+    if (!opts) {
+        free(httpPool->sock);
+        httpPool->sock = NULL;
+        return 0;
+    }
+    if (opts->bufferSize < 0 || opts->bufferSize > CURL_MAX_READ_SIZE || opts->uploadSize < 0 || opts->rcvbuf < 0 || opts->sndbuf < 0) goto OnErrorExit;
+
+    if (!httpPool->sock) {
+        httpPool->sock = calloc(1, sizeof(httpSockT));
+        if (!httpPool->sock) goto OnErrorExit;
+    }
+    httpPool->sock->opts = *opts;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[sock-profile-fail] invalid profile or out of memory (httpPoolSetSocket)\n");
+    return -1;
+}
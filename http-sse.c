@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Server-sent events and long-lived chunked streams. A subscription is a GET whose body goes
+ * to the request sink, text/event-stream frames are parsed as they arrive (lines ending with
+ * CRLF, LF or CR, split across chunks) and each event is dispatched to callback, nothing is
+ * accumulated past current event. Parser buffers keep their capacity between events and are
+ * bounded by maxEvent, memory stays flat on streams running for days. When stream ends or
+ * fails the subscription reconnects from a pool timer with Last-Event-ID, server 'retry:'
+ * delay and exponential backoff with jitter while connections fail. Lines mode dispatches each
+ * line of a chunked response (ie: NDJSON) without SSE framing.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAGIC_HTTP_SSE 852471
+#define SSE_DFLT_RECONNECT_MS 3000
+#define SSE_DFLT_RECONNECT_MAX 60000
+#define SSE_DFLT_MAX_EVENT (1024 * 1024)
+#define SSE_KEEP_BUFFER (64 * 1024) // larger buffers are released after their event
+#define SSE_MAX_ID 512              // Last-Event-ID must fit in one request header
+
+static void sseConnect(httpSseT *sse);
+
+// append to a parser buffer, -1 when event would go over maxEvent
+static int sseAppend(httpSseT *sse, httpSseBufT *buf, const char *data, size_t count)
+{
+    if (buf->len + count > sse->maxEvent) return -1;
+    if (buf->len + count + 1 > buf->size) {
+        size_t size = buf->size ? buf->size * 2 : 128;
+        while (size < buf->len + count + 1) size *= 2;
+        char *text = realloc(buf->text, size);
+        if (!text) return -1;
+        buf->text = text;
+        buf->size = size;
+    }
+    memcpy(buf->text + buf->len, data, count);
+    buf->len += count;
+    buf->text[buf->len] = '\0';
+    return 0;
+}
+
+// an exceptionally large event does not pin its buffer for the rest of the stream
+static void sseReset(httpSseBufT *buf)
+{
+    if (buf->size > SSE_KEEP_BUFFER) {
+        free(buf->text);
+        buf->text = NULL;
+        buf->size = 0;
+    }
+    buf->len = 0;
+}
+
+static void sseRelease(httpSseT *sse)
+{
+    free(sse->line.text);
+    free(sse->data.text);
+    free(sse->type.text);
+    free(sse->nextId.text);
+    free(sse->last.text);
+    free(sse->url);
+    free(sse);
+}
+
+static void sseDispatch(httpSseT *sse, const char *type)
+{
+    httpSseEventT event = {
+        .event = type,
+        .data = sse->data.text ? sse->data.text : "",
+        .dataLen = sse->data.len,
+        .id = sse->lastId,
+    };
+
+    sse->events++;
+    sse->busy = 1;
+    httpRqtActionT action = sse->callback(sse, &event);
+    sse->busy = 0;
+    if (action == HTTP_HANDLE_FREE) sse->closing = 1;
+}
+
+// blank line, event is complete
+static void sseEventEnd(httpSseT *sse)
+{
+    // id is committed even when event has no data, it acknowledges stream position
+    if (sse->idSet) {
+        sse->idSet = 0;
+        sse->last.len = 0;
+        if (!sseAppend(sse, &sse->last, sse->nextId.text ? sse->nextId.text : "", sse->nextId.len)) sse->lastId = sse->last.len ? sse->last.text : NULL;
+    }
+
+    if (sse->overflow) {
+        sse->overflow = 0;
+        sse->dropped++;
+        fprintf(stderr, "[sse-event-dropped] url=%s event over %zu bytes (sseEventEnd)\n", sse->url, sse->maxEvent);
+    } else if (sse->data.len) {
+        sse->data.text[--sse->data.len] = '\0'; // last data line '\n'
+        sseDispatch(sse, sse->type.len ? sse->type.text : "message");
+    }
+    sseReset(&sse->data);
+    sseReset(&sse->type);
+}
+
+static void sseField(httpSseT *sse, const char *line, size_t len)
+{
+    const char *colon = memchr(line, ':', len);
+    size_t nameLen = colon ? (size_t)(colon - line) : len;
+    const char *value = colon ? colon + 1 : line + len;
+    size_t valueLen = len - (value - line);
+
+    if (valueLen && *value == ' ') {
+        value++;
+        valueLen--;
+    }
+
+    if (nameLen == 4 && !memcmp(line, "data", 4)) {
+        if (sse->overflow) return;
+        if (sseAppend(sse, &sse->data, value, valueLen) || sseAppend(sse, &sse->data, "\n", 1)) sse->overflow = 1;
+    } else if (nameLen == 5 && !memcmp(line, "event", 5)) {
+        sse->type.len = 0;
+        if (sseAppend(sse, &sse->type, value, valueLen)) sse->overflow = 1;
+    } else if (nameLen == 2 && !memcmp(line, "id", 2)) {
+        if (memchr(value, '\0', valueLen) || valueLen > SSE_MAX_ID) return;
+        sse->nextId.len = 0;
+        if (!sseAppend(sse, &sse->nextId, value, valueLen)) sse->idSet = 1;
+    } else if (nameLen == 5 && !memcmp(line, "retry", 5)) {
+        long delay = 0;
+        for (size_t idx = 0; idx < valueLen; idx++) {
+            if (value[idx] < '0' || value[idx] > '9' || delay > SSE_DFLT_RECONNECT_MAX * 100) return;
+            delay = delay * 10 + (value[idx] - '0');
+        }
+        if (valueLen) sse->reconnectMs = delay;
+    }
+    // unknown fields are ignored
+}
+
+static void sseLine(httpSseT *sse, const char *line, size_t len)
+{
+    if (sse->lines) {
+        if (!len) return;
+        if (sse->overflow || sseAppend(sse, &sse->data, line, len)) {
+            sse->overflow = 1;
+            sseEventEnd(sse);
+            return;
+        }
+        sseDispatch(sse, NULL);
+        sseReset(&sse->data);
+        return;
+    }
+
+    if (!len) sseEventEnd(sse);
+    else if (*line != ':') sseField(sse, line, len); // ':' comment, ie: heartbeat
+}
+
+// split chunk on CRLF, LF or CR, a line may span several chunks
+static void sseFeed(httpSseT *sse, const char *data, size_t len)
+{
+    while (len && !sse->closing) {
+        if (sse->crSkip) {
+            sse->crSkip = 0;
+            if (*data == '\n') {
+                data++;
+                len--;
+                continue;
+            }
+        }
+
+        const char *eol = memchr(data, '\n', len);
+        const char *cr = memchr(data, '\r', eol ? (size_t)(eol - data) : len);
+        if (cr) eol = cr;
+
+        // incomplete line, keep it for next chunk
+        if (!eol) {
+            if (!sse->lineSkip && sseAppend(sse, &sse->line, data, len)) sse->lineSkip = 1;
+            return;
+        }
+
+        size_t count = eol - data;
+        if (*eol == '\r') sse->crSkip = 1;
+        if (sse->line.len || sse->lineSkip) {
+            if (!sse->lineSkip && sseAppend(sse, &sse->line, data, count)) sse->lineSkip = 1;
+            if (sse->lineSkip) {
+                // line went over maxEvent, its event is dropped
+                sse->lineSkip = 0;
+                sse->overflow = 1;
+                if (sse->lines) sseEventEnd(sse);
+            } else {
+                sseLine(sse, sse->line.text, sse->line.len);
+            }
+            sseReset(&sse->line);
+        } else {
+            sseLine(sse, data, count);
+        }
+        data += count + 1;
+        len -= count + 1;
+    }
+}
+
+static size_t sseSinkCB(httpRqtT *httpRqt, const char *data, size_t len)
+{
+    httpSseT *sse = (httpSseT *)httpRqt->userData;
+
+    if (sse->closing) return 0;
+
+    // first chunk tells whether this is a stream or an error page
+    if (!sse->checked) {
+        long status = 0;
+        char *ctype = NULL;
+        sse->checked = 1;
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(httpRqt->easy, CURLINFO_CONTENT_TYPE, &ctype);
+        if (status != 200) {
+            sse->ignore = 1;
+        } else if (!sse->lines && (!ctype || strncasecmp(ctype, "text/event-stream", 17))) {
+            fprintf(stderr, "[sse-invalid-type] url=%s content-type=%s (sseSinkCB)\n", sse->url, ctype ? ctype : "(none)");
+            sse->invalid = 1;
+            return 0;
+        }
+
+        // optional UTF-8 BOM
+        if (!sse->ignore && len >= 3 && !memcmp(data, "\xEF\xBB\xBF", 3)) {
+            sse->received = 1;
+            sseFeed(sse, data + 3, len - 3);
+            return sse->closing ? 0 : len;
+        }
+    }
+    if (sse->ignore) return len;
+
+    sse->received = 1;
+    sseFeed(sse, data, len);
+    return sse->closing ? 0 : len;
+}
+
+// subscription is over, last callback may release handle
+static void sseFinish(httpSseT *sse)
+{
+    if (sse->verbose) fprintf(stderr, "-- httpSse: closed status=%ld events=%ld connects=%ld url=%s\n", sse->status, sse->events, sse->connects, sse->url);
+    sse->busy = 1;
+    httpRqtActionT action = sse->callback(sse, NULL);
+    sse->busy = 0;
+    if (action == HTTP_HANDLE_FREE || sse->closing) sseRelease(sse);
+}
+
+static void sseReconnectCB(httpPoolT *httpPool, void *ctx)
+{
+    httpSseT *sse = (httpSseT *)ctx;
+    sse->timer = NULL;
+    sseConnect(sse);
+}
+
+static void sseSchedule(httpSseT *sse, long retryAfter)
+{
+    httpPoolT *httpPool = sse->pool;
+    long delay = sse->reconnectMs;
+
+    // a connection that delivered data resets backoff, failed ones double delay
+    if (sse->received) {
+        sse->failures = 0;
+    } else {
+        int shift = sse->failures < 16 ? sse->failures : 16;
+        sse->failures++;
+        if (delay < 1) delay = 1;
+        delay = (delay << shift) > sse->reconnectMax ? sse->reconnectMax : delay << shift;
+        delay = delay / 2 + rand_r(&httpPool->seed) % (delay / 2 + 1); // equal jitter, subscribers do not reconnect as a herd
+    }
+    if (retryAfter > delay) delay = retryAfter;
+
+    if (sse->verbose) fprintf(stderr, "-- httpSse: reconnect in %ldms status=%ld lastId=%s url=%s\n", delay, sse->status, sse->lastId ? sse->lastId : "(none)", sse->url);
+    sse->timer = httpTimerAdd(httpPool, delay ? delay : 1, sseReconnectCB, sse);
+    if (!sse->timer) {
+        sse->status = CURLE_OUT_OF_MEMORY;
+        sseFinish(sse);
+    }
+}
+
+static httpRqtActionT sseRqtCB(httpRqtT *httpRqt)
+{
+    httpSseT *sse = (httpSseT *)httpRqt->userData;
+    long status = httpRqt->status;
+
+    sse->id = 0;
+    sse->pending = 0;
+    sse->status = status;
+
+    // unsubscribed from event callback or httpSseClose
+    if (sse->closing) {
+        if (!sse->busy) sseRelease(sse);
+        return HTTP_HANDLE_FREE;
+    }
+
+    // server says stop (204, client errors) or this is not an event stream
+    int over = sse->invalid || status == HTTP_STATUS_CANCELLED || status == 204;
+    if (status >= 400 && status < 500 && status != 408 && status != 429) over = 1;
+    if (over) {
+        sseFinish(sse);
+        return HTTP_HANDLE_FREE;
+    }
+
+    // stream ended, network error, 5xx, 408/429 or open circuit
+    sseSchedule(sse, (status == 429 || status == 503) ? httpRetryAfter(httpRqt) : 0);
+    return HTTP_HANDLE_FREE;
+}
+
+// stream connection never times out by itself, idle streams are cut by libcurl low speed check
+static httpOptsT sseOpts(httpSseT *sse)
+{
+    static const httpOptsT none;
+    const httpOptsT *opts = sse->opts ? sse->opts : &none;
+
+    httpOptsT out = {
+        .username = opts->username,
+        .password = opts->password,
+        .sslchk = opts->sslchk,
+        .verbose = opts->verbose,
+        .speedlimit = sse->idleSec ? 1 : 0,
+        .speedlow = sse->idleSec,
+        .follow = opts->follow,
+        .maxredir = opts->maxredir,
+        .cainfo = opts->cainfo,
+        .sslcert = opts->sslcert,
+        .sslkey = opts->sslkey,
+        .agent = opts->agent,
+        .nocache = 1,
+        .connectMs = opts->connectMs,
+        .priority = opts->priority,
+        .compress = opts->compress,
+        .unixSocket = opts->unixSocket,
+        .headers = opts->headers,
+        .sink = sseSinkCB,
+        .stream = 1,
+    };
+    return out;
+}
+
+static void sseConnect(httpSseT *sse)
+{
+    httpOptsT opts = sseOpts(sse);
+    httpKeyValT tokens[] = {
+        {.tag = "Accept", .value = sse->lines ? "*/*" : "text/event-stream"},
+        {.tag = "Cache-Control", .value = "no-cache"},
+        {.tag = "Last-Event-ID", .value = sse->lastId},
+        {NULL},
+    };
+    if (!sse->lastId || sse->lines) tokens[2].tag = NULL;
+
+    // per connection parser state, buffers keep their capacity
+    sse->checked = sse->ignore = sse->invalid = sse->received = 0;
+    sse->crSkip = sse->lineSkip = sse->overflow = sse->idSet = 0;
+    sse->line.len = sse->data.len = sse->type.len = 0;
+    sse->connects++;
+    if (sse->verbose > 1) fprintf(stderr, "-- httpSse: connect lastId=%s url=%s\n", sse->lastId ? sse->lastId : "(none)", sse->url);
+
+    // a send may complete synchronously (ie: open circuit), request callback then already ran
+    sse->pending = 1;
+    httpRqtIdT id = httpSendGet(sse->pool, sse->url, &opts, tokens, sseRqtCB, sse);
+    if (!sse->pending) return;
+    if (id) {
+        sse->id = id;
+        return;
+    }
+    sse->pending = 0;
+    sse->status = CURLE_FAILED_INIT;
+    sseSchedule(sse, 0);
+}
+
+httpSseT *httpSseSubscribe(httpPoolT *httpPool, const char *url, const httpSseOptsT *sopts, httpSseCbT callback, void *ctx)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpSseT *sse = NULL;
+
+    if (!url || !callback) goto OnErrorExit;
+    if (sopts && (sopts->reconnectMs < 0 || sopts->reconnectMax < 0 || sopts->idleSec < 0)) goto OnErrorExit;
+
+    sse = calloc(1, sizeof(httpSseT));
+    if (!sse) goto OnErrorExit;
+    sse->magic = MAGIC_HTTP_SSE;
+    sse->pool = httpPool;
+    sse->verbose = httpPool->verbose;
+    sse->callback = callback;
+    sse->userData = ctx;
+    sse->opts = sopts ? sopts->opts : NULL;
+    sse->lines = sopts ? sopts->lines : 0;
+    sse->idleSec = sopts ? sopts->idleSec : 0;
+    sse->reconnectMs = (sopts && sopts->reconnectMs) ? sopts->reconnectMs : SSE_DFLT_RECONNECT_MS;
+    sse->reconnectMax = (sopts && sopts->reconnectMax) ? sopts->reconnectMax : SSE_DFLT_RECONNECT_MAX;
+    sse->maxEvent = (sopts && sopts->maxEvent) ? sopts->maxEvent : SSE_DFLT_MAX_EVENT;
+    if (!(sse->url = strdup(url))) goto OnErrorExit;
+
+    sseConnect(sse);
+    return sse;
+
+OnErrorExit:
+    fprintf(stderr, "[sse-invalid] url=%s invalid options or out of memory (httpSseSubscribe)\n", url ? url : "(null)");
+    if (sse) sseRelease(sse);
+    return NULL;
+}
+
+// unsubscribe, no further callback. Safe from within event callback
+void httpSseClose(httpSseT *sse)
+{
+    assert(sse->magic == MAGIC_HTTP_SSE);
+    sse->closing = 1;
+    if (sse->timer) {
+        httpTimerCancel(sse->pool, sse->timer);
+        sse->timer = NULL;
+    }
+
+    // within a callback, handle goes when it returns
+    if (sse->busy) return;
+    if (sse->id) {
+        sse->busy = 1;
+        httpCancel(sse->pool, sse->id);
+        sse->busy = 0;
+    }
+    sseRelease(sse);
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Pool timer jobs (retry backoff, hedging, ...). Glue layers only provide one timer per pool,
+ * jobs are kept within a min-heap and the glue timer is armed with the earliest of libcurl
+ * timeout and first job due time. Deferred jobs are caller owned nodes run by a single 0ms job.
+ * Worker threads (dns lookups, offloaded callbacks) wake event loop through a pool eventfd
+ * when glue watches it (evtWakeup), with older glues their results are polled from a pool timer.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMER_HEAP_MIN 16
+
+struct httpTimerS
+{
+    uint64_t due;
+    size_t index;
+    httpTimerCbT callback;
+    void *ctx;
+};
+
+uint64_t httpNowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// public alias, applications compute absolute deadlines from it
+uint64_t httpNow(void)
+{
+    return httpNowMs();
+}
+
+static void timerPlace(httpPoolT *httpPool, httpTimerT *timer, size_t index)
+{
+    httpPool->timers[index] = timer;
+    timer->index = index;
+}
+
+static void timerSiftUp(httpPoolT *httpPool, size_t index)
+{
+    httpTimerT *timer = httpPool->timers[index];
+    while (index) {
+        size_t parent = (index - 1) / 2;
+        if (httpPool->timers[parent]->due <= timer->due) break;
+        timerPlace(httpPool, httpPool->timers[parent], index);
+        index = parent;
+    }
+    timerPlace(httpPool, timer, index);
+}
+
+static void timerSiftDown(httpPoolT *httpPool, size_t index)
+{
+    httpTimerT *timer = httpPool->timers[index];
+    for (;;) {
+        size_t child = index * 2 + 1;
+        if (child >= httpPool->timerCount) break;
+        if (child + 1 < httpPool->timerCount && httpPool->timers[child + 1]->due < httpPool->timers[child]->due) child++;
+        if (timer->due <= httpPool->timers[child]->due) break;
+        timerPlace(httpPool, httpPool->timers[child], index);
+        index = child;
+    }
+    timerPlace(httpPool, timer, index);
+}
+
+static void timerRemove(httpPoolT *httpPool, size_t index)
+{
+    httpTimerT *last = httpPool->timers[--httpPool->timerCount];
+    if (index == httpPool->timerCount) return;
+
+    timerPlace(httpPool, last, index);
+    timerSiftUp(httpPool, index);
+    timerSiftDown(httpPool, last->index);
+}
+
+// arm glue timer with earliest of libcurl and pool jobs due time
+int httpTimerArm(httpPoolT *httpPool)
+{
+    uint64_t due = httpPool->curlDue;
+    long timeout = -1;
+
+    if (httpPool->timerCount && (!due || httpPool->timers[0]->due < due))
+        due = httpPool->timers[0]->due;
+
+    if (due) {
+        uint64_t now = httpNowMs();
+        timeout = (due > now) ? due - now : 0;
+    }
+    return httpPool->callback->multiTimer(httpPool, timeout);
+}
+
+// schedule a one shot job, callback runs from pool event loop
+httpTimerT *httpTimerAdd(httpPoolT *httpPool, uint64_t delay, httpTimerCbT callback, void *ctx)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpTimerT *timer = malloc(sizeof(httpTimerT));
+    if (!timer) goto OnErrorExit;
+
+    if (httpPool->timerCount == httpPool->timerSize) {
+        size_t size = httpPool->timerSize ? httpPool->timerSize * 2 : TIMER_HEAP_MIN;
+        httpTimerT **timers = realloc(httpPool->timers, size * sizeof(httpTimerT *));
+        if (!timers) goto OnErrorExit;
+        httpPool->timers = timers;
+        httpPool->timerSize = size;
+    }
+
+    timer->due = httpNowMs() + delay;
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timerPlace(httpPool, timer, httpPool->timerCount++);
+    timerSiftUp(httpPool, timer->index);
+
+    // new earliest job, rearm glue timer
+    if (httpPool->timers[0] == timer) (void)httpTimerArm(httpPool);
+    return timer;
+
+OnErrorExit:
+    fprintf(stderr, "[timer-add-fail] fail to schedule pool job delay=%ldms (httpTimerAdd)\n", delay);
+    free(timer);
+    return NULL;
+}
+
+// cancel a pending job (should not be called once job callback started)
+void httpTimerCancel(httpPoolT *httpPool, httpTimerT *timer)
+{
+    assert(httpPool->timers[timer->index] == timer);
+    timerRemove(httpPool, timer->index);
+    free(timer);
+}
+
+// run expired jobs, a job may schedule new ones
+void httpTimerRun(httpPoolT *httpPool)
+{
+    uint64_t now = httpNowMs();
+
+    while (httpPool->timerCount && httpPool->timers[0]->due <= now) {
+        httpTimerT *timer = httpPool->timers[0];
+        timerRemove(httpPool, 0);
+        timer->callback(httpPool, timer->ctx);
+        free(timer);
+    }
+}
+
+// run deferred jobs in submission order, jobs deferred meanwhile wait for next run
+static void deferRun(httpPoolT *httpPool, void *ctx)
+{
+    httpDeferT *job = httpPool->deferHead;
+    httpPool->deferHead = httpPool->deferTail = NULL;
+    httpPool->deferTimer = NULL;
+
+    while (job) {
+        httpDeferT *next = job->next;
+        job->next = NULL;
+        job->callback(job->ctx);
+        job = next;
+    }
+}
+
+int httpPoolDefer(httpPoolT *httpPool, httpDeferT *job)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+
+    if (!httpPool->deferTimer) {
+        httpPool->deferTimer = httpTimerAdd(httpPool, 0, deferRun, NULL);
+        if (!httpPool->deferTimer) return -1;
+    }
+
+    job->next = NULL;
+    if (httpPool->deferTail) httpPool->deferTail->next = job;
+    else httpPool->deferHead = job;
+    httpPool->deferTail = job;
+    return 0;
+}
+
+// create pool eventfd and hand it over to glue, return -1 when workers results should be polled
+int httpWakeSetup(httpPoolT *httpPool)
+{
+    if (httpPool->wakeFd >= 0) return 0;
+    if (!httpPool->callback || !httpPool->callback->evtWakeup) return -1;
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) goto OnErrorExit;
+    if (httpPool->callback->evtWakeup(httpPool, fd)) {
+        close(fd);
+        goto OnErrorExit;
+    }
+    httpPool->wakeFd = fd;
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[wakeup-fail] fail to watch pool eventfd, workers results are polled (httpWakeSetup)\n");
+    return -1;
+}
+
+// any thread, results were pushed on a done list
+void httpWakeSignal(httpPoolT *httpPool)
+{
+    uint64_t one = 1;
+    if (httpPool->wakeFd < 0) return;
+
+    ssize_t done = write(httpPool->wakeFd, &one, sizeof(one));
+    (void)done; // EAGAIN means counter is saturated, a wakeup is pending anyway
+}
+
+// called from glue when pool eventfd is readable
+int httpOnWakeupCB(httpPoolT *httpPool)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    uint64_t count;
+
+    // reset counter before collecting, a result pushed meanwhile signals again
+    if (read(httpPool->wakeFd, &count, sizeof(count)) < 0) return 0;
+    httpDnsCollect(httpPool);
+    httpExecCollect(httpPool);
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Persistent TLS session cache. New sessions (TLS1.2 ids or TLS1.3 tickets) are captured from
+ * OpenSSL and saved to a small file encrypted with AES-256-GCM, a restarted process offers them
+ * again on its first handshake toward each upstream and resumes instead of a full handshake.
+ *
+ *  Note: libcurl session export API only exists from 8.12. For older versions OpenSSL SSL_CTX is
+ *  reached through CURLOPT_SSL_CTX_FUNCTION, libcurl own session callback is chained so that its
+ *  in-process cache keeps working. Other TLS backends simply do not persist sessions. libcurl
+ *  creates the SSL handle after SSL_CTX callback, a persisted session is therefore set from the
+ *  info callback when handshake starts: libcurl has already offered its own session if any and
+ *  ClientHello is not built yet (SSL_in_before).
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TLS_FILE_MAGIC "HTTPTLS1"
+#define TLS_KEY_LEN 32
+#define TLS_IV_LEN 12
+#define TLS_TAG_LEN 16
+#define TLS_MAX_SESSIONS 128
+#define TLS_MAX_DER 8192
+#define TLS_SAVE_DELAY_MS 1000
+
+typedef struct
+{
+    char *origin;
+    unsigned char *der;
+    uint32_t derLen;
+    int64_t expires;
+} tlsSessionT;
+
+struct httpTlsS
+{
+    httpPoolT *httpPool;
+    char *path;
+    unsigned char key[TLS_KEY_LEN];
+    tlsSessionT sessions[TLS_MAX_SESSIONS];
+    int count;
+    httpTimerT *saveTimer;
+};
+
+// per connection context attached to libcurl SSL_CTX
+typedef struct
+{
+    httpTlsT *tls;
+    int offered;
+    char origin[];
+} tlsConnT;
+
+typedef int (*tlsNewCbT)(SSL *ssl, SSL_SESSION *sslSession);
+
+static int tlsExIndex = -1;
+static tlsNewCbT tlsCurlNewCb;
+
+static void tlsConnFree(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    free(ptr);
+}
+
+static tlsSessionT *tlsFind(httpTlsT *tls, const char *origin)
+{
+    for (int idx = 0; idx < tls->count; idx++) {
+        if (!strcmp(tls->sessions[idx].origin, origin)) return &tls->sessions[idx];
+    }
+    return NULL;
+}
+
+static void tlsDrop(httpTlsT *tls, tlsSessionT *session)
+{
+    free(session->origin);
+    free(session->der);
+    *session = tls->sessions[--tls->count];
+}
+
+static void tlsPurge(httpTlsT *tls)
+{
+    int64_t now = time(NULL);
+    for (int idx = 0; idx < tls->count;) {
+        if (tls->sessions[idx].expires <= now) tlsDrop(tls, &tls->sessions[idx]);
+        else idx++;
+    }
+}
+
+// serialize then encrypt sessions: magic|iv|tag|ciphertext
+static int tlsSave(httpTlsT *tls)
+{
+    size_t len = 0, index = 0;
+    unsigned char *plain = NULL, *cipher = NULL;
+    EVP_CIPHER_CTX *evp = NULL;
+    char *tmpPath = NULL;
+    int fd = -1, outLen, finLen;
+
+    tlsPurge(tls);
+    for (int idx = 0; idx < tls->count; idx++) len += 14 + strlen(tls->sessions[idx].origin) + tls->sessions[idx].derLen;
+
+    plain = malloc(len + 1);
+    cipher = malloc(strlen(TLS_FILE_MAGIC) + TLS_IV_LEN + TLS_TAG_LEN + len + 1);
+    if (!plain || !cipher) goto OnErrorExit;
+
+    for (int idx = 0; idx < tls->count; idx++) {
+        tlsSessionT *session = &tls->sessions[idx];
+        uint16_t originLen = strlen(session->origin);
+        memcpy(&plain[index], &originLen, 2);
+        memcpy(&plain[index + 2], &session->derLen, 4);
+        memcpy(&plain[index + 6], &session->expires, 8);
+        memcpy(&plain[index + 14], session->origin, originLen);
+        memcpy(&plain[index + 14 + originLen], session->der, session->derLen);
+        index += 14 + originLen + session->derLen;
+    }
+
+    unsigned char *iv = cipher + strlen(TLS_FILE_MAGIC);
+    unsigned char *tag = iv + TLS_IV_LEN;
+    unsigned char *data = tag + TLS_TAG_LEN;
+    memcpy(cipher, TLS_FILE_MAGIC, strlen(TLS_FILE_MAGIC));
+    if (RAND_bytes(iv, TLS_IV_LEN) != 1) goto OnErrorExit;
+
+    evp = EVP_CIPHER_CTX_new();
+    if (!evp || EVP_EncryptInit_ex(evp, EVP_aes_256_gcm(), NULL, tls->key, iv) != 1) goto OnErrorExit;
+    if (EVP_EncryptUpdate(evp, data, &outLen, plain, len) != 1) goto OnErrorExit;
+    if (EVP_EncryptFinal_ex(evp, data + outLen, &finLen) != 1) goto OnErrorExit;
+    if (EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_GET_TAG, TLS_TAG_LEN, tag) != 1) goto OnErrorExit;
+    size_t total = (data - cipher) + outLen + finLen;
+
+    // atomic replace, a crash never leaves a truncated file
+    if (asprintf(&tmpPath, "%s.tmp", tls->path) < 0) {
+        tmpPath = NULL;
+        goto OnErrorExit;
+    }
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || write(fd, cipher, total) != (ssize_t)total) goto OnErrorExit;
+    close(fd);
+    fd = -1;
+    if (rename(tmpPath, tls->path)) goto OnErrorExit;
+
+    if (tls->httpPool->verbose > 1) fprintf(stderr, "-- httpTls: saved sessions=%d path=%s\n", tls->count, tls->path);
+    EVP_CIPHER_CTX_free(evp);
+    free(tmpPath);
+    free(plain);
+    free(cipher);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[tls-cache-save-fail] path=%s error=%s (tlsSave)\n", tls->path, strerror(errno));
+    if (fd >= 0) close(fd);
+    if (tmpPath) unlink(tmpPath);
+    EVP_CIPHER_CTX_free(evp);
+    free(tmpPath);
+    free(plain);
+    free(cipher);
+    return -1;
+}
+
+static void tlsSaveCB(httpPoolT *httpPool, void *ctx)
+{
+    httpTlsT *tls = (httpTlsT *)ctx;
+    tls->saveTimer = NULL;
+    (void)tlsSave(tls);
+}
+
+// decrypt and load sessions, a file that does not authenticate is ignored
+static int tlsLoad(httpTlsT *tls)
+{
+    unsigned char *cipher = NULL, *plain = NULL;
+    EVP_CIPHER_CTX *evp = NULL;
+    struct stat st;
+    size_t headLen = strlen(TLS_FILE_MAGIC) + TLS_IV_LEN + TLS_TAG_LEN;
+    int outLen, finLen;
+
+    int fd = open(tls->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0; // first run
+    if (fstat(fd, &st) || (size_t)st.st_size < headLen) goto OnErrorExit;
+
+    cipher = malloc(st.st_size);
+    plain = malloc(st.st_size);
+    if (!cipher || !plain || read(fd, cipher, st.st_size) != st.st_size) goto OnErrorExit;
+    if (memcmp(cipher, TLS_FILE_MAGIC, strlen(TLS_FILE_MAGIC))) goto OnErrorExit;
+
+    unsigned char *iv = cipher + strlen(TLS_FILE_MAGIC);
+    unsigned char *tag = iv + TLS_IV_LEN;
+    evp = EVP_CIPHER_CTX_new();
+    if (!evp || EVP_DecryptInit_ex(evp, EVP_aes_256_gcm(), NULL, tls->key, iv) != 1) goto OnErrorExit;
+    if (EVP_DecryptUpdate(evp, plain, &outLen, cipher + headLen, st.st_size - headLen) != 1) goto OnErrorExit;
+    if (EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_SET_TAG, TLS_TAG_LEN, tag) != 1) goto OnErrorExit;
+    if (EVP_DecryptFinal_ex(evp, plain + outLen, &finLen) != 1) goto OnErrorExit;
+
+    size_t len = outLen + finLen, index = 0;
+    while (index + 14 <= len && tls->count < TLS_MAX_SESSIONS) {
+        tlsSessionT *session = &tls->sessions[tls->count];
+        uint16_t originLen;
+        memcpy(&originLen, &plain[index], 2);
+        memcpy(&session->derLen, &plain[index + 2], 4);
+        memcpy(&session->expires, &plain[index + 6], 8);
+        if (index + 14 + originLen + session->derLen > len || session->derLen > TLS_MAX_DER) break;
+
+        session->origin = strndup((char *)&plain[index + 14], originLen);
+        session->der = malloc(session->derLen);
+        if (!session->origin || !session->der) {
+            free(session->origin);
+            free(session->der);
+            break;
+        }
+        memcpy(session->der, &plain[index + 14 + originLen], session->derLen);
+        index += 14 + originLen + session->derLen;
+        tls->count++;
+    }
+    tlsPurge(tls);
+
+    if (tls->httpPool->verbose) fprintf(stderr, "-- httpTls: loaded sessions=%d path=%s\n", tls->count, tls->path);
+    EVP_CIPHER_CTX_free(evp);
+    free(cipher);
+    free(plain);
+    close(fd);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[tls-cache-invalid] ignoring unreadable or tampered file path=%s (tlsLoad)\n", tls->path);
+    EVP_CIPHER_CTX_free(evp);
+    free(cipher);
+    free(plain);
+    close(fd);
+    return -1;
+}
+
+// OpenSSL callback, store new session then hand it over to libcurl in-process cache
+static int tlsNewSessionCB(SSL *ssl, SSL_SESSION *sslSession)
+{
+    tlsConnT *conn = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tlsExIndex);
+
+    if (conn && SSL_SESSION_is_resumable(sslSession)) {
+        httpTlsT *tls = conn->tls;
+        int derLen = i2d_SSL_SESSION(sslSession, NULL);
+        unsigned char *der = (derLen > 0 && derLen <= TLS_MAX_DER) ? malloc(derLen) : NULL;
+
+        if (der) {
+            unsigned char *cursor = der;
+            i2d_SSL_SESSION(sslSession, &cursor);
+
+            tlsSessionT *session = tlsFind(tls, conn->origin);
+            if (!session && tls->count == TLS_MAX_SESSIONS) tlsPurge(tls);
+            if (!session && tls->count == TLS_MAX_SESSIONS) tlsDrop(tls, &tls->sessions[0]);
+            if (!session) {
+                session = &tls->sessions[tls->count];
+                session->origin = strdup(conn->origin);
+                if (session->origin) tls->count++;
+            } else {
+                free(session->der);
+            }
+
+            if (session->origin) {
+                session->der = der;
+                session->derLen = derLen;
+                session->expires = (int64_t)SSL_SESSION_get_time(sslSession) + SSL_SESSION_get_timeout(sslSession);
+                tls->httpPool->stats.tlsStored++;
+                if (!tls->saveTimer) tls->saveTimer = httpTimerAdd(tls->httpPool, TLS_SAVE_DELAY_MS, tlsSaveCB, tls);
+            } else {
+                free(der);
+            }
+        }
+    }
+    return tlsCurlNewCb ? tlsCurlNewCb(ssl, sslSession) : 0;
+}
+
+// offer a persisted session when libcurl has none for this connection, count resumption outcome
+static void tlsInfoCB(const SSL *ssl, int where, int ret)
+{
+    tlsConnT *conn = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tlsExIndex);
+    if (!conn) return;
+
+    // only before first ClientHello, never on renegotiation or TLS1.3 post-handshake messages
+    if ((where & SSL_CB_HANDSHAKE_START) && !conn->offered && SSL_in_before(ssl) && !SSL_get_session(ssl)) {
+        tlsSessionT *session = tlsFind(conn->tls, conn->origin);
+        if (!session || session->expires <= time(NULL)) return;
+
+        const unsigned char *cursor = session->der;
+        SSL_SESSION *sslSession = d2i_SSL_SESSION(NULL, &cursor, session->derLen);
+        if (!sslSession) return;
+        if (SSL_set_session((SSL *)ssl, sslSession) == 1) conn->offered = 1;
+        SSL_SESSION_free(sslSession);
+    }
+
+    if ((where & SSL_CB_HANDSHAKE_DONE) && conn->offered == 1) {
+        conn->offered = 2;
+        if (SSL_session_reused((SSL *)ssl)) conn->tls->httpPool->stats.tlsHits++;
+        else conn->tls->httpPool->stats.tlsMisses++;
+        if (conn->tls->httpPool->verbose > 1) fprintf(stderr, "-- httpTls: origin=%s resumed=%d\n", conn->origin, SSL_session_reused((SSL *)ssl));
+    }
+}
+
+// libcurl CURLOPT_SSL_CTX_FUNCTION, called once per new connection
+static CURLcode tlsCtxCB(CURL *easy, void *sslCtx, void *ctx)
+{
+    httpTlsT *tls = (httpTlsT *)ctx;
+    SSL_CTX *sslContext = (SSL_CTX *)sslCtx;
+    char origin[DFLT_HEADER_MAX_LEN];
+    char *url = NULL;
+
+    curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+    if (!url || httpUrlOrigin(url, origin, sizeof(origin))) return CURLE_OK;
+
+    tlsConnT *conn = calloc(1, sizeof(tlsConnT) + strlen(origin) + 1);
+    if (!conn) return CURLE_OK;
+    conn->tls = tls;
+    strcpy(conn->origin, origin);
+    SSL_CTX_set_ex_data(sslContext, tlsExIndex, conn);
+
+    // keep libcurl callback (same static function for every connection)
+    tlsNewCbT curlNewCb = SSL_CTX_sess_get_new_cb(sslContext);
+    if (curlNewCb != tlsNewSessionCB) tlsCurlNewCb = curlNewCb;
+    SSL_CTX_set_session_cache_mode(sslContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(sslContext, tlsNewSessionCB);
+    SSL_CTX_set_info_callback(sslContext, tlsInfoCB);
+    return CURLE_OK;
+}
+
+// attach persistent TLS session hooks to an https request
+void httpTlsSetup(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    if (!httpPool->tls || strncasecmp(httpRqt->url, "https:", 6)) return;
+    curl_easy_setopt(httpRqt->easy, CURLOPT_SSL_CTX_FUNCTION, tlsCtxCB);
+    curl_easy_setopt(httpRqt->easy, CURLOPT_SSL_CTX_DATA, httpPool->tls);
+}
+
+// read key file or create a random one (only owner may read it)
+static int tlsKeyLoad(httpTlsT *tls, const char *keyPath)
+{
+    int fd = open(keyPath, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t len = read(fd, tls->key, TLS_KEY_LEN);
+        close(fd);
+        return (len == TLS_KEY_LEN) ? 0 : -1;
+    }
+    if (errno != ENOENT || RAND_bytes(tls->key, TLS_KEY_LEN) != 1) return -1;
+
+    fd = open(keyPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    ssize_t len = write(fd, tls->key, TLS_KEY_LEN);
+    close(fd);
+    return (len == TLS_KEY_LEN) ? 0 : -1;
+}
+
+int httpPoolSetTlsCache(httpPoolT *httpPool, const char *path, const char *keyPath)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpTlsT *tls = NULL;
+
+    if (httpPool->tls || !path || !keyPath) goto OnErrorExit;
+    const char *backend = curl_version_info(CURLVERSION_NOW)->ssl_version;
+    if (!backend || !strcasestr(backend, "OpenSSL")) {
+        fprintf(stderr, "[tls-cache-unsupported] libcurl tls backend=%s is not OpenSSL (httpPoolSetTlsCache)\n", backend);
+        goto OnErrorExit;
+    }
+
+    if (tlsExIndex < 0) tlsExIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, tlsConnFree);
+    if (tlsExIndex < 0) goto OnErrorExit;
+
+    tls = calloc(1, sizeof(httpTlsT));
+    if (!tls) goto OnErrorExit;
+    tls->httpPool = httpPool;
+    tls->path = strdup(path);
+    if (!tls->path) goto OnErrorExit;
+
+    if (tlsKeyLoad(tls, keyPath)) {
+        fprintf(stderr, "[tls-cache-key-fail] cannot read or create %d bytes key path=%s (httpPoolSetTlsCache)\n", TLS_KEY_LEN, keyPath);
+        goto OnErrorExit;
+    }
+    (void)tlsLoad(tls);
+    httpPool->tls = tls;
+    return 0;
+
+OnErrorExit:
+    if (tls) {
+        OPENSSL_cleanse(tls->key, sizeof(tls->key));
+        free(tls->path);
+        free(tls);
+    }
+    return -1;
+}
+
+// flush pending sessions now (ie: before exit)
+int httpPoolTlsCacheSave(httpPoolT *httpPool)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpTlsT *tls = httpPool->tls;
+    if (!tls) return -1;
+
+    if (tls->saveTimer) {
+        httpTimerCancel(httpPool, tls->saveTimer);
+        tls->saveTimer = NULL;
+    }
+    return tlsSave(tls);
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2021 "IoT.bzh"
+ * Author "Fulup Ar Foll" <fulup@iot.bzh>
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at https://opensource.org/licenses/MIT.
+ * $RP_END_LICENSE$
+ *
+ * Upstream groups. Requests to "upstream://name/path" go to one replica base url of group
+ * 'name', picked when request really goes to network (cache keeps logical url). Selection is
+ * either least outstanding requests, lowest EWMA latency weighted by outstanding requests, or
+ * power of two random choices. Replicas whose recent error rate (libcurl errors and 5xx) goes
+ * over threshold are ejected for a delay doubling on each ejection, never more than half of
+ * a group at once. Ejected replicas come back once delay expires, no timer is needed.
+ */
+
+#define _GNU_SOURCE
+
+#include "http-client.h"
+#include "http-private.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UPSTREAM_SCHEME "upstream://"
+#define UPSTREAM_WINDOW 20      // outcomes kept per replica
+#define UPSTREAM_MIN_SAMPLES 5
+#define UPSTREAM_EJECT_PERCENT 50
+#define UPSTREAM_EJECT_MS 5000
+#define UPSTREAM_EJECT_MAX_MS 60000
+#define UPSTREAM_EWMA_ALPHA 0.3
+
+struct httpReplicaS
+{
+    char *url;
+    long outstanding;
+    double ewma;
+    int warm;
+    uint32_t outcomes; // failure bits, last outcome in bit 0
+    int samples;
+    int ejections;
+    uint64_t ejectedUntil;
+    uint64_t requests;
+    uint64_t failures;
+};
+
+struct httpUpstreamS
+{
+    httpUpstreamT *next;
+    httpLbModeT mode;
+    int count;
+    unsigned int rr;
+    char *name;
+    httpReplicaT replicas[];
+};
+
+static httpUpstreamT *upstreamFind(httpPoolT *httpPool, const char *name, size_t len)
+{
+    for (httpUpstreamT *group = httpPool->upstreams; group; group = group->next) {
+        if (strlen(group->name) == len && !strncmp(group->name, name, len)) return group;
+    }
+    return NULL;
+}
+
+static int replicaFailRate(httpReplicaT *replica)
+{
+    if (replica->samples < UPSTREAM_MIN_SAMPLES) return 0;
+    return __builtin_popcount(replica->outcomes) * 100 / replica->samples;
+}
+
+// ewma latency weighted by queue, an idle slow replica still competes with a busy fast one
+static double replicaCost(httpUpstreamT *group, httpReplicaT *replica)
+{
+    if (group->mode == HTTP_LB_EWMA) return (replica->ewma + 1.0) * (replica->outstanding + 1);
+    return (double)replica->outstanding;
+}
+
+static httpReplicaT *upstreamSelect(httpPoolT *httpPool, httpUpstreamT *group)
+{
+    httpReplicaT *healthy[group->count];
+    int count = 0;
+    uint64_t now = httpNowMs();
+
+    for (int idx = 0; idx < group->count; idx++) {
+        if (group->replicas[idx].ejectedUntil <= now) healthy[count++] = &group->replicas[idx];
+    }
+    if (!count) {
+        for (int idx = 0; idx < group->count; idx++) healthy[count++] = &group->replicas[idx];
+    }
+
+    if (group->mode == HTTP_LB_P2C && count > 1) {
+        int first = rand_r(&httpPool->seed) % count;
+        int second = rand_r(&httpPool->seed) % (count - 1);
+        if (second >= first) second++;
+        return replicaCost(group, healthy[second]) < replicaCost(group, healthy[first]) ? healthy[second] : healthy[first];
+    }
+
+    // rotating start spreads ties
+    unsigned int start = group->rr++;
+    httpReplicaT *best = healthy[start % count];
+    for (int idx = 1; idx < count; idx++) {
+        httpReplicaT *replica = healthy[(start + idx) % count];
+        if (replicaCost(group, replica) < replicaCost(group, best)) best = replica;
+    }
+    return best;
+}
+
+static void replicaEject(httpPoolT *httpPool, httpUpstreamT *group, httpReplicaT *replica)
+{
+    uint64_t now = httpNowMs();
+    int ejected = 0;
+
+    for (int idx = 0; idx < group->count; idx++) {
+        if (group->replicas[idx].ejectedUntil > now) ejected++;
+    }
+    if ((ejected + 1) * 100 > group->count * UPSTREAM_EJECT_PERCENT) return;
+
+    long delay = UPSTREAM_EJECT_MS << (replica->ejections < 4 ? replica->ejections : 4);
+    if (delay > UPSTREAM_EJECT_MAX_MS) delay = UPSTREAM_EJECT_MAX_MS;
+    replica->ejectedUntil = now + delay;
+    replica->ejections++;
+    replica->outcomes = 0;
+    replica->samples = 0;
+    httpPool->stats.ejections++;
+    fprintf(stderr, "[upstream-eject] group=%s replica=%s delay=%ldms (replicaEject)\n", group->name, replica->url, delay);
+}
+
+// pick a replica for an upstream:// url, return real url within request scratch or NULL
+const char *httpUpstreamPick(httpPoolT *httpPool, httpRqtT *httpRqt, const char *url)
+{
+    const char *name = url + strlen(UPSTREAM_SCHEME);
+    size_t len = strcspn(name, "/?#");
+    const char *path = name + len;
+
+    httpUpstreamT *group = upstreamFind(httpPool, name, len);
+    if (!group) goto OnErrorExit;
+
+    httpReplicaT *replica = upstreamSelect(httpPool, group);
+    char *real = httpRqtScratch(httpRqt, strlen(replica->url) + strlen(path) + 2);
+    if (!real) goto OnErrorExit;
+    sprintf(real, "%s%s%s", replica->url, (*path && *path != '/') ? "/" : "", path);
+
+    replica->outstanding++;
+    replica->requests++;
+    httpRqt->upstream = group;
+    httpRqt->lbReplica = replica;
+    httpRqt->replica = replica->url;
+    if (httpPool->verbose > 1) fprintf(stderr, "-- httpUpstream: group=%s outstanding=%ld url=%s\n", group->name, replica->outstanding, real);
+    return real;
+
+OnErrorExit:
+    fprintf(stderr, "[upstream-unknown] no upstream group for url=%s (httpUpstreamPick)\n", url);
+    return NULL;
+}
+
+int httpUpstreamIs(const char *url)
+{
+    return !strncasecmp(url, UPSTREAM_SCHEME, strlen(UPSTREAM_SCHEME));
+}
+
+// request is over, feed replica latency and error rate
+void httpUpstreamDone(httpPoolT *httpPool, httpRqtT *httpRqt)
+{
+    httpReplicaT *replica = httpRqt->lbReplica;
+    httpUpstreamT *group = httpRqt->upstream;
+    if (!replica) return;
+    httpRqt->lbReplica = NULL;
+    replica->outstanding--;
+
+    // cancelled or never sent, says nothing about replica health
+    if (httpRqt->status <= 0) return;
+
+    int failed = (httpRqt->status < 100 || httpRqt->status >= 500);
+    replica->outcomes = (replica->outcomes << 1) | failed;
+    replica->outcomes &= (1U << UPSTREAM_WINDOW) - 1;
+    if (replica->samples < UPSTREAM_WINDOW) replica->samples++;
+    if (failed) replica->failures++;
+    else if (!replica->warm++) replica->ewma = (double)httpRqt->msTime;
+    else replica->ewma += UPSTREAM_EWMA_ALPHA * ((double)httpRqt->msTime - replica->ewma);
+
+    if (failed && replicaFailRate(replica) >= UPSTREAM_EJECT_PERCENT) replicaEject(httpPool, group, replica);
+}
+
+int httpPoolAddUpstream(httpPoolT *httpPool, const char *name, const char *urls[], int count, httpLbModeT mode)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpUpstreamT *group = NULL;
+
+    if (!name || !*name || strcspn(name, "/?#") != strlen(name) || count <= 0 || !urls || mode < 0 || mode > HTTP_LB_P2C) goto OnErrorExit;
+    if (upstreamFind(httpPool, name, strlen(name))) goto OnErrorExit;
+
+    group = calloc(1, sizeof(httpUpstreamT) + count * sizeof(httpReplicaT));
+    if (!group || !(group->name = strdup(name))) goto OnErrorExit;
+    group->mode = mode;
+    for (int idx = 0; idx < count; idx++) {
+        // base url without trailing '/'
+        size_t len = strlen(urls[idx]);
+        while (len && urls[idx][len - 1] == '/') len--;
+        if (!len || !(group->replicas[idx].url = strndup(urls[idx], len))) goto OnErrorExit;
+        group->count++;
+    }
+
+    group->next = httpPool->upstreams;
+    httpPool->upstreams = group;
+    if (httpPool->verbose) fprintf(stderr, "-- httpUpstream: group=%s replicas=%d mode=%d\n", name, count, mode);
+    return 0;
+
+OnErrorExit:
+    fprintf(stderr, "[upstream-invalid] name=%s count=%d duplicated or invalid group (httpPoolAddUpstream)\n", name ? name : "(null)", count);
+    if (group) {
+        for (int idx = 0; idx < group->count; idx++) free(group->replicas[idx].url);
+        free(group->name);
+        free(group);
+    }
+    return -1;
+}
+
+int httpPoolUpstreamStats(httpPoolT *httpPool, const char *name, httpReplicaStatsT *stats, int max)
+{
+    assert(httpPool->magic == MAGIC_HTTP_POOL);
+    httpUpstreamT *group = name ? upstreamFind(httpPool, name, strlen(name)) : NULL;
+    uint64_t now = httpNowMs();
+
+    if (!group) return -1;
+    for (int idx = 0; idx < group->count && idx < max; idx++) {
+        httpReplicaT *replica = &group->replicas[idx];
+        stats[idx].url = replica->url;
+        stats[idx].outstanding = replica->outstanding;
+        stats[idx].ewmaMs = replica->ewma;
+        stats[idx].requests = replica->requests;
+        stats[idx].failures = replica->failures;
+        stats[idx].failRate = replicaFailRate(replica);
+        stats[idx].ejected = replica->ejectedUntil > now;
+    }
+    return group->count;
+}
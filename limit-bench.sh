@@ -0,0 +1,53 @@
+#!/bin/bash
+# Adaptive concurrency benchmark against a local saturating upstream.
+# Upstream serves 4 requests at a time (10ms each) and answers 503 when more than 24 are waiting,
+# batch-client then runs the same url file without limiter, with AIMD and with gradient limiter.
+
+DIRNAME=`dirname $0`
+COUNT=${1:-300}
+PORT=${2:-8183}
+TMPDIR=`mktemp -d`
+
+if ! test -x $DIRNAME/build/batch-client; then
+    echo "syntax: $0 [count(300)] [port(8183)] (build first with 'make MAIN_LOOP=epoll|systemd|libuv')"
+    exit 1
+fi
+
+cat > $TMPDIR/upstream.py <<'EOF'
+import http.server, socketserver, sys, threading, time
+workers = threading.Semaphore(4); waiting = [0]; lock = threading.Lock()
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    disable_nagle_algorithm = True
+    def log_message(self, *args): pass
+    def do_GET(self):
+        with lock: waiting[0] += 1; depth = waiting[0]
+        try:
+            if depth > 24: self.send_response(503)
+            else:
+                with workers: time.sleep(0.01)
+                self.send_response(200)
+        finally:
+            with lock: waiting[0] -= 1
+        self.send_header('Content-Length', '3'); self.end_headers(); self.wfile.write(b'ok\n')
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024
+Server(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()
+EOF
+
+python3 $TMPDIR/upstream.py $PORT &
+SERVER=$!
+trap "kill $SERVER; rm -rf $TMPDIR" EXIT
+sleep 0.5
+
+for IDX in `seq 1 $COUNT`; do echo "http://127.0.0.1:$PORT/rqt-$IDX"; done > $TMPDIR/urls
+
+for MODE in none aimd gradient; do
+    LIMIT=""
+    test $MODE != none && LIMIT="-l $MODE"
+    $DIRNAME/build/batch-client $LIMIT -f $TMPDIR/urls 2> $TMPDIR/log-$MODE
+    ERRORS=`grep -c "request-error" $TMPDIR/log-$MODE`
+    ELAPSED=`grep -o "elapsed=[0-9.]*s" $TMPDIR/log-$MODE`
+    echo "limiter=$MODE requests=$COUNT errors=$ERRORS $ELAPSED"
+done